@@ -0,0 +1,595 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: BMP280Driver_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * Below is a driver for the BMP280 sensor running over SPI1.
+ * The calibration block (0x88 - 0x9F) and the data block (0xF7 - 0xFC) are both read out in one burst each, using the auto-increment of the BMP280.
+ * This replaces the register-by-register readout we had in main.c, where every single byte cost a CS toggle, an SPE toggle and a 100 us delay.
+ *
+ * Example:
+ *    BMP280 sensor;
+ *    BMP280Sample sample;
+ *    BMP280Init(&sensor, GPIOB, 6);										//CS on PB6, SPI1 must already be initialised
+ *    BMP280ReadCalibration(&sensor);
+ *    BMP280ReadSample(&sensor, &sample);									//sample.temperature is in 0.01 degC
+ *
+ * v.1.1
+ * BMP280Configure writes ctrl_meas and config within one CS assertion and one SPI session.
+ * BMP280ReadSample keeps the bus in one session as well.
+ *
+ * v.1.2
+ * BMP280WaitReady polls the status register instead of a fixed delay. It waits only until the selected status bits (measuring and/or im_update) are cleared.
+ * The time spent waiting is returned and summed up in the sensor's ready_wait_us.
+ *
+ * v.1.3
+ * Full fixed point compensation: temperature, t_fine and the 64-bit integer pressure formula from the datasheet.
+ * The compensation works on the cached calibration struct, which also holds a few pre-shifted calibration terms.
+ * BMP280CompensateBatch compensates an array of raw samples in one pass. Since the M0+ has no hardware divide, the batch path:
+ * - reuses the t_fine dependent pressure terms if t_fine did not change from the previous sample
+ * - replaces the 64/64-bit library division with a 64/32-bit one whenever the quotient is known to fit 32 bits (always the case for valid readouts)
+ * The results are bit-exact with the datasheet formulas.
+ *
+ * v.1.4
+ * BMP280StartReadDMA starts the data block readout using the SPI DMA mode. The raw block can then be parsed with BMP280ParseData (e.g. in the callback).
+ *
+ * v.1.5
+ * The calibration and the sample readouts return the SPI1 status. On an error, the calibration/sample is left as it was.
+ * BMP280WaitReady treats a failed status read as "not ready", so it runs into its own timeout instead of returning early.
+ *
+ * v.1.6
+ * Calibration cache in the data EEPROM. BMP280LoadCalibration reloads the calibration from the EEPROM without any SPI traffic, if the cache is valid:
+ * - the magic word is there
+ * - the chip ID stored with the calibration matches the one given (read out from the sensor at startup)
+ * - the checksum (Fletcher-32) over the record matches
+ * Otherwise the calibration block is read from the sensor and the cache is written again.
+ * Note: all BMP280s have the same chip ID (0x58), so swapping to another BMP280 is not detected. BMP280InvalidateCalibrationCache forces a new readout.
+ *
+ * v.1.7
+ * Shadow copy of the configuration registers (ctrl_meas and config) with dirty tracking.
+ * Fields are changed locally with BMP280ShadowSet, no SPI traffic. BMP280ShadowFlush then writes only the registers that differ from what the sensor holds, all within one CS assertion.
+ * Setting a field to the value it already has costs nothing, and changing one field never needs a read-modify-write over SPI.
+ * What the sensor holds is known after a reset (all 0x00), after a flush and after BMP280ShadowLoad. Until then, every register is dirty.
+ * Forced mode: the sensor goes back to sleep mode after the conversion, so the mode bits are stored as sleep. Triggering the next conversion is therefore never skipped.
+ * BMP280Configure and BMP280WriteCtrlMeas go through the shadow.
+ *
+ * v.1.8
+ * BMP280ReadID returns 0 (not a valid ID) if the ID register could not be read.
+ * BMP280Reset returns the SPI1 status. The shadow is only marked as known if the reset was sent, otherwise every register stays dirty.
+ *
+ */
+
+#include "BMP280Driver_STM32L0x3.h"
+
+//1) Store the sensor's CS
+void BMP280Init (BMP280* sensor, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_pin_number_SPI) {
+	/*
+	 * We set up the device handle of the sensor on the bus.
+	 * The BMP280 works in SPIMODE0 (or SPIMODE3) with 8-bit frames, up to 10 MHz SCK. We run it at APB2/2.
+	 * Note: SPI1MasterInit must be called separately.
+	 *
+	 * */
+
+	SPI1DeviceInit(&sensor->device, gpio_port_SPI, gpio_pin_number_SPI, SPIMODE0, SPI1_FRAME_8BIT, SPI1_BAUD_DIV2);
+	sensor->ready_wait_us = 0;
+	sensor->shadow_known = 0;
+	sensor->shadow_touched = 0;
+	sensor->writes_skipped = 0;
+	sensor->calib_from_cache = 0;
+}
+
+
+//2) Read the chip ID
+uint8_t BMP280ReadID (BMP280* sensor) {
+	/*
+	 * The ID register should give back 0x58 for a BMP280.
+	 * If the SPI read fails, we give back 0.
+	 *
+	 * */
+
+	uint8_t chip_id = 0;
+	if (SPI1DeviceRead(&sensor->device, BMP280_REG_ID, &chip_id, 1)) return 0;
+	return chip_id;
+}
+
+
+//3) Reset the sensor
+uint8_t BMP280Reset (BMP280* sensor) {
+	/*
+	 * Writing 0xB6 to the reset register resets the sensor.
+	 * Note: writing is with the MSB of the address being 0.
+	 * If the write fails, we don't know what the sensor holds, so the whole shadow becomes dirty.
+	 *
+	 * */
+
+	uint8_t reset_value = 0xB6;
+	uint8_t error = SPI1DeviceWrite(&sensor->device, (BMP280_REG_RESET & 0x7F), &reset_value, 1);
+	if (error) {
+		sensor->shadow_known = 0;
+		return error;
+	}
+	SPI1DeviceHoldOff(&sensor->device, 100);								//we give the sensor some time before we poll its status
+
+	for (uint8_t i = 0; i < BMP280_SHADOW_REGS; i++) {
+		sensor->shadow[i] = 0x00;											//reset values of ctrl_meas and config
+		sensor->written[i] = 0x00;
+	}
+	sensor->shadow_known = (1<<BMP280_SHADOW_REGS) - 1;
+	sensor->shadow_touched = 0;
+	return SPI1_OK;
+}
+
+
+//4) Set the measurement control
+void BMP280WriteCtrlMeas (BMP280* sensor, uint8_t ctrl_meas) {
+	/*
+	 * The ctrl_meas register holds the temperature oversampling [7:5], the pressure oversampling [4:2] and the power mode [1:0].
+	 * 0x27 is the standard function: x1 oversampling on both, normal mode.
+	 * The write is skipped if the sensor already holds ctrl_meas (see BMP280ShadowFlush).
+	 *
+	 * */
+
+	BMP280ShadowSet(sensor, BMP280_SHADOW_CTRL_MEAS, 0xFF, ctrl_meas);
+	BMP280ShadowFlush(sensor);
+}
+
+
+//5) Parse the calibration block
+void BMP280ParseCalibration (BMP280Calib* calib, uint8_t *calib_block) {
+	/*
+	 * What happens here?
+	 * The calibration parameters are stored as 16-bit little endian values from 0x88 onwards: LSB first, MSB second.
+	 * T1 and P1 are unsigned, the rest are signed.
+	 *
+	 * */
+
+	calib->dig_T1 = (uint16_t) ((calib_block[1] << 8) | calib_block[0]);
+	calib->dig_T2 = (int16_t) ((calib_block[3] << 8) | calib_block[2]);
+	calib->dig_T3 = (int16_t) ((calib_block[5] << 8) | calib_block[4]);
+	calib->dig_P1 = (uint16_t) ((calib_block[7] << 8) | calib_block[6]);
+	calib->dig_P2 = (int16_t) ((calib_block[9] << 8) | calib_block[8]);
+	calib->dig_P3 = (int16_t) ((calib_block[11] << 8) | calib_block[10]);
+	calib->dig_P4 = (int16_t) ((calib_block[13] << 8) | calib_block[12]);
+	calib->dig_P5 = (int16_t) ((calib_block[15] << 8) | calib_block[14]);
+	calib->dig_P6 = (int16_t) ((calib_block[17] << 8) | calib_block[16]);
+	calib->dig_P7 = (int16_t) ((calib_block[19] << 8) | calib_block[18]);
+	calib->dig_P8 = (int16_t) ((calib_block[21] << 8) | calib_block[20]);
+	calib->dig_P9 = (int16_t) ((calib_block[23] << 8) | calib_block[22]);
+
+	calib->dig_T1_x2 = ((int32_t)calib->dig_T1) << 1;						//constant terms of the compensation formulas
+	calib->dig_P4_x2e35 = ((int64_t)calib->dig_P4) << 35;
+	calib->dig_P7_x16 = ((int32_t)calib->dig_P7) << 4;
+}
+
+
+//6) Read the calibration block
+uint8_t BMP280ReadCalibration (BMP280* sensor) {
+	/*
+	 * We read all 24 calibration bytes in one go and then parse them.
+	 * The calibration values are factory constants, so this is necessary only once.
+	 *
+	 * */
+
+	uint8_t calib_block[BMP280_CALIB_LENGTH];
+	uint8_t error = SPI1DeviceRead(&sensor->device, BMP280_REG_CALIB, calib_block, BMP280_CALIB_LENGTH);
+	if (error) return error;
+	BMP280ParseCalibration(&sensor->calib, calib_block);
+	return SPI1_OK;
+}
+
+
+//6a) Checksum of the calibration cache record
+static uint32_t BMP280CacheChecksum (uint32_t* record) {
+	/*
+	 * What happens here?
+	 * Fletcher-32 over all but the last word of the record, taken as 16-bit halves.
+	 * Unlike a plain sum, it also catches words that were swapped or bytes that moved.
+	 *
+	 * */
+
+	uint32_t sum1 = 0xFFFF;
+	uint32_t sum2 = 0xFFFF;
+	for (uint8_t i = 0; i < (BMP280_CALIB_CACHE_WORDS - 1); i++) {
+		sum1 += record[i] & 0xFFFF;
+		sum2 += sum1;
+		sum1 += record[i] >> 16;
+		sum2 += sum1;
+		sum1 = (sum1 & 0xFFFF) + (sum1 >> 16);
+		sum2 = (sum2 & 0xFFFF) + (sum2 >> 16);
+	}
+	sum1 = (sum1 & 0xFFFF) + (sum1 >> 16);
+	sum2 = (sum2 & 0xFFFF) + (sum2 >> 16);
+	return (sum2 << 16) | sum1;
+}
+
+
+//6b) Load the calibration from the cache or the sensor
+uint8_t BMP280LoadCalibration (BMP280* sensor, uint8_t chip_id) {
+	/*
+	 * What happens here?
+	 * The record is: magic, chip ID, the 24 calibration bytes packed little endian into 6 words, checksum.
+	 * If the record in the EEPROM is valid for this chip ID, we parse the calibration from it and we are done - no SPI transaction at all.
+	 * If not, we read the calibration block from the sensor, parse it and store the record.
+	 * A failed EEPROM write is not an error for the sensor: the calibration is still valid, we just read it out again at the next startup.
+	 * Returns the SPI1 status (SPI1_OK for a cache hit).
+	 *
+	 * */
+
+	uint32_t record[BMP280_CALIB_CACHE_WORDS];
+	uint8_t* calib_block = (uint8_t*) &record[2];							//little endian, so the words hold the bytes in order
+
+	NVMEEPROMRead(BMP280_CALIB_CACHE_ADDRESS, record, BMP280_CALIB_CACHE_WORDS);
+
+	if ((record[0] == BMP280_CALIB_CACHE_MAGIC) && (record[1] == chip_id) && (record[BMP280_CALIB_CACHE_WORDS - 1] == BMP280CacheChecksum(record))) {
+		BMP280ParseCalibration(&sensor->calib, calib_block);
+		sensor->calib_from_cache = 1;
+		return SPI1_OK;
+	}
+
+	uint8_t error = SPI1DeviceRead(&sensor->device, BMP280_REG_CALIB, calib_block, BMP280_CALIB_LENGTH);
+	if (error) return error;
+	BMP280ParseCalibration(&sensor->calib, calib_block);
+	sensor->calib_from_cache = 0;
+
+	record[0] = BMP280_CALIB_CACHE_MAGIC;
+	record[1] = chip_id;
+	record[BMP280_CALIB_CACHE_WORDS - 1] = BMP280CacheChecksum(record);
+	NVMEEPROMWrite(BMP280_CALIB_CACHE_ADDRESS, record, BMP280_CALIB_CACHE_WORDS);
+
+	return SPI1_OK;
+}
+
+
+//6c) Invalidate the calibration cache
+uint8_t BMP280InvalidateCalibrationCache (void) {
+	/*
+	 * Only the magic word is cleared. The next BMP280LoadCalibration reads the sensor again.
+	 *
+	 * */
+
+	uint32_t blank = 0;
+	return NVMEEPROMWrite(BMP280_CALIB_CACHE_ADDRESS, &blank, 1);
+}
+
+
+//7) Read out and compensate one sample
+uint8_t BMP280ReadSample (BMP280* sensor, BMP280Sample* sample) {
+	/*
+	 * What happens here?
+	 * We read the pressure (0xF7 - 0xF9) and the temperature (0xFA - 0xFC) in one burst.
+	 * Both are 20-bit values stored as MSB, LSB and XLSB with the XLSB having the data in [7:4].
+	 * Reading them in one burst also ensures that they are from the same measurement (the sensor locks the data registers while the burst is ongoing).
+	 *
+	 * */
+
+	uint8_t data_block[BMP280_DATA_LENGTH];
+	uint8_t error = SPI1SessionBegin(&sensor->device);
+	if (error) return error;
+	SPI1SessionSelect();
+	error = SPI1SessionRead(BMP280_REG_DATA, data_block, BMP280_DATA_LENGTH);
+	SPI1SessionEnd();
+	if (error) return error;
+
+	BMP280ParseData(data_block, &sample->adc_P, &sample->adc_T);
+
+	int32_t t_fine = BMP280CompensateTFine(&sensor->calib, sample->adc_T);
+	sample->temperature = (t_fine * 5 + 128) >> 8;
+	sample->pressure = BMP280CompensatePressure(&sensor->calib, sample->adc_P, t_fine);
+	return SPI1_OK;
+}
+
+
+//8) BMP280 t_fine calculation
+int32_t BMP280CompensateTFine (BMP280Calib* calib, int32_t adc_T) {
+	/*
+	 * This is the formula from the datasheet. t_fine is the fine resolution temperature that is used for both the temperature and the pressure.
+	 *
+	 * */
+
+	int32_t var1, var2;
+
+	var1 = (((adc_T >> 3) - calib->dig_T1_x2) * ((int32_t)calib->dig_T2)) >> 11;
+	var2 = (((((adc_T >> 4) - ((int32_t)calib->dig_T1)) * ((adc_T >> 4) - ((int32_t)calib->dig_T1))) >> 12) * ((int32_t)calib->dig_T3)) >> 14;
+
+	return var1 + var2;
+}
+
+
+//9) BMP280 temperature compensation calculation for fixed point results
+int32_t BMP280CompensateTemperature (BMP280Calib* calib, int32_t adc_T) {
+	/*
+	 * The result is in 0.01 degC.
+	 *
+	 * */
+
+	return (BMP280CompensateTFine(calib, adc_T) * 5 + 128) >> 8;
+}
+
+
+//10) Pressure terms that only depend on t_fine
+static void BMP280PressureTerms (BMP280Calib* calib, int32_t t_fine, int64_t* divisor, int64_t* offset) {
+	/*
+	 * This is the first half of the datasheet's 64-bit pressure formula.
+	 * divisor is "var1" and offset is "var2" in the datasheet.
+	 *
+	 * */
+
+	int64_t var1, var2;
+
+	var1 = ((int64_t)t_fine) - 128000;
+	var2 = var1 * var1 * (int64_t)calib->dig_P6;
+	var2 = var2 + ((var1 * (int64_t)calib->dig_P5) << 17);
+	var2 = var2 + calib->dig_P4_x2e35;
+	var1 = ((var1 * var1 * (int64_t)calib->dig_P3) >> 8) + ((var1 * (int64_t)calib->dig_P2) << 12);
+	var1 = (((((int64_t)1) << 47) + var1) * ((int64_t)calib->dig_P1)) >> 33;
+
+	*divisor = var1;
+	*offset = var2;
+}
+
+
+//11) 64/32-bit division
+static uint32_t BMP280Divide (uint64_t numerator, uint32_t divisor) {
+	/*
+	 * What happens here?
+	 * Shift-and-subtract division for a 32-bit quotient. The M0+ has no divide instruction at all, and the library's 64/64-bit division is generic (and slow).
+	 * We only need 32 steps since we know that the quotient fits 32 bits (checked by the caller).
+	 *
+	 * */
+
+	uint32_t quotient = 0;
+	uint64_t shifted_divisor = ((uint64_t)divisor) << 31;
+
+	for (uint8_t i = 0; i < 32; i++) {
+		quotient <<= 1;
+		if (numerator >= shifted_divisor) {
+			numerator -= shifted_divisor;
+			quotient |= 1;
+		}
+		shifted_divisor >>= 1;
+	}
+
+	return quotient;
+}
+
+
+//12) Second half of the pressure calculation
+static uint32_t BMP280PressureFromTerms (BMP280Calib* calib, int32_t adc_P, int64_t divisor, int64_t offset) {
+	/*
+	 * The second half of the datasheet's 64-bit pressure formula.
+	 * The division is done in 64/32 bits when the divisor and the quotient both fit 32 bits, otherwise we fall back to the generic 64-bit division.
+	 *
+	 * */
+
+	int64_t p, var1, var2, numerator;
+
+	if (divisor == 0) return 0;												//avoid division by zero
+
+	p = 1048576 - adc_P;
+	numerator = ((p << 31) - offset) * 3125;
+
+	if ((numerator >= 0) && (divisor > 0) && (divisor <= 0xFFFFFFFF) && ((uint64_t)numerator < (((uint64_t)divisor) << 32))) {
+		p = BMP280Divide((uint64_t)numerator, (uint32_t)divisor);
+	} else {
+		p = numerator / divisor;
+	}
+
+	var1 = (((int64_t)calib->dig_P9) * (p >> 13) * (p >> 13)) >> 25;
+	var2 = (((int64_t)calib->dig_P8) * p) >> 19;
+	p = ((p + var1 + var2) >> 8) + ((int64_t)calib->dig_P7_x16);
+
+	return (uint32_t)p;
+}
+
+
+//13) BMP280 pressure compensation calculation for fixed point results
+uint32_t BMP280CompensatePressure (BMP280Calib* calib, int32_t adc_P, int32_t t_fine) {
+	/*
+	 * The result is in Pa in Q24.8 format: 24 integer bits and 8 fractional bits. 24674867 is 96386.2 Pa (963.862 hPa).
+	 *
+	 * */
+
+	int64_t divisor, offset;
+
+	BMP280PressureTerms(calib, t_fine, &divisor, &offset);
+	return BMP280PressureFromTerms(calib, adc_P, divisor, offset);
+}
+
+
+//14) Compensate a set of samples
+void BMP280CompensateBatch (BMP280Calib* calib, BMP280Sample* samples, uint16_t number_of_samples) {
+	/*
+	 * What happens here?
+	 * We go through the samples and fill up the temperature and pressure from the raw values.
+	 * The t_fine dependent part of the pressure formula holds most of the 64-bit multiplications. We only recalculate it when t_fine changes.
+	 *
+	 * */
+
+	int32_t t_fine;
+	int32_t last_t_fine = 0;
+	int64_t divisor = 0;
+	int64_t offset = 0;
+
+	for (uint16_t i = 0; i < number_of_samples; i++) {
+		t_fine = BMP280CompensateTFine(calib, samples[i].adc_T);
+		samples[i].temperature = (t_fine * 5 + 128) >> 8;
+
+		if ((i == 0) || (t_fine != last_t_fine)) {
+			BMP280PressureTerms(calib, t_fine, &divisor, &offset);
+			last_t_fine = t_fine;
+		}
+
+		samples[i].pressure = BMP280PressureFromTerms(calib, samples[i].adc_P, divisor, offset);
+	}
+}
+
+
+//15) Set up the measurement control and the configuration registers together
+void BMP280Configure (BMP280* sensor, uint8_t ctrl_meas, uint8_t config) {
+	/*
+	 * What happens here?
+	 * The BMP280 accepts multiple address/data pairs within one CS assertion when writing.
+	 * We use a session to write both ctrl_meas and config with only one SPE and one CS toggle (see BMP280ShadowFlush).
+	 * config holds the standby time [7:5] and the IIR filter [4:2]. It is only guaranteed to be taken in sleep mode, so we write it first.
+	 * Registers the sensor already holds are not written again.
+	 *
+	 * */
+
+	BMP280ShadowSet(sensor, BMP280_SHADOW_CTRL_MEAS, 0xFF, ctrl_meas);
+	BMP280ShadowSet(sensor, BMP280_SHADOW_CONFIG, 0xFF, config);
+	BMP280ShadowFlush(sensor);
+}
+
+
+
+//16) Wait for the sensor to be ready
+uint32_t BMP280WaitReady (BMP280* sensor, uint8_t status_mask) {
+	/*
+	 * What happens here?
+	 * We read the status register until the bits in status_mask are all LOW:
+	 * - BMP280_STATUS_IM_UPDATE is HIGH after a reset/power up while the calibration data is being copied
+	 * - BMP280_STATUS_MEASURING is HIGH while a conversion is running (useful in forced mode)
+	 * We give up after BMP280_READY_TIMEOUT_US.
+	 * We return the time we have waited in us.
+	 *
+	 * */
+
+	uint8_t status = 0xFF;													//stays "not ready" if the read fails
+	uint32_t waited = 0;
+	uint32_t start = TIM6Now();
+
+	SPI1DeviceRead(&sensor->device, BMP280_REG_STATUS, &status, 1);
+	while ((status & status_mask) && (waited < BMP280_READY_TIMEOUT_US)) {
+		SPI1DeviceRead(&sensor->device, BMP280_REG_STATUS, &status, 1);
+		waited = TIM6Elapsed(start);
+	}
+
+	sensor->ready_wait_us += waited;
+	return waited;
+}
+
+
+
+//17) Rebuild the raw values from the data block
+void BMP280ParseData (uint8_t *data_block, int32_t* adc_P, int32_t* adc_T) {
+	/*
+	 * Both values are 20 bits, stored as MSB, LSB and XLSB with the XLSB having the data in [7:4].
+	 *
+	 * */
+
+	*adc_P = (data_block[0] << 12) | (data_block[1] << 4) | (data_block[2] >> 4);
+	*adc_T = (data_block[3] << 12) | (data_block[4] << 4) | (data_block[5] >> 4);
+}
+
+
+//18) Start the data block readout using DMA
+void BMP280StartReadDMA (BMP280* sensor, uint8_t *data_block, void (*read_done)(void)) {
+	/*
+	 * The function returns immediately. data_block holds the data once read_done is called.
+	 * Note: SPI1DMAInit must have been called before.
+	 *
+	 * */
+
+	SPI1DeviceSelect(&sensor->device);
+	SPI1MasterReadDMA(BMP280_REG_DATA, data_block, BMP280_DATA_LENGTH, sensor->device.cs_port, sensor->device.cs_pin, read_done);
+}
+
+
+
+//19) Change a field of a configuration register
+void BMP280ShadowSet (BMP280* sensor, uint8_t reg_index, uint8_t field_mask, uint8_t value) {
+	/*
+	 * What happens here?
+	 * Only the shadow is changed. value is given in place (e.g. 5<<2 for x16 pressure oversampling), only the bits in field_mask are taken.
+	 *
+	 * */
+
+	sensor->shadow[reg_index] = (sensor->shadow[reg_index] & ~field_mask) | (value & field_mask);
+	sensor->shadow_touched |= (1<<reg_index);
+}
+
+
+//20) Registers that need to be written
+uint8_t BMP280ShadowDirty (BMP280* sensor) {
+
+	uint8_t dirty = 0;
+	for (uint8_t i = 0; i < BMP280_SHADOW_REGS; i++) {
+		if (!(sensor->shadow_known & (1<<i)) || (sensor->shadow[i] != sensor->written[i])) dirty |= (1<<i);
+	}
+	return dirty;
+}
+
+
+//21) Write the dirty registers in one transaction
+uint8_t BMP280ShadowFlush (BMP280* sensor) {
+	/*
+	 * What happens here?
+	 * The dirty registers are written within one session and one CS assertion, config before ctrl_meas (config is only guaranteed to be taken in sleep mode).
+	 * If nothing is dirty, there is no SPI traffic at all. Registers that were set but are clean count as skipped writes.
+	 * After a failed write we don't know what the sensor holds anymore, so the dirty registers become unknown.
+	 *
+	 * */
+
+	uint8_t dirty = BMP280ShadowDirty(sensor);
+	uint8_t skipped = sensor->shadow_touched & ~dirty;
+	uint8_t error = SPI1_OK;
+
+	for (uint8_t i = 0; i < BMP280_SHADOW_REGS; i++) {
+		if (skipped & (1<<i)) sensor->writes_skipped++;
+	}
+	sensor->shadow_touched = 0;
+
+	if (!dirty) return SPI1_OK;
+
+	if ((error = SPI1SessionBegin(&sensor->device))) return error;				//nothing written, the shadow stays dirty
+	SPI1SessionSelect();
+	if (dirty & (1<<BMP280_SHADOW_CONFIG)) error = SPI1SessionWrite((BMP280_REG_CONFIG & 0x7F), &sensor->shadow[BMP280_SHADOW_CONFIG], 1);
+	if (!error && (dirty & (1<<BMP280_SHADOW_CTRL_MEAS))) error = SPI1SessionWrite((BMP280_REG_CTRL_MEAS & 0x7F), &sensor->shadow[BMP280_SHADOW_CTRL_MEAS], 1);
+	SPI1SessionDeselect();
+	uint8_t end_error = SPI1SessionEnd();
+	if (!error) error = end_error;
+
+	if (error) {
+		sensor->shadow_known &= ~dirty;
+		return error;
+	}
+
+	for (uint8_t i = 0; i < BMP280_SHADOW_REGS; i++) {
+		if (dirty & (1<<i)) sensor->written[i] = sensor->shadow[i];
+	}
+	sensor->shadow_known |= dirty;
+
+	uint8_t mode = sensor->written[BMP280_SHADOW_CTRL_MEAS] & BMP280_MODE;
+	if ((mode == 1) || (mode == 2)) {
+		sensor->written[BMP280_SHADOW_CTRL_MEAS] &= ~BMP280_MODE;			//forced mode: back to sleep after the conversion
+		sensor->shadow[BMP280_SHADOW_CTRL_MEAS] &= ~BMP280_MODE;
+	}
+
+	return SPI1_OK;
+}
+
+
+//22) Read the configuration registers into the shadow
+uint8_t BMP280ShadowLoad (BMP280* sensor) {
+	/*
+	 * ctrl_meas (0xF4) and config (0xF5) are next to each other, so one burst reads both. Pending changes in the shadow are lost.
+	 *
+	 * */
+
+	uint8_t regs[BMP280_SHADOW_REGS];
+	uint8_t error = SPI1DeviceRead(&sensor->device, BMP280_REG_CTRL_MEAS, regs, BMP280_SHADOW_REGS);
+	if (error) return error;
+
+	for (uint8_t i = 0; i < BMP280_SHADOW_REGS; i++) {
+		sensor->shadow[i] = regs[i];
+		sensor->written[i] = regs[i];
+	}
+	sensor->shadow_known = (1<<BMP280_SHADOW_REGS) - 1;
+	sensor->shadow_touched = 0;
+	return SPI1_OK;
+}
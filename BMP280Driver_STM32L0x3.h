@@ -0,0 +1,110 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: BMP280Driver_STM32L0x3.h
+ */
+
+#ifndef INC_BMP280DRIVER_CUSTOM_H_
+#define INC_BMP280DRIVER_CUSTOM_H_
+
+#include "stdint.h"
+#include "SPIDriver_STM32L0x3.h"									//custom SPI driver
+#include "NVMDriver_STM32L0x3.h"									//data EEPROM for the calibration cache
+
+//LOCAL CONSTANT
+#define BMP280_REG_CALIB			0x88							//start of the calibration block (0x88 - 0x9F)
+#define BMP280_REG_ID				0xD0
+#define BMP280_REG_RESET			0xE0
+#define BMP280_REG_STATUS			0xF3
+#define BMP280_REG_CTRL_MEAS		0xF4
+#define BMP280_REG_CONFIG			0xF5
+#define BMP280_REG_DATA				0xF7							//start of the data block (0xF7 - 0xFC)
+
+#define BMP280_STATUS_MEASURING		(1<<3)							//conversion is running
+#define BMP280_STATUS_IM_UPDATE		(1<<0)							//NVM data is being copied to the image registers
+#define BMP280_READY_TIMEOUT_US		50000							//longest wait for the status bits (longest conversion is ~44 ms)
+
+#define BMP280_SHADOW_CTRL_MEAS		0								//index of ctrl_meas in the shadow registers
+#define BMP280_SHADOW_CONFIG		1								//index of config in the shadow registers
+#define BMP280_SHADOW_REGS			2
+
+#define BMP280_OSRS_T				(7<<5)							//ctrl_meas fields
+#define BMP280_OSRS_P				(7<<2)
+#define BMP280_MODE					(3<<0)
+#define BMP280_T_SB					(7<<5)							//config fields
+#define BMP280_FILTER				(7<<2)
+
+#define BMP280_CALIB_LENGTH			24
+#define BMP280_DATA_LENGTH			6
+
+#ifndef BMP280_CALIB_CACHE_ADDRESS
+#define BMP280_CALIB_CACHE_ADDRESS	NVM_EEPROM_START				//word aligned address of the calibration cache in the data EEPROM
+#endif
+#define BMP280_CALIB_CACHE_MAGIC	0xB2800CA1						//marks a written cache (bump it if the layout changes)
+#define BMP280_CALIB_CACHE_WORDS	9								//magic, chip ID, 24 calibration bytes, checksum
+
+//LOCAL TYPES
+typedef struct {
+	uint16_t dig_T1;
+	int16_t dig_T2;
+	int16_t dig_T3;
+	uint16_t dig_P1;
+	int16_t dig_P2;
+	int16_t dig_P3;
+	int16_t dig_P4;
+	int16_t dig_P5;
+	int16_t dig_P6;
+	int16_t dig_P7;
+	int16_t dig_P8;
+	int16_t dig_P9;
+	int32_t dig_T1_x2;												//pre-calculated terms for the compensation (see BMP280ParseCalibration)
+	int64_t dig_P4_x2e35;
+	int32_t dig_P7_x16;
+} BMP280Calib;
+
+typedef struct {
+	SPI1Device device;												//CS and bus setup of the sensor
+	BMP280Calib calib;												//calibration parameters read out from the sensor
+	uint32_t ready_wait_us;											//total time spent waiting for the status register
+	uint8_t shadow[BMP280_SHADOW_REGS];								//configuration registers as we want them
+	uint8_t written[BMP280_SHADOW_REGS];							//configuration registers as the sensor holds them
+	uint8_t shadow_known;											//bit n is set if written[n] is known
+	uint8_t shadow_touched;											//bit n is set if shadow[n] was set since the last flush
+	uint32_t writes_skipped;										//redundant register writes that were not sent
+	uint8_t calib_from_cache;										//1 if the calibration was loaded from the data EEPROM
+} BMP280;
+
+typedef struct {
+	int32_t adc_T;													//raw 20-bit temperature
+	int32_t adc_P;													//raw 20-bit pressure
+	int32_t temperature;											//compensated temperature in 0.01 degC
+	uint32_t pressure;												//compensated pressure in Pa, Q24.8 format (divide by 256 for Pa)
+} BMP280Sample;
+
+//FUNCTION PROTOTYPES
+void BMP280Init (BMP280* sensor, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_pin_number_SPI);
+uint8_t BMP280ReadID (BMP280* sensor);
+uint8_t BMP280Reset (BMP280* sensor);
+uint32_t BMP280WaitReady (BMP280* sensor, uint8_t status_mask);
+void BMP280WriteCtrlMeas (BMP280* sensor, uint8_t ctrl_meas);
+void BMP280ShadowSet (BMP280* sensor, uint8_t reg_index, uint8_t field_mask, uint8_t value);
+uint8_t BMP280ShadowDirty (BMP280* sensor);
+uint8_t BMP280ShadowFlush (BMP280* sensor);
+uint8_t BMP280ShadowLoad (BMP280* sensor);
+void BMP280Configure (BMP280* sensor, uint8_t ctrl_meas, uint8_t config);
+uint8_t BMP280ReadCalibration (BMP280* sensor);
+uint8_t BMP280LoadCalibration (BMP280* sensor, uint8_t chip_id);
+uint8_t BMP280InvalidateCalibrationCache (void);
+void BMP280ParseCalibration (BMP280Calib* calib, uint8_t *calib_block);
+uint8_t BMP280ReadSample (BMP280* sensor, BMP280Sample* sample);
+void BMP280ParseData (uint8_t *data_block, int32_t* adc_P, int32_t* adc_T);
+void BMP280StartReadDMA (BMP280* sensor, uint8_t *data_block, void (*read_done)(void));
+int32_t BMP280CompensateTFine (BMP280Calib* calib, int32_t adc_T);
+int32_t BMP280CompensateTemperature (BMP280Calib* calib, int32_t adc_T);
+uint32_t BMP280CompensatePressure (BMP280Calib* calib, int32_t adc_P, int32_t t_fine);
+void BMP280CompensateBatch (BMP280Calib* calib, BMP280Sample* samples, uint16_t number_of_samples);
+
+#endif /* INC_BMP280DRIVER_CUSTOM_H_ */
@@ -0,0 +1,140 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: BMP280Multi_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * Staggered forced mode sampling of several BMP280s on SPI1, each with its own CS.
+ * Reading the sensors one after the other (trigger, wait, read, next sensor) takes N conversion times per cycle. The bus is idle almost all the time.
+ * Instead, we trigger a forced conversion on every sensor first, one after the other. The sensors then convert in parallel, offset only by the few us of the trigger writes.
+ * While they convert, we go round the sensors and read out each one as soon as it is done. A cycle thus takes about one conversion time plus the readouts.
+ *
+ * We don't poll the status of a sensor before its typical conversion time has passed - that would only load the bus. After that, the measuring bit decides.
+ * The trigger goes through the shadow registers of the sensor, so config is only written in the first cycle (or after a change) and ctrl_meas is the single byte written per cycle.
+ *
+ * Example:
+ *    BMP280* sensors[2] = {&sensor_a, &sensor_b};							//initialised, calibration read out
+ *    BMP280Multi multi;
+ *    BMP280MultiInit(&multi, sensors, 2, 0x27);								//x1 oversampling on both
+ *    uint8_t valid = BMP280MultiCycle(&multi);								//multi.samples[n] is valid if bit n is set
+ *
+ */
+
+#include "BMP280Multi_STM32L0x3.h"
+
+//1) Typical conversion time
+uint32_t BMP280ConversionTime (uint8_t ctrl_meas) {
+	/*
+	 * What happens here?
+	 * From the datasheet: t = 1 ms + 2 ms * T oversampling + (2 ms * P oversampling + 0.5 ms), the pressure part only if pressure is measured.
+	 * osrs_t is in [7:5], osrs_p in [4:2]. Codes 1 to 5 are x1 to x16, anything above is x16 as well, 0 is skipped.
+	 *
+	 * */
+
+	static const uint8_t oversampling[8] = {0, 1, 2, 4, 8, 16, 16, 16};
+	uint8_t osrs_t = oversampling[(ctrl_meas >> 5) & 7];
+	uint8_t osrs_p = oversampling[(ctrl_meas >> 2) & 7];
+
+	uint32_t conversion_us = 1000 + 2000 * osrs_t;
+	if (osrs_p) conversion_us += 2000 * osrs_p + 500;
+	return conversion_us;
+}
+
+
+//2) Set up the sampler
+void BMP280MultiInit (BMP280Multi* multi, BMP280** sensors, uint8_t count, uint8_t ctrl_meas) {
+	/*
+	 * The sensors must be initialised and their calibration read out before.
+	 * The mode bits of ctrl_meas are replaced by forced mode.
+	 *
+	 * */
+
+	if (count > BMP280_MULTI_MAX_SENSORS) count = BMP280_MULTI_MAX_SENSORS;
+
+	for (uint8_t i = 0; i < count; i++) {
+		multi->sensors[i] = sensors[i];
+		multi->ready_time[i] = 0;
+	}
+	multi->count = count;
+	multi->ctrl_meas = (ctrl_meas & ~0x03) | BMP280_MODE_FORCED;
+	multi->conversion_us = BMP280ConversionTime(ctrl_meas);
+	multi->valid = 0;
+	multi->cycle_us = 0;
+	multi->status_polls = 0;
+	multi->timeouts = 0;
+	multi->errors = 0;
+}
+
+
+//3) One staggered cycle
+uint8_t BMP280MultiCycle (BMP280Multi* multi) {
+	/*
+	 * What happens here?
+	 * 1)We write ctrl_meas with forced mode to all sensors and store the time stamp of each trigger.
+	 * 2)We go round the pending sensors. A sensor whose typical conversion time has passed gets a status read. If it is not measuring anymore, the data block is read and compensated.
+	 *   Since the sensors were triggered in order, they also finish in order, so the readout of one sensor overlaps with the conversion of the next ones.
+	 * 3)Sensors not done within BMP280_READY_TIMEOUT_US of their trigger are dropped from the cycle.
+	 * Returns the bit mask of the sensors with a new sample.
+	 *
+	 * Note: the sensors go back to sleep by themselves after the conversion, so there is nothing to stop.
+	 *
+	 * */
+
+	uint32_t trigger_time[BMP280_MULTI_MAX_SENSORS];
+	uint8_t pending = 0;
+	uint32_t cycle_start = TIM6Now();
+
+	multi->valid = 0;
+
+	//1)
+	for (uint8_t i = 0; i < multi->count; i++) {
+		BMP280ShadowSet(multi->sensors[i], BMP280_SHADOW_CTRL_MEAS, 0xFF, multi->ctrl_meas);
+		if (BMP280ShadowFlush(multi->sensors[i])) {
+			multi->errors++;
+			continue;
+		}
+		trigger_time[i] = TIM6Now();
+		pending |= (1<<i);
+	}
+
+	//2)
+	while (pending) {
+		for (uint8_t i = 0; i < multi->count; i++) {
+			if (!(pending & (1<<i))) continue;
+
+			uint32_t converting = TIM6Elapsed(trigger_time[i]);
+			if (converting < multi->conversion_us) continue;				//too early, don't waste bus time
+
+			//3)
+			if (converting > BMP280_READY_TIMEOUT_US) {
+				multi->timeouts++;
+				pending &= ~(1<<i);
+				continue;
+			}
+
+			uint8_t status = 0xFF;
+			if (SPI1DeviceRead(&multi->sensors[i]->device, BMP280_REG_STATUS, &status, 1) == SPI1_OK) {
+				if (status & BMP280_STATUS_MEASURING) {
+					multi->status_polls++;
+					continue;
+				}
+				if (BMP280ReadSample(multi->sensors[i], &multi->samples[i]) == SPI1_OK) {
+					multi->ready_time[i] = TIM6Now();
+					multi->valid |= (1<<i);
+					pending &= ~(1<<i);
+					continue;
+				}
+			}
+
+			multi->errors++;
+			pending &= ~(1<<i);
+		}
+	}
+
+	multi->cycle_us = TIM6Elapsed(cycle_start);
+	return multi->valid;
+}
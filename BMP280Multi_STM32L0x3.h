@@ -0,0 +1,42 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: BMP280Multi_STM32L0x3.h
+ */
+
+#ifndef INC_BMP280MULTI_CUSTOM_H_
+#define INC_BMP280MULTI_CUSTOM_H_
+
+#include "stdint.h"
+#include "ClockDriver_STM32L0x3.h"									//TIM6 time stamps
+#include "SPIDriver_STM32L0x3.h"									//device transactions
+#include "BMP280Driver_STM32L0x3.h"									//BMP280 registers and compensation
+
+//LOCAL CONSTANT
+#define BMP280_MULTI_MAX_SENSORS	4								//sensors on the bus, each with its own CS
+#define BMP280_MODE_FORCED			0x01							//ctrl_meas [1:0] - one conversion, then back to sleep
+
+//LOCAL TYPES
+typedef struct {
+	BMP280* sensors[BMP280_MULTI_MAX_SENSORS];
+	BMP280Sample samples[BMP280_MULTI_MAX_SENSORS];					//results of the last cycle
+	uint32_t ready_time[BMP280_MULTI_MAX_SENSORS];					//TIM6 time stamp of each readout
+	uint8_t count;
+	uint8_t ctrl_meas;												//oversampling of the sensors, forced mode
+	uint32_t conversion_us;											//typical conversion time for ctrl_meas, no status poll before that
+	uint8_t valid;													//bit n is set if sensor n has a new sample from the last cycle
+	uint32_t cycle_us;												//duration of the last cycle
+	uint32_t status_polls;											//status reads that found a sensor still measuring
+	uint32_t timeouts;												//sensors that did not finish within BMP280_READY_TIMEOUT_US
+	uint32_t errors;												//SPI errors
+} BMP280Multi;
+
+//FUNCTION PROTOTYPES
+uint32_t BMP280ConversionTime (uint8_t ctrl_meas);
+void BMP280MultiInit (BMP280Multi* multi, BMP280** sensors, uint8_t count, uint8_t ctrl_meas);
+uint8_t BMP280MultiCycle (BMP280Multi* multi);
+
+#endif /* INC_BMP280MULTI_CUSTOM_H_ */
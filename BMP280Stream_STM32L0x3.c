@@ -0,0 +1,175 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: BMP280Stream_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * Continuous, double-buffered acquisition of the BMP280 data block.
+ * TIM2 starts a DMA burst read of the data block on every period. The DMA writes straight into the next slot of a ping-pong buffer, so there is no copying and no parsing in the IRQs.
+ * When a half is full, it is handed over to the application (ready flag and optional callback) and the other half is filled in the meantime.
+ * The application parses/compensates the whole half in one go, then releases it.
+ *
+ * Counters:
+ * - missed_periods: the bus was still busy (e.g. the previous burst or another transfer) when the period came
+ * - overruns: the half to be filled next had not been released by the application yet, the sample is dropped
+ * - errors: the DMA transfer failed, the slot is filled again in the next period
+ *
+ * Example:
+ *    static BMP280Stream stream;
+ *    BMP280StreamStart(&stream, &sensor, 100, 0);							//100 samples per second, no callback
+ *    ...
+ *    int8_t half = BMP280StreamPending(&stream);
+ *    if (half >= 0) {
+ *        BMP280StreamParse(&stream, half, samples);
+ *        BMP280StreamRelease(&stream, half);
+ *        BMP280CompensateBatch(&sensor.calib, samples, BMP280_STREAM_SAMPLES);
+ *    }
+ *
+ * v.1.1
+ * The address byte is sent by the DMA as well (SPI1MasterExchangeDMA), so the TIM2 IRQ only sets up the transfer and doesn't wait for the address to go out.
+ * Each slot holds the reply to the address (junk) in front of the data block.
+ * SPI1_DMA_error is cleared by the driver when a transfer starts, so an error of an earlier transfer is not taken for the current one.
+ *
+ */
+
+#include "BMP280Stream_STM32L0x3.h"
+
+//LOCAL VARIABLES
+static BMP280Stream* active_stream = 0;										//the TIM2 and DMA callbacks have no argument
+static const uint8_t stream_command[BMP280_STREAM_SLOT] = {BMP280_REG_DATA, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};	//address, then dummies for the data block
+
+//1) DMA callback - one data block is in
+static void BMP280StreamDone (void) {
+	/*
+	 * What happens here?
+	 * If the transfer went through, we step to the next slot. If the half is full, we flag it, call the callback and go over to the other half.
+	 * After a failed transfer we stay on the same slot.
+	 *
+	 * */
+
+	BMP280Stream* stream = active_stream;
+	if (stream == 0) return;
+
+	if (SPI1_DMA_error) {
+		stream->errors++;
+		return;
+	}
+
+	uint8_t half = stream->fill_half;
+	if (++stream->fill_index >= BMP280_STREAM_SAMPLES) {
+		stream->ready[half] = 1;
+		stream->halves_completed++;
+		stream->fill_half = half ^ 1;
+		stream->fill_index = 0;
+		if (stream->half_ready) stream->half_ready(half);
+	}
+}
+
+
+//2) TIM2 callback - start the next burst
+static void BMP280StreamTick (void) {
+	/*
+	 * What happens here?
+	 * We must not wait in an IRQ, so if the bus is busy, the period is counted as missed.
+	 * At the start of a half, the half must have been released by the application. If not, we count an overrun and drop the sample.
+	 * Otherwise we start the DMA burst into the next slot. The address goes out through the DMA too, so nothing is polled here.
+	 *
+	 * */
+
+	BMP280Stream* stream = active_stream;
+	if (stream == 0) return;
+
+	if (SPI1_DMA_busy || SPI1_IT_busy) {
+		stream->missed_periods++;
+		return;
+	}
+
+	uint8_t half = stream->fill_half;
+	if (stream->ready[half]) {
+		stream->overruns++;
+		return;
+	}
+
+	if (stream->fill_index == 0) stream->start_time[half] = TIM6Now();
+	SPI1DeviceSelect(&stream->sensor->device);
+	SPI1MasterExchangeDMA(stream_command, stream->block[half][stream->fill_index], BMP280_STREAM_SLOT, stream->sensor->device.cs_port, stream->sensor->device.cs_pin, BMP280StreamDone);
+}
+
+
+//3) Start the continuous acquisition
+void BMP280StreamStart (BMP280Stream* stream, BMP280* sensor, uint32_t rate_hz, void (*half_ready)(uint8_t half)) {
+	/*
+	 * What happens here?
+	 * We reset the buffer and the counters, then start TIM2 at rate_hz with the burst start as its callback.
+	 * The sensor should be in normal mode with a standby time shorter than the period, so every burst reads a fresh measurement.
+	 *
+	 * Note: SPI1DMAInit must have been called before. TIM2 is taken over by the stream until BMP280StreamStop.
+	 *
+	 * */
+
+	stream->ready[0] = 0;
+	stream->ready[1] = 0;
+	stream->fill_half = 0;
+	stream->fill_index = 0;
+	stream->halves_completed = 0;
+	stream->missed_periods = 0;
+	stream->overruns = 0;
+	stream->errors = 0;
+	stream->sensor = sensor;
+	stream->half_ready = half_ready;
+
+	active_stream = stream;
+	TIM2PeriodicConfig(rate_hz, BMP280StreamTick);
+}
+
+
+//4) Stop the continuous acquisition
+void BMP280StreamStop (void) {
+	/*
+	 * A burst that is already running is finished, but nothing is started anymore.
+	 *
+	 * */
+
+	TIM2PeriodicStop();
+	active_stream = 0;
+}
+
+
+//5) Half waiting to be processed
+int8_t BMP280StreamPending (BMP280Stream* stream) {
+	/*
+	 * Returns the half that is full and not yet released, or -1 if there is none.
+	 * If both halves are full, the one filled first is returned (the other one is being filled next).
+	 *
+	 * */
+
+	uint8_t first = stream->fill_half;										//the half being filled now was completed earlier
+	if (stream->ready[first]) return first;
+	if (stream->ready[first ^ 1]) return first ^ 1;
+	return -1;
+}
+
+
+//6) Parse a full half into samples
+void BMP280StreamParse (BMP280Stream* stream, uint8_t half, BMP280Sample* samples) {
+	/*
+	 * samples must hold BMP280_STREAM_SAMPLES entries. Only the raw values are filled in, BMP280CompensateBatch does the rest.
+	 *
+	 * */
+
+	for (uint8_t i = 0; i < BMP280_STREAM_SAMPLES; i++) {
+		BMP280ParseData(&stream->block[half][i][1], &samples[i].adc_P, &samples[i].adc_T);
+	}
+}
+
+
+//7) Hand a half back to the acquisition
+void BMP280StreamRelease (BMP280Stream* stream, uint8_t half) {
+
+	__DMB();																//all reads of the half are done before the DMA may write it again
+	stream->ready[half] = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: BMP280Stream_STM32L0x3.h
+ */
+
+#ifndef INC_BMP280STREAM_CUSTOM_H_
+#define INC_BMP280STREAM_CUSTOM_H_
+
+#include "stdint.h"
+#include "stm32l053xx.h"											//device specific header file for registers
+#include "ClockDriver_STM32L0x3.h"									//TIM2 schedule, TIM6 time stamps
+#include "SPIDriver_STM32L0x3.h"									//DMA transfers
+#include "BMP280Driver_STM32L0x3.h"									//BMP280 data block
+
+//LOCAL CONSTANT
+#define BMP280_STREAM_SAMPLES		16								//samples in one half of the ping-pong buffer
+#define BMP280_STREAM_SLOT			(BMP280_DATA_LENGTH + 1)		//reply to the address, then the data block
+
+//LOCAL TYPES
+typedef struct {
+	uint8_t block[2][BMP280_STREAM_SAMPLES][BMP280_STREAM_SLOT];	//ping-pong buffer of raw data blocks - the DMA writes here directly
+	uint32_t start_time[2];											//TIM6 time stamp of the first sample of each half
+	volatile uint8_t ready[2];										//half is full and owned by the application until released
+	volatile uint8_t fill_half;										//half the DMA is filling
+	volatile uint8_t fill_index;									//next sample within the half
+	volatile uint32_t halves_completed;
+	volatile uint32_t missed_periods;								//periods where the bus was still busy
+	volatile uint32_t overruns;										//periods dropped because the next half was not released yet
+	volatile uint32_t errors;										//DMA transfers that failed (the sample is read again in the next period)
+	BMP280* sensor;
+	void (*half_ready)(uint8_t half);								//optional, called from the DMA IRQ when a half is full
+} BMP280Stream;
+
+//FUNCTION PROTOTYPES
+void BMP280StreamStart (BMP280Stream* stream, BMP280* sensor, uint32_t rate_hz, void (*half_ready)(uint8_t half));
+void BMP280StreamStop (void);
+int8_t BMP280StreamPending (BMP280Stream* stream);
+void BMP280StreamParse (BMP280Stream* stream, uint8_t half, BMP280Sample* samples);
+void BMP280StreamRelease (BMP280Stream* stream, uint8_t half);
+
+#endif /* INC_BMP280STREAM_CUSTOM_H_ */
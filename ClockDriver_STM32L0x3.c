@@ -11,11 +11,65 @@
  * Below is a custom RCC configuration function, followed by the setup of TIM6 basic timer.
  * TIM2 PWM is removed from this version.
  *
+ * v.1.1
+ * TIM6 is left free running. Delay_us does not reset the counter anymore, it measures the elapsed ticks instead.
+ * This way TIM6 can also be used for time stamps (TIM6Now/TIM6Elapsed) without the delays destroying them.
+ *
+ * v.1.2
+ * TIM2 periodic interrupt added for scheduled activities (e.g. sensor acquisition at a fixed rate). The core can sleep (WFI) between the periods.
+ * The latency between the hardware update event and the callback is measured on every period. Since the update events are exact, the spread of this latency is the jitter of the schedule.
+ *
+ * v.1.3
+ * TIM6 timer service. TIM6 now counts from 0 to 999 us and generates an update interrupt every ms, which steps a ms counter.
+ * TIM6Now returns a 32-bit us time stamp (ms counter * 1000 + CNT), which only wraps after 71 minutes. TIM6Elapsed is valid for the same range.
+ * On top of that, software timers can be started with a callback: one-shot or periodic. The running timers are kept in a list sorted by their deadline, so the ms IRQ only ever looks at the first one.
+ * The callbacks are called from the TIM6 IRQ with 1 ms resolution (TIM6 is a basic timer without compare channels).
+ * Delay_us and Delay_ms remain as blocking wrappers around TIM6Now/TIM6Elapsed and can now overlap with each other and with the timers.
+ *
+ * Example:
+ *    static SoftTimer blink;
+ *    TIM6TimerStart(&blink, 500000, 500000, ToggleLED);					//ToggleLED is called every 500 ms, starting 500 ms from now
+ *
+ * v.1.4
+ * Clock profiles that can be switched at run time: CLOCK_PROFILE_PLL32 (HSI16 + PLL, 32 MHz, same as SysClockConfig), CLOCK_PROFILE_HSI16 (16 MHz) and CLOCK_PROFILE_MSI (2.097 MHz, for idle).
+ * The TIM6 and TIM2 prescalers are no longer hard-wired. They are calculated from SystemCoreClock and the APB1 divider, and recalculated on every profile switch, so the time stamps, the delays and the TIM2 rate stay correct.
+ * Other drivers register a hook (ClockRegisterHook) that is called after the switch to rescale their own peripherals (e.g. the SPI baud rate prescaler).
+ *
+ * Example:
+ *    ClockRegisterHook(SPI1ClockChanged);
+ *    ClockSetProfile(CLOCK_PROFILE_MSI);									//idle
+ *    ClockSetProfile(CLOCK_PROFILE_PLL32);									//full speed for a burst
+ *
+ * v.1.5
+ * TIM6AddMillis steps the ms count for counter wraps that were caught outside the TIM6 IRQ (interrupts off for longer than a ms, e.g. during a data EEPROM write).
+ *
+ * v.1.6
+ * The TIM6 IRQ steps the ms count only if UIF is HIGH. The first wrap with the interrupts off leaves the IRQ pending in the NVIC, even after the wrap counter has cleared UIF.
+ * That pending IRQ ran once the interrupts were back on and added one ms too many on top of TIM6AddMillis. It now only serves the timer queue.
+ *
+ * v.1.7
+ * TIM6CatchWrap counts a wrap on the spot, for loops that keep the interrupts off for an unbounded time (e.g. the gapless SPI transfers) and call it at least once per ms.
+ *
+ * v.1.8
+ * TIM2Rescale sets URS around the forced update, so a profile switch doesn't leave a TIM2 IRQ pending (the flag was cleared, but the NVIC had latched it with the interrupts off).
+ * The TIM2 IRQ also ignores a call without UIF. Before, every switch added an extra period.
+ *
  */
 
 #include "ClockDriver_STM32L0x3.h"
 #include "stm32l053xx.h"														//device specific header file for registers
 
+//LOCAL VARIABLES
+volatile PeriodicStats TIM2_stats;
+static void (*tim2_period_elapsed)(void);
+static uint32_t tim2_tick_ns;														//length of one TIM2 tick in ns
+static volatile uint32_t tim6_ms = 0;												//ms elapsed since TIM6Config
+static SoftTimer* tim6_timer_queue = 0;												//running software timers, earliest deadline first
+static uint32_t tim6_ticks_per_ms = 1000;											//TIM6 ticks in one ms, 1000 if the tick is exactly 1 us
+static uint32_t tim2_rate_hz;														//rate of the TIM2 periodic interrupt
+static void (*clock_hooks[CLOCK_HOOKS])(void);										//called after a clock profile switch
+static uint8_t clock_profile = CLOCK_PROFILE_MSI;								//MSI after reset
+
 //1)We set up the core clock and the peripheral prescalers/dividers
 void SysClockConfig(void) {
 	/**
@@ -92,22 +146,73 @@ void SysClockConfig(void) {
 	while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL);						//system clock status (set by hardware in bits [3:2]) should be matching the PLL source status set in bits [1:0]
 
 	SystemCoreClockUpdate();													//This CMSIS function must be called to update the system clock! If not done, we will remain in the original clocking (likely MSI).
+	clock_profile = CLOCK_PROFILE_PLL32;
+}
+
+//1a) APB clocks
+uint32_t ClockAPB1Hz (void) {
+	/*
+	 * PPRE1 is [10:8] in CFGR: below 4 it is not divided, 4 is /2, 5 is /4 and so on. The AHB is never divided here, so HCLK is SystemCoreClock.
+	 *
+	 * */
+
+	uint32_t ppre1 = (RCC->CFGR >> 8) & 7;
+	return (ppre1 < 4) ? SystemCoreClock : (SystemCoreClock >> (ppre1 - 3));
+}
+
+uint32_t ClockAPB1TimerHz (void) {
+	/*
+	 * The timers on APB1 get the APB1 clock x2 - unless APB1 is not divided.
+	 *
+	 * */
+
+	uint32_t ppre1 = (RCC->CFGR >> 8) & 7;
+	return (ppre1 < 4) ? SystemCoreClock : (ClockAPB1Hz() * 2);
 }
 
+uint32_t ClockAPB2Hz (void) {
+
+	uint32_t ppre2 = (RCC->CFGR >> 11) & 7;
+	return (ppre2 < 4) ? SystemCoreClock : (SystemCoreClock >> (ppre2 - 3));
+}
+
+
+//1b) TIM6 prescaler for the current clock
+static uint32_t TIM6Prescaler (void) {
+	/*
+	 * We want a tick of 1 us. If the timer clock is not a multiple of 1 MHz (MSI), the tick is a bit shorter and TIM6Now scales the counter to us.
+	 * The number of ticks in a ms is stored for TIM6Now and the ARR.
+	 *
+	 * */
+
+	uint32_t timer_hz = ClockAPB1TimerHz();
+	uint32_t prescaler = timer_hz / 1000000;
+	if (prescaler == 0) prescaler = 1;
+	tim6_ticks_per_ms = (timer_hz / prescaler) / 1000;
+	return prescaler;
+}
+
+
 //2) TIM6 setup for precise delay generation
 void TIM6Config (void) {
 	/**
 	 * What happens here?
 	 * We first enable the timer, paying VERY close attention on which APB it is connected to (APB1).
 	 * We then prescale the (automatically x2 multiplied!) APB clock to have a nice round frequency.
-	 * Since we will play with how far this timer counts, we put the automatic maximum value of count value to maximum. This means that this timer can only count 65535 cycles.
+	 * The automatic reload value is the number of ticks in a ms, so the counter wraps every ms.
 	 * We tgeb enable the timers and wait until it is engaged.
 	 *
 	 * TIM6 is a basic clock that is configured to provide a counter for a simple delay function (see below).
-	 * It is connected to AP1B which is clocking at 16 MHz currently (see above the clock config for the PLL setup to generate 32 MHz and then the APB1 clock divider left at DIV4 and a PCLK multiplier of 2 - not possible to change)
+	 * The prescaler is calculated from the actual clock setup (see TIM6Prescaler). SysClockConfig must be called before.
+	 * It is connected to APB1. The timer clock (ClockAPB1TimerHz) depends on the clock profile:
+	 * - CLOCK_PROFILE_PLL32: 32 MHz, APB1 /4 = 8 MHz, x2 = 16 MHz -> prescaler 16, 1000 ticks in a ms
+	 * - CLOCK_PROFILE_HSI16: 16 MHz, APB1 /2 = 8 MHz, x2 = 16 MHz -> prescaler 16, 1000 ticks in a ms
+	 * - CLOCK_PROFILE_MSI: 2.097 MHz, APB1 /1 (no x2) -> prescaler 2, the tick is 0.954 us and there are 1048 ticks in a ms (TIM6Now scales them to us)
+	 * The counter wraps every ms and the update interrupt extends it to 32 bits (see TIM6Now).
 	 * 1)Enable TIM6 clocking
 	 * 2)Set prescaler and ARR
 	 * 3)Enable timer and wait for update flag
+	 * 4)Enable the update IRQ
 	 **/
 
 	//1)
@@ -115,12 +220,12 @@ void TIM6Config (void) {
 
 	//2)
 
-	TIM6->PSC = 16 - 1;															// 16 MHz/16 = 1 MHz -- 1 us delay
+	uint32_t prescaler = TIM6Prescaler();
+	TIM6->PSC = prescaler - 1;													//timer clock / prescaler = 1 MHz (1.048 MHz with MSI) -- 1 us delay
 																				// Note: the timer has a prescaler, but so does APB1!
-																				// Note: the timer has a x2 multiplier on the APB clock
-																				// Here APB1 PCLK is 8 MHz
+																				// Note: the timer has a x2 multiplier on the APB clock, unless APB1 is not divided
 
-	TIM6->ARR = 0xFFFF;															//Maximum ARR value - how far can the timer count?
+	TIM6->ARR = tim6_ticks_per_ms - 1;											//the counter wraps every ms
 
 	//3)
 	TIM6->CR1 |= (1<<0);														//timer counter enable bit
@@ -129,33 +234,412 @@ void TIM6Config (void) {
 																				//This part is necessary since we can update on the fly. We just need to wait until we are done with a counting cycle and thus an update event has been generated.
 																				//also, almost everything is preloaded before it takes effect
 																				//update events can be disabled by writing to the UDIS bits in CR1. UDIS as LOW is UDIS ENABLED!!!s
+
+	//4)
+	TIM6->SR &= ~(1<<0);														//we clear the flag of the first update
+	tim6_ms = 0;
+	TIM6->DIER |= (1<<0);														//update interrupt enabled
+	NVIC_SetPriority(TIM6_DAC_IRQn, 0);											//highest priority so the ms count is never late by more than one IRQ
+	NVIC_EnableIRQ(TIM6_DAC_IRQn);
 }
 
 
 //3) Delay function for microseconds
 void Delay_us(int micro_sec) {
 	/**
-	 * Since we can use TIM6 only to count up to maximum 65535 cycles (65535 us), we need to up-scale out counter.
-	 * We do that by counting first us seconds...
+	 * We don't reset the counter, we just wait until the necessary number of us have passed since we have entered the function.
+	 * Since the time stamps are 32 bits, any delay up to 71 minutes works and multiple delays (e.g. in an IRQ) can overlap.
 	 *
+	 * 1)Take the current time stamp
+	 * 2)Wait until micro_sec has elapsed
 	 *
-	 * 1)Reset counter for TIM6
-	 * 2)Wait until micro_sec
+	 * Note: with interrupts disabled for more than 1 ms, the ms count can't follow and the delay gets longer.
 	 **/
-	TIM6->CNT = 0;
-	while(TIM6->CNT < micro_sec);												//Note: this is a blocking timer counter!
+	uint32_t start = TIM6Now();
+	while(TIM6Elapsed(start) < (uint32_t) micro_sec);							//Note: this is a blocking timer counter!
 }
 
 
 //4) Delay function for milliseconds
 void Delay_ms(int milli_sec) {
 	/*
-	 * ...and then, ms seconds.
 	 * This function will be equivalent to HAL_Delay().
 	 *
 	 * */
 
-	for (uint32_t i = 0; i < milli_sec; i++){
-		Delay_us(1000);															//we call the custom microsecond delay for 1000 to generate a delay of 1 millisecond
+	uint32_t start = TIM6Now();
+	while(TIM6Elapsed(start) < ((uint32_t) milli_sec * 1000));
+}
+
+
+
+//5) Time stamp
+uint32_t TIM6Now(void) {
+	/*
+	 * What happens here?
+	 * The time stamp is the ms count times 1000 plus the counter value.
+	 * The two must belong together: if the counter has wrapped but the IRQ has not stepped the ms count yet (we are in a higher priority IRQ or interrupts are off), the UIF flag is HIGH.
+	 * In that case we read the counter again (it is after the wrap for sure) and add the missing ms ourselves.
+	 * We do this with the interrupts off so the TIM6 IRQ can't step the ms count in between.
+	 * If the tick is not exactly 1 us, the counter is scaled to us.
+	 *
+	 * */
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint32_t ms = tim6_ms;
+	uint32_t us = TIM6->CNT;
+	if (TIM6->SR & (1<<0)) {													//update pending
+		us = TIM6->CNT;
+		ms++;
+	}
+	__set_PRIMASK(primask);
+
+	if (tim6_ticks_per_ms != 1000) us = (us * 1000) / tim6_ticks_per_ms;		//tick is not 1 us (MSI profile)
+	return (ms * 1000) + us;
+}
+
+
+//6) Elapsed time since a time stamp
+uint32_t TIM6Elapsed(uint32_t since) {
+	/*
+	 * Elapsed time in us since the time stamp. The subtraction is done on 32 bits, so it is valid up to 71 minutes.
+	 *
+	 * */
+
+	return TIM6Now() - since;
+}
+
+
+
+//6a) TIM2 prescaler and ARR for the current clock
+static void TIM2Rescale (void) {
+	/*
+	 * We pick the smallest prescaler that allows the period to fit into the 16-bit ARR.
+	 * The tick length is kept in ns for the latency measurement. With a timer clock that is not a multiple of 1 MHz, it is rounded.
+	 *
+	 * */
+
+	uint32_t timer_hz = ClockAPB1TimerHz();
+	uint32_t cycles = timer_hz / tim2_rate_hz;									//timer clocks in one period
+	uint32_t prescaler = (cycles / 65536) + 1;
+	TIM2->PSC = prescaler - 1;
+	TIM2->ARR = (cycles / prescaler) - 1;
+	tim2_tick_ns = (uint32_t)(((uint64_t)prescaler * 1000000000) / timer_hz);
+	TIM2->CR1 |= (1<<2);														//URS - the forced update below doesn't set UIF
+	TIM2->EGR |= (1<<0);														//we force an update to load the PSC
+	TIM2->CR1 &= ~(1<<2);
+}
+
+
+//7) TIM2 periodic interrupt
+void TIM2PeriodicConfig (uint32_t rate_hz, void (*period_elapsed)(void)) {
+	/*
+	 * What happens here?
+	 * TIM2 is a 16-bit timer on the L0x3, so we pick the smallest prescaler that still allows the period to fit into the ARR. This gives the best resolution for the latency measurement.
+	 * The update interrupt then calls period_elapsed at the demanded rate.
+	 * Like TIM6, TIM2 is on APB1 with the x2 multiplier, so it is clocked at 16 MHz with the PLL32 profile. The actual timer clock is calculated (see TIM2Rescale).
+	 *
+	 * 1)Enable TIM2 clocking
+	 * 2)Set prescaler and ARR
+	 * 3)Enable update IRQ and the timer
+	 *
+	 * */
+
+	//1)
+	RCC->APB1ENR |= (1<<0);														//enable TIM2 clocking
+	TIM2->CR1 &= ~(1<<0);														//timer stopped while we set it up
+
+	//2)
+	tim2_rate_hz = rate_hz;
+	TIM2Rescale();
+
+	TIM2_stats.ticks = 0;
+	TIM2_stats.latency_last_us = 0;
+	TIM2_stats.latency_min_us = 0xFFFFFFFF;
+	TIM2_stats.latency_max_us = 0;
+	tim2_period_elapsed = period_elapsed;
+
+	//3)
+	TIM2->DIER |= (1<<0);														//update interrupt enabled
+	NVIC_SetPriority(TIM2_IRQn, 2);												//lower priority than the DMA/SPI IRQs
+	NVIC_EnableIRQ(TIM2_IRQn);
+	TIM2->CR1 |= (1<<0);														//timer counter enable bit
+}
+
+
+//8) Stop the TIM2 periodic interrupt
+void TIM2PeriodicStop (void) {
+
+	TIM2->CR1 &= ~(1<<0);
+	TIM2->DIER &= ~(1<<0);
+	NVIC_DisableIRQ(TIM2_IRQn);
+}
+
+
+//9) TIM2 IRQ
+void TIM2_IRQHandler (void) {
+	/*
+	 * What happens here?
+	 * The counter restarted from 0 at the update event, so its value now is the latency of the IRQ.
+	 * We update the latency statistics, clear the flag and call the callback.
+	 * Without UIF, there is no period to count: the IRQ was left pending in the NVIC by a flag that has been cleared since.
+	 *
+	 * */
+
+	if (!(TIM2->SR & (1<<0))) return;
+
+	uint32_t latency_us = (TIM2->CNT * tim2_tick_ns) / 1000;
+	TIM2->SR &= ~(1<<0);														//clear UIF
+
+	TIM2_stats.ticks++;
+	TIM2_stats.latency_last_us = latency_us;
+	if (latency_us < TIM2_stats.latency_min_us) TIM2_stats.latency_min_us = latency_us;
+	if (latency_us > TIM2_stats.latency_max_us) TIM2_stats.latency_max_us = latency_us;
+
+	if (tim2_period_elapsed) tim2_period_elapsed();
+}
+
+
+//10) Put a software timer into the sorted queue
+static void TIM6TimerInsert (SoftTimer* timer) {
+	/*
+	 * We walk the queue until we find the first timer that expires after this one. Deadlines are compared as a signed difference, so the time stamp wrap does not matter.
+	 * Timers with the same deadline are called in the order they were started.
+	 *
+	 * Note: must be called with interrupts off.
+	 *
+	 * */
+
+	SoftTimer** slot = &tim6_timer_queue;
+	while (*slot && ((int32_t)((*slot)->deadline - timer->deadline) <= 0)) {
+		slot = &(*slot)->next;
+	}
+	timer->next = *slot;
+	*slot = timer;
+	timer->active = 1;
+}
+
+
+//11) Take a software timer out of the queue
+static void TIM6TimerRemove (SoftTimer* timer) {
+	/*
+	 * Note: must be called with interrupts off.
+	 *
+	 * */
+
+	SoftTimer** slot = &tim6_timer_queue;
+	while (*slot && (*slot != timer)) {
+		slot = &(*slot)->next;
+	}
+	if (*slot) *slot = timer->next;
+	timer->next = 0;
+	timer->active = 0;
+}
+
+
+//12) Start a software timer
+void TIM6TimerStart (SoftTimer* timer, uint32_t delay_us, uint32_t period_us, void (*expired)(void)) {
+	/*
+	 * What happens here?
+	 * The timer expires delay_us from now and calls expired from the TIM6 IRQ. With a period_us other than 0, it is then restarted with that period.
+	 * A timer that is already running is restarted.
+	 *
+	 * Note: the timer struct is owned by the caller and must stay valid while the timer runs (static or global).
+	 * Note: the callbacks are called on the next ms tick after the deadline, so they are late by up to 1 ms.
+	 *
+	 * */
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (timer->active) TIM6TimerRemove(timer);
+	timer->deadline = TIM6Now() + delay_us;
+	timer->period_us = period_us;
+	timer->expired = expired;
+	TIM6TimerInsert(timer);
+	__set_PRIMASK(primask);
+}
+
+
+//13) Stop a software timer
+void TIM6TimerStop (SoftTimer* timer) {
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (timer->active) TIM6TimerRemove(timer);
+	__set_PRIMASK(primask);
+}
+
+
+//14) ms tick
+uint32_t TIM6Millis (void) {
+
+	return tim6_ms;
+}
+
+
+//15) TIM6 IRQ
+void TIM6_DAC_IRQHandler (void) {
+	/*
+	 * What happens here?
+	 * We step the ms count, then call every timer at the front of the queue whose deadline has passed.
+	 * The ms count is only stepped if UIF is HIGH. The IRQ can also be pending in the NVIC from a wrap that was already counted and cleared with the interrupts off (see TIM6AddMillis).
+	 * A periodic timer is put back into the queue with its next deadline before its callback is called, so the callback may stop it.
+	 * The next deadline is counted from the previous one, not from now, so a periodic timer does not drift.
+	 *
+	 * */
+
+	if (TIM6->SR & (1<<0)) {
+		TIM6->SR &= ~(1<<0);													//clear UIF
+		tim6_ms++;
+	}
+
+	uint32_t us = TIM6->CNT;
+	if (tim6_ticks_per_ms != 1000) us = (us * 1000) / tim6_ticks_per_ms;
+	uint32_t now = (tim6_ms * 1000) + us;
+	while (tim6_timer_queue && ((int32_t)(tim6_timer_queue->deadline - now) <= 0)) {
+		SoftTimer* timer = tim6_timer_queue;
+		tim6_timer_queue = timer->next;
+		timer->next = 0;
+		timer->active = 0;
+		if (timer->period_us) {
+			timer->deadline += timer->period_us;
+			TIM6TimerInsert(timer);
+		}
+		if (timer->expired) timer->expired();
+	}
+}
+
+
+//16) Register a clock change hook
+void ClockRegisterHook (void (*clock_changed)(void)) {
+	/*
+	 * The hook is called after every clock profile switch, once SystemCoreClock, TIM6 and TIM2 are updated.
+	 * Up to CLOCK_HOOKS hooks can be registered. Registering the same hook twice does nothing.
+	 *
+	 * */
+
+	for (uint8_t i = 0; i < CLOCK_HOOKS; i++) {
+		if (clock_hooks[i] == clock_changed) return;
+		if (clock_hooks[i] == 0) {
+			clock_hooks[i] = clock_changed;
+			return;
+		}
+	}
+}
+
+
+//17) Switch to a clock profile
+void ClockSetProfile (uint8_t profile) {
+	/*
+	 * What happens here?
+	 * We switch SYSCLK over to the new source and set the APB dividers so that the APB1 timers still run at 16 MHz where possible:
+	 * - CLOCK_PROFILE_PLL32: HSI16 -> PLL x4 /2 = 32 MHz, APB1 /4 (timers 16 MHz), APB2 /2 (16 MHz), 1 wait state
+	 * - CLOCK_PROFILE_HSI16: HSI16 directly, APB1 /2 (timers 16 MHz), APB2 /1 (16 MHz), 0 wait states
+	 * - CLOCK_PROFILE_MSI: MSI range 5 (2.097 MHz), APB1 and APB2 /1, 0 wait states
+	 * The flash gets its wait state before going up to 32 MHz and loses it only after we have come down.
+	 * The oscillators we don't need anymore are turned off after the switch (PLL, HSI16).
+	 * We then recalculate TIM6 (keeping the time stamp running) and TIM2 (if it is running), and call the hooks.
+	 *
+	 * Note: must not be called while a transfer is ongoing or from an IRQ. The core voltage stays in range 1.
+ * Note: TIM6 is re-seeded from a time stamp taken before its registers are written, so the time stamp loses the time of those writes (some 30 us going to MSI).
+	 *
+	 * */
+
+	if (profile == clock_profile) return;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	FLASH->ACR |= (1<<0);														//1 WS - safe for any clock
+
+	if (profile == CLOCK_PROFILE_MSI) {
+		RCC->CR |= (1<<8);														//MSI on
+		while (!(RCC->CR & (1<<9)));
+		RCC->ICSCR = (RCC->ICSCR & ~(7<<13)) | (5<<13);							//range 5 - 2.097 MHz
+		RCC->CFGR &= ~((7<<8) | (7<<11));										//APB1 and APB2 /1
+		RCC->CFGR &= ~(3<<0);													//MSI as source
+		while ((RCC->CFGR & (3<<2)) != (0<<2));
+	} else {
+		RCC->CR |= (1<<0);														//HSI16 on
+		while (!(RCC->CR & (1<<2)));
+		if (profile == CLOCK_PROFILE_HSI16) {
+			RCC->CFGR = (RCC->CFGR & ~((7<<8) | (7<<11))) | (4<<8);				//APB1 /2, APB2 /1
+			RCC->CFGR = (RCC->CFGR & ~(3<<0)) | (1<<0);							//HSI16 as source
+			while ((RCC->CFGR & (3<<2)) != (1<<2));
+		} else {
+			if (!(RCC->CR & (1<<25))) {
+				RCC->CFGR &= ~((1<<16) | (15<<18) | (3<<22));					//PLL can only be set up while it is off
+				RCC->CFGR |= (1<<18) | (1<<22);									//HSI16 source, x4, /2
+				RCC->CR |= (1<<24);												//PLL on
+				while (!(RCC->CR & (1<<25)));
+			}
+			RCC->CFGR = (RCC->CFGR & ~((7<<8) | (7<<11))) | (5<<8) | (4<<11);	//APB1 /4, APB2 /2
+			RCC->CFGR |= (3<<0);												//PLL as source
+			while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL);
+		}
+	}
+
+	if (profile != CLOCK_PROFILE_PLL32) {
+		RCC->CR &= ~(1<<24);													//PLL off
+		FLASH->ACR &= ~(1<<0);													//0 WS is enough up to 16 MHz
+	}
+	if (profile == CLOCK_PROFILE_MSI) RCC->CR &= ~(1<<0);						//HSI16 off
+	clock_profile = profile;
+
+	SystemCoreClockUpdate();
+
+	//TIM6: we keep the ms count and move the counter to the same position within the ms
+	uint32_t us_in_ms = TIM6Now() % 1000;
+	TIM6->CR1 |= (1<<2);														//URS - the forced update below doesn't set UIF
+	TIM6->PSC = TIM6Prescaler() - 1;
+	TIM6->ARR = tim6_ticks_per_ms - 1;
+	TIM6->EGR |= (1<<0);														//we load the new PSC
+	TIM6->CNT = (us_in_ms * tim6_ticks_per_ms) / 1000;
+	TIM6->CR1 &= ~(1<<2);
+
+	if (TIM2->CR1 & (1<<0)) TIM2Rescale();
+
+	__set_PRIMASK(primask);
+
+	for (uint8_t i = 0; i < CLOCK_HOOKS; i++) {
+		if (clock_hooks[i]) clock_hooks[i]();
+	}
+}
+
+
+//18) Active clock profile
+uint8_t ClockGetProfile (void) {
+
+	return clock_profile;
+}
+
+
+//19) Add ms ticks that were counted outside the TIM6 IRQ
+void TIM6AddMillis (uint32_t ms) {
+	/*
+	 * The UIF flag only holds one wrap. If the interrupts are off for longer than a ms, the code that kept them off must count the wraps itself (clearing UIF each time) and add them here.
+	 * Soft timers that expired in the meantime are called on the next TIM6 IRQ. The IRQ pending from the first wrap is still called then, but it doesn't step the ms count again (UIF is LOW).
+	 *
+	 * Note: must be called with interrupts off, before the TIM6 IRQ can run again.
+	 *
+	 * */
+
+	tim6_ms += ms;
+}
+
+
+//20) Count a TIM6 wrap with the interrupts off
+void TIM6CatchWrap (void) {
+	/*
+	 * Same as counting the wraps and calling TIM6AddMillis, but one wrap at a time, so TIM6Now stays valid within the loop that calls it.
+	 *
+	 * Note: must be called with interrupts off, at least once per ms.
+	 *
+	 * */
+
+	if (TIM6->SR & (1<<0)) {
+		TIM6->SR &= ~(1<<0);													//clear UIF
+		tim6_ms++;
 	}
 }
@@ -14,11 +14,49 @@
 #include "stdint.h"
 
 //LOCAL CONSTANT
+#define CLOCK_PROFILE_PLL32			0								//HSI16 + PLL, 32 MHz - SysClockConfig
+#define CLOCK_PROFILE_HSI16			1								//HSI16, 16 MHz
+#define CLOCK_PROFILE_MSI			2								//MSI range 5, 2.097 MHz
+#define CLOCK_HOOKS					4								//number of clock change hooks
+
+//LOCAL TYPES
+typedef struct {
+	uint32_t ticks;													//number of periods elapsed
+	uint32_t latency_last_us;										//time between the update event and the callback
+	uint32_t latency_min_us;
+	uint32_t latency_max_us;										//jitter is latency_max_us - latency_min_us
+} PeriodicStats;
+
+typedef struct SoftTimer {
+	uint32_t deadline;												//TIM6 time stamp of the next expiry
+	uint32_t period_us;												//0 for a one-shot timer
+	void (*expired)(void);											//called from the TIM6 IRQ
+	struct SoftTimer* next;											//next timer in the queue
+	uint8_t active;
+} SoftTimer;
+
+//EXTERNAL VARIABLE
+extern volatile PeriodicStats TIM2_stats;
 
 //FUNCTION PROTOTYPES
 void SysClockConfig(void);
 void TIM6Config (void);
 void Delay_us(int micro_sec);
 void Delay_ms(int milli_sec);
+uint32_t TIM6Now(void);
+uint32_t TIM6Elapsed(uint32_t since);
+void TIM2PeriodicConfig (uint32_t rate_hz, void (*period_elapsed)(void));
+void TIM2PeriodicStop (void);
+void TIM6TimerStart (SoftTimer* timer, uint32_t delay_us, uint32_t period_us, void (*expired)(void));
+void TIM6TimerStop (SoftTimer* timer);
+uint32_t TIM6Millis (void);
+uint32_t ClockAPB1Hz (void);
+uint32_t ClockAPB1TimerHz (void);
+uint32_t ClockAPB2Hz (void);
+void ClockRegisterHook (void (*clock_changed)(void));
+void ClockSetProfile (uint8_t profile);
+uint8_t ClockGetProfile (void);
+void TIM6AddMillis (uint32_t ms);
+void TIM6CatchWrap (void);
 
 #endif /* RCCTIMPWMDELAY_CUSTOM_H_ */
@@ -0,0 +1,129 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: NVMDriver_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * Minimal data EEPROM access, word by word.
+ * The data EEPROM is memory mapped, so reading is just a copy. Writing needs the PECR to be unlocked first and each word to be waited for.
+ * Words that already hold the value to be written are skipped. This saves time (~3.2 ms per word) and EEPROM wear when the same data is stored again.
+ *
+ * Note: the CPU stalls when it fetches from the flash while the EEPROM is being programmed. It is safe, but not quick: no IRQ is served until the word is done.
+ *
+ * v.1.1
+ * The stall above made TIM6 wrap ~3 times per word while only one wrap could be caught up (UIF), so the time base lost ~2 ms with every word written.
+ * A word is now programmed and waited for by a function running from RAM (.RamFunc), with the interrupts off. It counts the TIM6 wraps itself and they are added to the ms count afterwards (TIM6AddMillis), so the time stamps stay correct.
+ * IRQs are still held back until the word is done (the vector table is in the flash). Soft timers that expired in the meantime are called right after.
+ *
+ */
+
+#include "NVMDriver_STM32L0x3.h"
+
+//1) Unlock the PECR
+static void NVMUnlock (void) {
+	/*
+	 * What happens here?
+	 * The data EEPROM is unlocked by writing the two keys into PEKEYR, in this order. A wrong sequence locks the PECR until the next reset.
+	 *
+	 * */
+
+	if (FLASH->PECR & (1<<0)) {												//PELOCK
+		FLASH->PEKEYR = 0x89ABCDEF;
+		FLASH->PEKEYR = 0x02030405;
+	}
+}
+
+
+//2) Lock the PECR
+static void NVMLock (void) {
+
+	FLASH->PECR |= (1<<0);													//PELOCK
+}
+
+
+//3) Program one word and wait for the end of the programming
+__attribute__((section(".RamFunc"), noinline)) static uint32_t NVMProgramWord (volatile uint32_t* destination, uint32_t word) {
+	/*
+	 * What happens here?
+	 * This function runs from RAM, so the CPU does not stall while the word is being programmed.
+	 * It is called with the interrupts off and must not call anything in the flash. Hence, TIM6 is read directly: every wrap (UIF) is cleared and counted, and the count doubles as the timeout.
+	 * We give back the number of wraps.
+	 *
+	 * */
+
+	uint32_t wraps = 0;
+	*destination = word;
+	while ((FLASH->SR & (1<<0)) && (wraps <= NVM_WRITE_TIMEOUT_MS)) {		//BSY
+		if (TIM6->SR & (1<<0)) {											//UIF
+			TIM6->SR &= ~(1<<0);
+			wraps++;
+		}
+	}
+	return wraps;
+}
+
+
+//4) Write one word
+static uint8_t NVMWriteWord (volatile uint32_t* destination, uint32_t word) {
+	/*
+	 * What happens here?
+	 * We program the word from RAM with the interrupts off, then add the TIM6 wraps that happened meanwhile to the ms count.
+	 * Lastly, we check the error flags. The error flags are cleared by writing 1 to them.
+	 *
+	 * */
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint32_t wraps = NVMProgramWord(destination, word);
+	TIM6AddMillis(wraps);
+	__set_PRIMASK(primask);
+
+	if (FLASH->SR & (1<<0)) return NVM_ERROR_TIMEOUT;						//BSY
+
+	uint32_t errors = FLASH->SR & ((1<<8) | (1<<9) | (1<<10));				//WRPERR, PGAERR, SIZERR
+	if (errors) {
+		FLASH->SR = errors;
+		return NVM_ERROR_WRITE;
+	}
+	return NVM_OK;
+}
+
+
+//5) Read words from the data EEPROM
+void NVMEEPROMRead (uint32_t address, uint32_t* words, uint8_t number_of_words) {
+
+	volatile uint32_t* source = (volatile uint32_t*)(uintptr_t) address;
+	for (uint8_t i = 0; i < number_of_words; i++) {
+		words[i] = source[i];
+	}
+}
+
+
+//6) Write words into the data EEPROM
+uint8_t NVMEEPROMWrite (uint32_t address, const uint32_t* words, uint8_t number_of_words) {
+	/*
+	 * What happens here?
+	 * We unlock, write the words one by one (skipping the ones that are already the same) and lock again.
+	 * The address must be word aligned and within the data EEPROM.
+	 *
+	 * */
+
+	if ((address & 3) || (address < NVM_EEPROM_START) || ((address + 4 * number_of_words - 1) > NVM_EEPROM_END)) return NVM_ERROR_ADDRESS;
+
+	volatile uint32_t* destination = (volatile uint32_t*)(uintptr_t) address;
+	uint8_t error = NVM_OK;
+
+	NVMUnlock();
+	for (uint8_t i = 0; i < number_of_words; i++) {
+		if (destination[i] == words[i]) continue;
+		error = NVMWriteWord(&destination[i], words[i]);
+		if (error) break;
+	}
+	NVMLock();
+
+	return error;
+}
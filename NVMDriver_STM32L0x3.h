@@ -0,0 +1,31 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: NVMDriver_STM32L0x3.h
+ */
+
+#ifndef INC_NVMDRIVER_CUSTOM_H_
+#define INC_NVMDRIVER_CUSTOM_H_
+
+#include "stdint.h"
+#include "stm32l053xx.h"											//device specific header file for registers
+#include "ClockDriver_STM32L0x3.h"									//TIM6 time base for the write timeout
+
+//LOCAL CONSTANT
+#define NVM_EEPROM_START			0x08080000						//data EEPROM, 2 kbytes on the L053
+#define NVM_EEPROM_END				0x080807FF
+#define NVM_WRITE_TIMEOUT_MS		10								//one word takes ~3.2 ms with the erase
+
+#define NVM_OK						0
+#define NVM_ERROR_TIMEOUT			1
+#define NVM_ERROR_WRITE				2								//write protection, alignment or size error
+#define NVM_ERROR_ADDRESS			3								//outside of the data EEPROM
+
+//FUNCTION PROTOTYPES
+void NVMEEPROMRead (uint32_t address, uint32_t* words, uint8_t number_of_words);
+uint8_t NVMEEPROMWrite (uint32_t address, const uint32_t* words, uint8_t number_of_words);
+
+#endif /* INC_NVMDRIVER_CUSTOM_H_ */
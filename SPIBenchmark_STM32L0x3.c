@@ -0,0 +1,372 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: SPIBenchmark_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * On-target measurements of the SPI driver. Results are published over the printf retarget (USART2).
+ * Time is measured using the free running TIM6 with 1 us resolution, so every measurement is repeated SPI1_BENCHMARK_REPEAT times to have enough resolution.
+ *
+ * Stream measurement: effective bytes/second of the polling read (SPI1MasterRead) versus the streaming read (SPI1MasterReadStream) for multiple transfer sizes.
+ * The ideal value at 8 MHz SCK is 1 MByte/s. The "effective" value includes the CS and SPE overhead of every transaction as well.
+ *
+ * v.1.1
+ * Compensation measurement: the BMP280 batch compensation is compared to the datasheet's reference formulas (copied here verbatim) on a set of synthetic raw samples.
+ * We publish the number of mismatching results and the core clock cycles spent per sample for both.
+ *
+ * v.1.2
+ * Benchmark suite: all transfer modes (polling, streaming, DMA, IT), reads and writes, for every transfer size.
+ * For each combination, we publish the effective bytes/second, the min/average/max transaction latency and the CPU-busy time per transaction.
+ * CPU-busy time is the latency for the blocking modes. For the DMA and IT modes, we count how many rounds of a spin loop the CPU can still do while the transfer is running,
+ * and subtract that (calibrated against an idle 1 ms) from the latency.
+ * These measurements run on the board itself. The same suite also runs on a PC against the register model in host/ (make -C host bench).
+ *
+ * v.1.3
+ * The 16-bit frame functions are added to the suite as the "wide" mode. Compare them to the "poll" rows: same blocking behaviour, half the DR accesses.
+ *
+ * v.1.4
+ * Static measurement: the 6-byte read through the device handle, the run-time SPI1MasterRead, the compile-time specialised read and the hand-unrolled 6-byte read, in core clock cycles per transaction.
+ * The specialised functions are wrapped into non-inlined functions here (SPI1BenchmarkStaticRead, SPI1BenchmarkStaticRead6) so their code size can be compared to SPI1MasterRead in the map file
+ * or with "arm-none-eabi-nm -S --size-sort" on the elf. The code size can't be measured on the board itself.
+ *
+ * v.1.6
+ * The code sizes are measured by "make size" in host/ (the host objects by default, or the board's elf with arm-none-eabi-nm). The static read is skipped if SPI1BenchmarkDeviceSelect refuses the switch.
+ *
+ * v.1.5
+ * The compensation measurement is split: BMP280BenchmarkCompensationRun does one set of samples from a given seed and returns the mismatches and the cycles, BMP280BenchmarkCompensation prints it.
+ * The host build runs many sets and fails on any mismatch. The clock is BMP280_BENCHMARK_CYCLES (TIM6 on the board). The host build swaps it for the host's own cycle counter, since compute-only code costs no simulated time.
+ *
+ */
+
+#include "SPIBenchmark_STM32L0x3.h"
+
+//LOCAL VARIABLES
+static uint8_t benchmark_buf[SPI1_BENCHMARK_MAX_BYTES];
+static const uint8_t benchmark_sizes[] = {1, 6, 24, 64, 128};
+static BMP280Sample benchmark_samples[BMP280_BENCHMARK_SAMPLES];
+static int32_t reference_temperature[BMP280_BENCHMARK_SAMPLES];
+static const char* const benchmark_mode_names[SPI1_BENCHMARK_MODES] = {"poll", "stream", "dma", "it", "wide"};
+static uint32_t reference_pressure[BMP280_BENCHMARK_SAMPLES];
+
+SPI1_STATIC_DEVICE(SPI1BenchmarkDevice, SPI1_BENCHMARK_STATIC_PORT, SPI1_BENCHMARK_STATIC_PIN, SPIMODE0, SPI1_BAUD_DIV2)
+
+//1) Bytes per second from a time measurement
+static uint32_t SPI1BenchmarkRate (uint32_t bytes, uint32_t elapsed_us) {
+
+	if (elapsed_us == 0) return 0;
+	return (uint32_t)(((uint64_t)bytes * 1000000) / elapsed_us);
+}
+
+
+//2) Polling versus streaming read
+void SPI1BenchmarkStream (SPI1Device* device, uint8_t reg_addr_to_read_from) {
+	/*
+	 * What happens here?
+	 * For each transfer size, we time SPI1_BENCHMARK_REPEAT polling reads and then the same number of streaming reads.
+	 * We publish the average transaction time and the effective bytes/second for both.
+	 *
+	 * */
+
+	printf("SPI1 stream benchmark (%d transfers per size) \r\n", SPI1_BENCHMARK_REPEAT);
+	printf("bytes | poll us | poll B/s | stream us | stream B/s \r\n");
+
+	SPI1DeviceSelect(device);
+
+	for (uint8_t i = 0; i < sizeof(benchmark_sizes); i++) {
+		uint8_t size = benchmark_sizes[i];
+
+		uint32_t start = TIM6Now();
+		for (uint8_t j = 0; j < SPI1_BENCHMARK_REPEAT; j++) {
+			SPI1MasterRead(reg_addr_to_read_from, benchmark_buf, size, device->cs_port, device->cs_pin);
+		}
+		uint32_t poll_us = TIM6Elapsed(start);
+
+		start = TIM6Now();
+		for (uint8_t j = 0; j < SPI1_BENCHMARK_REPEAT; j++) {
+			SPI1MasterReadStream(reg_addr_to_read_from, benchmark_buf, size, device->cs_port, device->cs_pin);
+		}
+		uint32_t stream_us = TIM6Elapsed(start);
+
+		uint32_t total_bytes = (uint32_t)size * SPI1_BENCHMARK_REPEAT;
+		printf("%u | %lu | %lu | %lu | %lu \r\n", size,
+				(unsigned long)(poll_us / SPI1_BENCHMARK_REPEAT), (unsigned long)SPI1BenchmarkRate(total_bytes, poll_us),
+				(unsigned long)(stream_us / SPI1_BENCHMARK_REPEAT), (unsigned long)SPI1BenchmarkRate(total_bytes, stream_us));
+	}
+}
+
+
+
+//3) Datasheet reference temperature formula
+static int32_t BMP280ReferenceTemperature (BMP280Calib* calib, int32_t adc_T, int32_t* t_fine) {
+
+	int32_t var1, var2;
+
+	var1 = ((((adc_T>>3) - ((int32_t)calib->dig_T1<<1))) * ((int32_t)calib->dig_T2)) >> 11;
+	var2 = (((((adc_T>>4) - ((int32_t)calib->dig_T1)) * ((adc_T>>4) - ((int32_t)calib->dig_T1))) >> 12) * ((int32_t)calib->dig_T3)) >> 14;
+	*t_fine = var1 + var2;
+
+	return (*t_fine * 5 + 128) >> 8;
+}
+
+
+//4) Datasheet reference 64-bit pressure formula
+static uint32_t BMP280ReferencePressure (BMP280Calib* calib, int32_t adc_P, int32_t t_fine) {
+
+	int64_t var1, var2, p;
+
+	var1 = ((int64_t)t_fine) - 128000;
+	var2 = var1 * var1 * (int64_t)calib->dig_P6;
+	var2 = var2 + ((var1*(int64_t)calib->dig_P5)<<17);
+	var2 = var2 + (((int64_t)calib->dig_P4)<<35);
+	var1 = ((var1 * var1 * (int64_t)calib->dig_P3)>>8) + ((var1 * (int64_t)calib->dig_P2)<<12);
+	var1 = (((((int64_t)1)<<47)+var1))*((int64_t)calib->dig_P1)>>33;
+	if (var1 == 0) return 0;
+	p = 1048576-adc_P;
+	p = (((p<<31)-var2)*3125)/var1;
+	var1 = (((int64_t)calib->dig_P9) * (p>>13) * (p>>13)) >> 25;
+	var2 = (((int64_t)calib->dig_P8) * p) >> 19;
+	p = ((p + var1 + var2) >> 8) + (((int64_t)calib->dig_P7)<<4);
+
+	return (uint32_t)p;
+}
+
+
+//5) Batch compensation versus the reference - one set of samples
+void BMP280BenchmarkCompensationRun (BMP280Calib* calib, uint32_t seed, BMP280BenchmarkResult* result) {
+	/*
+	 * What happens here?
+	 * We generate a set of raw samples around realistic values (pseudo-random from the seed, so the result is repeatable).
+	 * Every fourth sample repeats the previous temperature, like it would with pressure oversampling on a stable temperature.
+	 * We time the reference formulas for all samples, then the batch compensation, and count the samples where the two differ.
+	 * On the board, cycles are calculated from the TIM6 us ticks and SystemCoreClock, so they are only as precise as the 1 us resolution allows.
+	 *
+	 * */
+
+	int32_t t_fine;
+	uint16_t mismatches = 0;
+
+	for (uint16_t i = 0; i < BMP280_BENCHMARK_SAMPLES; i++) {
+		seed = seed * 1103515245 + 12345;									//simple LCG
+		if (i & 3) {
+			benchmark_samples[i].adc_T = benchmark_samples[i - 1].adc_T;
+		} else {
+			benchmark_samples[i].adc_T = 450000 + ((seed >> 8) & 0xFFFF);
+		}
+		seed = seed * 1103515245 + 12345;
+		benchmark_samples[i].adc_P = 300000 + ((seed >> 8) & 0x3FFFF);
+	}
+
+	uint32_t start = BMP280_BENCHMARK_CYCLES();
+	for (uint16_t i = 0; i < BMP280_BENCHMARK_SAMPLES; i++) {
+		reference_temperature[i] = BMP280ReferenceTemperature(calib, benchmark_samples[i].adc_T, &t_fine);
+		reference_pressure[i] = BMP280ReferencePressure(calib, benchmark_samples[i].adc_P, t_fine);
+	}
+	result->reference_cycles = BMP280_BENCHMARK_CYCLES() - start;
+
+	start = BMP280_BENCHMARK_CYCLES();
+	BMP280CompensateBatch(calib, benchmark_samples, BMP280_BENCHMARK_SAMPLES);
+	result->batch_cycles = BMP280_BENCHMARK_CYCLES() - start;
+
+	for (uint16_t i = 0; i < BMP280_BENCHMARK_SAMPLES; i++) {
+		if ((benchmark_samples[i].temperature != reference_temperature[i]) || (benchmark_samples[i].pressure != reference_pressure[i])) mismatches++;
+	}
+
+	result->samples = BMP280_BENCHMARK_SAMPLES;
+	result->mismatches = mismatches;
+}
+
+
+//5a) Batch compensation versus the reference
+uint16_t BMP280BenchmarkCompensation (BMP280Calib* calib) {
+	/*
+	 * One set of samples, published. The number of mismatches is returned.
+	 *
+	 * */
+
+	BMP280BenchmarkResult result;
+	BMP280BenchmarkCompensationRun(calib, 12345, &result);
+
+	printf("BMP280 compensation benchmark (%d samples) \r\n", BMP280_BENCHMARK_SAMPLES);
+	printf("reference: %lu cycles/sample \r\n", (unsigned long)(result.reference_cycles / result.samples));
+	printf("batch: %lu cycles/sample \r\n", (unsigned long)(result.batch_cycles / result.samples));
+	printf("mismatches: %u \r\n", result.mismatches);
+	return result.mismatches;
+}
+
+
+
+//6) Spin loop for the CPU-busy measurement
+static uint32_t SPI1BenchmarkSpin (uint8_t calibrate) {
+	/*
+	 * We spin while an async transfer is ongoing (or for 1 ms when calibrating) and count the rounds.
+	 * The loop body is the same in both cases, so the rounds are comparable.
+	 *
+	 * */
+
+	uint32_t spins = 0;
+	uint32_t start = TIM6Now();
+
+	while (SPI1_DMA_busy || SPI1_IT_busy || calibrate) {
+		spins++;
+		if (TIM6Elapsed(start) >= 1000) calibrate = 0;
+	}
+
+	return spins;
+}
+
+
+//7) One transaction in the selected mode
+static void SPI1BenchmarkTransfer (SPI1Device* device, uint8_t mode, uint8_t write, uint8_t reg_addr, uint8_t size) {
+
+	switch (mode) {
+		case SPI1_BENCHMARK_POLL:
+			if (write) SPI1MasterWrite(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin);
+			else SPI1MasterRead(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin);
+			break;
+		case SPI1_BENCHMARK_STREAM:
+			if (write) SPI1MasterWriteStream(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin);
+			else SPI1MasterReadStream(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin);
+			break;
+		case SPI1_BENCHMARK_DMA:
+			if (write) SPI1MasterWriteDMA(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin, 0);
+			else SPI1MasterReadDMA(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin, 0);
+			break;
+		case SPI1_BENCHMARK_WIDE:
+			if (write) SPI1MasterWrite16(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin);
+			else SPI1MasterRead16(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin);
+			break;
+		default:
+			if (write) SPI1MasterWriteIT(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin, 0);
+			else SPI1MasterReadIT(reg_addr, benchmark_buf, size, device->cs_port, device->cs_pin, 0);
+			break;
+	}
+}
+
+
+//8) Benchmark suite
+void SPI1BenchmarkSuite (SPI1Device* device, uint8_t reg_addr_to_read_from, uint8_t reg_addr_write_to, uint8_t write_fill) {
+	/*
+	 * What happens here?
+	 * We calibrate the spin loop first, then go through every mode, read and write, and every transfer size.
+	 * Every transaction is timed on its own, so we have min/max values and no TIM6 overflow even for the slow combinations.
+	 * For the writes, the buffer is filled with write_fill.
+	 *
+	 * Note: the write transactions go to the slave for real. Pick a register (and fill value) that the slave ignores.
+	 * For the BMP280, writes are address/data pairs, so reg_addr_write_to = 0x7F and write_fill = 0x7F only ever hits the reserved 0xFF register.
+	 * Note: SPI1DMAInit must have been called before, and the DMA/IT transfers must not be used by anything else while we run.
+	 *
+	 * */
+
+	uint32_t spins_per_ms = SPI1BenchmarkSpin(1);
+
+	printf("SPI1 benchmark suite (%d transfers per row), spin loop: %lu rounds/ms \r\n", SPI1_BENCHMARK_REPEAT, (unsigned long)spins_per_ms);
+	printf("mode | op | bytes | B/s | min us | avg us | max us | cpu us \r\n");
+
+	SPI1DeviceSelect(device);
+
+	for (uint8_t mode = 0; mode < SPI1_BENCHMARK_MODES; mode++) {
+		for (uint8_t write = 0; write < 2; write++) {
+			for (uint8_t i = 0; i < sizeof(benchmark_sizes); i++) {
+				uint8_t size = benchmark_sizes[i];
+				uint32_t latency_min = 0xFFFFFFFF;
+				uint32_t latency_max = 0;
+				uint32_t latency_sum = 0;
+				uint32_t busy_sum = 0;
+
+				for (uint8_t j = 0; j < SPI1_BENCHMARK_REPEAT; j++) {
+					if (write) {
+						for (uint8_t k = 0; k < size; k++) benchmark_buf[k] = write_fill;
+					}
+
+					uint32_t start = TIM6Now();
+					SPI1BenchmarkTransfer(device, mode, write, (write ? reg_addr_write_to : reg_addr_to_read_from), size);
+					uint32_t spins = SPI1BenchmarkSpin(0);
+					uint32_t latency = TIM6Elapsed(start);
+
+					uint32_t free_us = (spins_per_ms) ? ((spins * 1000) / spins_per_ms) : 0;
+					uint32_t busy = (free_us < latency) ? (latency - free_us) : 0;
+
+					if (latency < latency_min) latency_min = latency;
+					if (latency > latency_max) latency_max = latency;
+					latency_sum += latency;
+					busy_sum += busy;
+				}
+
+				printf("%s | %s | %u | %lu | %lu | %lu | %lu | %lu \r\n", benchmark_mode_names[mode], (write ? "write" : "read"), size,
+						(unsigned long)SPI1BenchmarkRate((uint32_t)size * SPI1_BENCHMARK_REPEAT, latency_sum),
+						(unsigned long)latency_min, (unsigned long)(latency_sum / SPI1_BENCHMARK_REPEAT), (unsigned long)latency_max,
+						(unsigned long)(busy_sum / SPI1_BENCHMARK_REPEAT));
+			}
+		}
+	}
+}
+
+
+
+//9) Specialised read wrappers for the code size comparison
+static __attribute__((noinline)) uint8_t SPI1BenchmarkStaticRead (uint8_t reg_addr_to_read_from, uint8_t *bytes_received) {
+
+	return SPI1BenchmarkDeviceRead(reg_addr_to_read_from, bytes_received, 6);			//constant length - the compiler can unroll
+}
+
+static __attribute__((noinline)) uint8_t SPI1BenchmarkStaticRead6 (uint8_t reg_addr_to_read_from, uint8_t *bytes_received) {
+
+	return SPI1BenchmarkDeviceRead6(reg_addr_to_read_from, bytes_received);
+}
+
+
+//10) Run-time versus compile-time specialised 6-byte read
+void SPI1BenchmarkStatic (SPI1Device* device, uint8_t reg_addr_to_read_from) {
+	/*
+	 * What happens here?
+	 * We time SPI1_BENCHMARK_REPEAT 6-byte reads for each of the four versions and publish the core clock cycles per read.
+	 * The device handle must use SPIMODE0 and SPI1_BAUD_DIV2 so that all four versions run at the same SCK.
+	 *
+	 * Note: the handle version includes the pacing and the device selection, just like it is used in the application.
+	 *
+	 * */
+
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	uint32_t elapsed_us[4];
+
+	SPI1BenchmarkDeviceInit();
+
+	SPI1DeviceSelect(device);
+	uint32_t start = TIM6Now();
+	for (uint8_t j = 0; j < SPI1_BENCHMARK_REPEAT; j++) {
+		SPI1DeviceRead(device, reg_addr_to_read_from, benchmark_buf, 6);
+	}
+	elapsed_us[0] = TIM6Elapsed(start);
+
+	start = TIM6Now();
+	for (uint8_t j = 0; j < SPI1_BENCHMARK_REPEAT; j++) {
+		SPI1MasterRead(reg_addr_to_read_from, benchmark_buf, 6, device->cs_port, device->cs_pin);
+	}
+	elapsed_us[1] = TIM6Elapsed(start);
+
+	if (SPI1BenchmarkDeviceSelect()) {
+		printf("SPI1 static benchmark skipped: SPI1 is in use \r\n");
+		return;
+	}
+	start = TIM6Now();
+	for (uint8_t j = 0; j < SPI1_BENCHMARK_REPEAT; j++) {
+		SPI1BenchmarkStaticRead(reg_addr_to_read_from, benchmark_buf);
+	}
+	elapsed_us[2] = TIM6Elapsed(start);
+
+	start = TIM6Now();
+	for (uint8_t j = 0; j < SPI1_BENCHMARK_REPEAT; j++) {
+		SPI1BenchmarkStaticRead6(reg_addr_to_read_from, benchmark_buf);
+	}
+	elapsed_us[3] = TIM6Elapsed(start);
+
+	printf("SPI1 static benchmark (%d 6-byte reads per row) \r\n", SPI1_BENCHMARK_REPEAT);
+	printf("handle: %lu cycles/read \r\n", (unsigned long)((elapsed_us[0] * cycles_per_us) / SPI1_BENCHMARK_REPEAT));
+	printf("run-time: %lu cycles/read \r\n", (unsigned long)((elapsed_us[1] * cycles_per_us) / SPI1_BENCHMARK_REPEAT));
+	printf("static: %lu cycles/read \r\n", (unsigned long)((elapsed_us[2] * cycles_per_us) / SPI1_BENCHMARK_REPEAT));
+	printf("static unrolled: %lu cycles/read \r\n", (unsigned long)((elapsed_us[3] * cycles_per_us) / SPI1_BENCHMARK_REPEAT));
+}
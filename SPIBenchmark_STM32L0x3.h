@@ -0,0 +1,56 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: SPIBenchmark_STM32L0x3.h
+ */
+
+#ifndef INC_SPIBENCHMARK_CUSTOM_H_
+#define INC_SPIBENCHMARK_CUSTOM_H_
+
+#include "stdint.h"
+#include "stdio.h"
+#include "SPIDriver_STM32L0x3.h"									//custom SPI driver
+#include "ClockDriver_STM32L0x3.h"									//TIM6 time stamps
+#include "BMP280Driver_STM32L0x3.h"									//BMP280 compensation
+#include "SPIDriverStatic_STM32L0x3.h"								//compile-time specialised functions
+
+//LOCAL CONSTANT
+#define SPI1_BENCHMARK_REPEAT		32								//number of transfers per measurement
+#define SPI1_BENCHMARK_MAX_BYTES	128								//largest transfer we measure
+#define BMP280_BENCHMARK_SAMPLES	64								//number of raw samples for the compensation measurement
+
+#define SPI1_BENCHMARK_POLL			0								//transfer modes measured by the suite
+#define SPI1_BENCHMARK_STREAM		1
+#define SPI1_BENCHMARK_DMA			2
+#define SPI1_BENCHMARK_IT			3
+#define SPI1_BENCHMARK_WIDE			4								//polling with 16-bit frames
+#define SPI1_BENCHMARK_MODES		5
+
+#ifndef BMP280_BENCHMARK_CYCLES
+#define BMP280_BENCHMARK_CYCLES()	(TIM6Now() * (SystemCoreClock / 1000000))	//core clock cycles for the compensation timing, 1 us resolution
+#endif
+
+#ifndef SPI1_BENCHMARK_STATIC_PORT
+#define SPI1_BENCHMARK_STATIC_PORT	GPIOB							//CS of the compile-time specialised device - must be the same slave as the handle we compare to
+#define SPI1_BENCHMARK_STATIC_PIN	6
+#endif
+
+//LOCAL TYPES
+typedef struct {
+	uint16_t samples;
+	uint16_t mismatches;											//batch results that differ from the reference
+	uint32_t reference_cycles;										//all samples through the datasheet formulas
+	uint32_t batch_cycles;											//all samples through BMP280CompensateBatch
+} BMP280BenchmarkResult;
+
+//FUNCTION PROTOTYPES
+void SPI1BenchmarkStream (SPI1Device* device, uint8_t reg_addr_to_read_from);
+void BMP280BenchmarkCompensationRun (BMP280Calib* calib, uint32_t seed, BMP280BenchmarkResult* result);
+uint16_t BMP280BenchmarkCompensation (BMP280Calib* calib);
+void SPI1BenchmarkSuite (SPI1Device* device, uint8_t reg_addr_to_read_from, uint8_t reg_addr_write_to, uint8_t write_fill);
+void SPI1BenchmarkStatic (SPI1Device* device, uint8_t reg_addr_to_read_from);
+
+#endif /* INC_SPIBENCHMARK_CUSTOM_H_ */
@@ -0,0 +1,157 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: SPIDriverStatic_STM32L0x3.h
+ *  Change history:
+ *
+ * v.1.0
+ * Header-only, compile-time specialised version of the polling read/write functions.
+ * SPI1_STATIC_DEVICE generates a set of static inline functions for one device, with the CS port, CS pin, SPI mode and baud rate prescaler as constants:
+ * - the CS is a single store of a constant to BRR/BSRR, no read-modify-write and no port/pin arguments
+ * - the CR1 setup of the device is a constant, so switching to the device is one compare (and one write if it differs)
+ * - the read/write loops are inlined into the caller, so a fixed length (like the 6 bytes of the BMP280 data block) can be unrolled by the compiler
+ * - name##Read6 is the 6-byte read unrolled by hand
+ *
+ * The waits are bounded by a spin count instead of a TIM6 deadline to keep them small. On a timeout, the shared SPI1Recover resets SPI1 and the device setup is written back.
+ * There is no pacing and no instrumentation here: this is the lean path for hot loops. The device handles of the SPIDriver should be used for everything else.
+ *
+ * v.1.1
+ * name##Select refuses to change CR1 while SPE is on (SPI1_ERROR_BUSY): within a session or an ongoing DMA/IT transfer, BR/CPOL/CPHA must not change under the running SPI.
+ *
+ * Example:
+ *    SPI1_STATIC_DEVICE(BMP280Fast, GPIOB, 6, SPIMODE0, SPI1_BAUD_DIV2)		//at file scope
+ *    ...
+ *    BMP280FastInit();														//CS pin setup, SPI1MasterInit must have been called before
+ *    if (BMP280FastSelect() == SPI1_OK) BMP280FastRead6(0xF7, data);
+ *
+ */
+
+#ifndef INC_SPIDRIVERSTATIC_CUSTOM_H_
+#define INC_SPIDRIVERSTATIC_CUSTOM_H_
+
+#include "stdint.h"
+#include "stm32l053xx.h"											//device specific header file for registers
+#include "SPIDriver_STM32L0x3.h"									//constants, SPI1Recover and SPI1DeviceRelease
+
+//LOCAL CONSTANT
+#ifndef SPI1_STATIC_SPIN_LIMIT
+#define SPI1_STATIC_SPIN_LIMIT		8000							//poll rounds before we give up on a flag - roughly SPI1_TIMEOUT_US at 32 MHz
+#endif
+
+#define SPI1_STATIC_INLINE			static inline __attribute__((always_inline))
+
+//1) Bounded wait for an SR flag
+SPI1_STATIC_INLINE uint8_t SPI1StaticWait (uint32_t flag, uint32_t expected) {
+
+	uint32_t spins = SPI1_STATIC_SPIN_LIMIT;
+	while ((SPI1->SR & flag) != expected) {
+		if (--spins == 0) return SPI1_ERROR_TIMEOUT;
+	}
+	return SPI1_OK;
+}
+
+//2) One frame in, one frame out
+#define SPI1_STATIC_EXCHANGE(tx, rx, fault)		SPI1->DR = (tx);															\
+												if (SPI1StaticWait((1<<0), (1<<0))) goto fault;								\
+												rx = SPI1->DR;
+
+//3) Device function generator
+/*
+ * What happens here?
+ * We generate the functions for one device. Everything that was a function argument before is a constant here.
+ * name##Init sets up the CS pin (same as SPI1CSInit).
+ * name##Select writes the device bits into CR1 if they differ. Since this bypasses the device handles, the active device of the driver is released.
+ * If the bits differ while SPE is on (an open session or an ongoing DMA/IT transfer), nothing is written and SPI1_ERROR_BUSY is returned.
+ * name##Read and name##Write follow SPI1MasterRead/SPI1MasterWrite. With a constant number_of_bytes, the loop can be unrolled.
+ * name##Read6 is the BMP280 data block read, unrolled.
+ *
+ * Note: SPE is turned off right after the CS is released. The CR1 write takes longer than the 50 ns SDO disable time at 32 MHz, so there is no Delay_us here.
+ * Note: the device must be selected (name##Select) before the first transaction and whenever another device has used the bus.
+ * Note: the prescaler is a constant, so it is not recalculated after a clock profile switch (unlike the device handles).
+ *
+ * */
+
+#define SPI1_STATIC_DEVICE(name, port, pin, spi_mode, baud_prescaler)											\
+																												\
+static const uint32_t name##_CR1 = (((spi_mode) & 3)<<0) | (((baud_prescaler) & 7)<<3);							\
+																												\
+static inline void name##Init (void) {																			\
+	(port)->BSRR = (1<<(pin));																					\
+	(port)->OSPEEDR |= (3<<((pin) * 2));																		\
+	(port)->MODER = ((port)->MODER & ~(3<<((pin) * 2))) | (1<<((pin) * 2));									\
+	(port)->PUPDR |= (1<<((pin) * 2));																			\
+}																												\
+																												\
+SPI1_STATIC_INLINE uint8_t name##Select (void) {																\
+	if ((SPI1->CR1 & SPI1_DEVICE_CR1_MASK) != name##_CR1) {														\
+		if (SPI1->CR1 & (1<<6)) return SPI1_ERROR_BUSY;															\
+		SPI1->CR1 = (SPI1->CR1 & ~SPI1_DEVICE_CR1_MASK) | name##_CR1;											\
+		SPI1DeviceRelease();																					\
+	}																											\
+	return SPI1_OK;																								\
+}																												\
+																												\
+static inline uint8_t name##Fault (void) {																		\
+	uint8_t error = SPI1Recover(SPI1_ERROR_TIMEOUT, (port), (pin));											\
+	SPI1->CR1 = (SPI1->CR1 & ~SPI1_DEVICE_CR1_MASK) | name##_CR1;												\
+	return error;																								\
+}																												\
+																												\
+SPI1_STATIC_INLINE uint8_t name##Read (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint8_t number_of_bytes) {	\
+	uint8_t rx_byte;																							\
+	(port)->BRR = (1<<(pin));																					\
+	SPI1->CR1 |= (1<<6);																						\
+	SPI1_STATIC_EXCHANGE(reg_addr_to_read_from, rx_byte, fault);												\
+	for (uint8_t i = 0; i < number_of_bytes; i++) {																\
+		SPI1_STATIC_EXCHANGE(0xFF, bytes_received[i], fault);													\
+	}																											\
+	if (SPI1StaticWait((1<<7), 0)) goto fault;																	\
+	(port)->BSRR = (1<<(pin));																					\
+	SPI1->CR1 &= ~(1<<6);																						\
+	(void) rx_byte;																								\
+	return SPI1_OK;																								\
+fault:																											\
+	return name##Fault();																						\
+}																												\
+																												\
+SPI1_STATIC_INLINE uint8_t name##Write (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint8_t number_of_bytes) {	\
+	uint8_t rx_byte;																							\
+	(port)->BRR = (1<<(pin));																					\
+	SPI1->CR1 |= (1<<6);																						\
+	SPI1_STATIC_EXCHANGE(reg_addr_write_to, rx_byte, fault);													\
+	for (uint8_t i = 0; i < number_of_bytes; i++) {																\
+		SPI1_STATIC_EXCHANGE(bytes_to_send[i], rx_byte, fault);													\
+	}																											\
+	if (SPI1StaticWait((1<<7), 0)) goto fault;																	\
+	(port)->BSRR = (1<<(pin));																					\
+	SPI1->CR1 &= ~(1<<6);																						\
+	(void) rx_byte;																								\
+	return SPI1_OK;																								\
+fault:																											\
+	return name##Fault();																						\
+}																												\
+																												\
+SPI1_STATIC_INLINE uint8_t name##Read6 (uint8_t reg_addr_to_read_from, uint8_t *bytes_received) {			\
+	uint8_t rx_byte;																							\
+	(port)->BRR = (1<<(pin));																					\
+	SPI1->CR1 |= (1<<6);																						\
+	SPI1_STATIC_EXCHANGE(reg_addr_to_read_from, rx_byte, fault);												\
+	SPI1_STATIC_EXCHANGE(0xFF, bytes_received[0], fault);														\
+	SPI1_STATIC_EXCHANGE(0xFF, bytes_received[1], fault);														\
+	SPI1_STATIC_EXCHANGE(0xFF, bytes_received[2], fault);														\
+	SPI1_STATIC_EXCHANGE(0xFF, bytes_received[3], fault);														\
+	SPI1_STATIC_EXCHANGE(0xFF, bytes_received[4], fault);														\
+	SPI1_STATIC_EXCHANGE(0xFF, bytes_received[5], fault);														\
+	if (SPI1StaticWait((1<<7), 0)) goto fault;																	\
+	(port)->BSRR = (1<<(pin));																					\
+	SPI1->CR1 &= ~(1<<6);																						\
+	(void) rx_byte;																								\
+	return SPI1_OK;																								\
+fault:																											\
+	return name##Fault();																						\
+}
+
+#endif /* INC_SPIDRIVERSTATIC_CUSTOM_H_ */
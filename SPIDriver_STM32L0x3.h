@@ -13,12 +13,114 @@
 #include "stdint.h"
 #include "stm32l053xx.h"											//device specific header file for registers
 #include "ClockDriver_STM32L0x3.h"									//custom clocking for the core and the peripherals
+#include "SPIStats_STM32L0x3.h"										//optional instrumentation
+
+//LOCAL CONSTANT
+#define SPIMODE0					0								//CPOL 0, CPHA 0
+#define SPIMODE1					1								//CPOL 0, CPHA 1
+#define SPIMODE2					2								//CPOL 1, CPHA 0
+#define SPIMODE3					3								//CPOL 1, CPHA 1
+
+#define SPI1_FRAME_8BIT				0
+#define SPI1_FRAME_16BIT			1
+
+#define SPI1_BAUD_DIV2				0								//BR[2:0] values in CR1
+#define SPI1_BAUD_DIV4				1
+#define SPI1_BAUD_DIV8				2
+#define SPI1_BAUD_DIV16				3
+#define SPI1_BAUD_DIV32				4
+#define SPI1_BAUD_DIV64				5
+#define SPI1_BAUD_DIV128			6
+#define SPI1_BAUD_DIV256			7
+
+#ifndef SPI1_TIMEOUT_US
+#define SPI1_TIMEOUT_US				1000							//longest wait for a single flag of a blocking transfer
+#endif
+#ifndef SPI1_ASYNC_TIMEOUT_US
+#define SPI1_ASYNC_TIMEOUT_US		60000							//longest wait for an ongoing DMA/IT transfer to finish
+#endif
+
+#define SPI1_OK						0								//return values of the transfer functions
+#define SPI1_ERROR_TIMEOUT			1								//a flag did not arrive in time - slave stalled or clock stopped
+#define SPI1_ERROR_OVR				2								//overrun - a received byte was not read out in time
+#define SPI1_ERROR_MODF				3								//mode fault - the peripheral dropped out of master mode
+#define SPI1_ERROR_BUSY				4								//BSY stuck HIGH
+#define SPI1_ERROR_CRC				5								//the CRC received from the slave did not match - data is corrupted
+
+#define SPI1_CRC_POLYNOMIAL_DEFAULT	0x07							//reset value of CRCPR - CRC-8, x^8 + x^2 + x + 1
+
+#define SPI1_DEVICE_CR1_MASK		((1<<11) | (7<<3) | (3<<0))		//DFF, BR and CPOL/CPHA - the bits that can differ between devices
+
+//LOCAL TYPES
+typedef struct {
+	GPIO_TypeDef* cs_port;											//CS of the device
+	uint8_t cs_pin;
+	uint8_t spi_mode;												//SPIMODE0 - SPIMODE3
+	uint8_t frame_size;												//SPI1_FRAME_8BIT or SPI1_FRAME_16BIT
+	uint8_t baud_prescaler;											//SPI1_BAUD_DIV2 - SPI1_BAUD_DIV256
+	uint32_t cr1_setup;												//pre-calculated CR1 bits of the device
+	uint32_t sck_hz;												//highest SCK the device takes - the prescaler is recalculated from this after a clock change
+	uint8_t clock_epoch;											//clock setup the prescaler was calculated for
+	uint16_t min_gap_us;											//minimum time between two transactions towards the device
+	uint16_t hold_off_us;											//one-off extra gap after the last transaction (e.g. after a reset)
+	uint32_t last_end;												//TIM6 time stamp of the end of the last transaction
+	uint32_t pacing_wait_us;										//total time spent waiting for the gaps
+	uint8_t crc_polynomial;											//CRC polynomial of the device for the CRC-checked transfers
+} SPI1Device;
+
+typedef struct {
+	uint8_t *tx_buf;												//bytes to send, NULL for 0xFF dummies
+	uint8_t *rx_buf;												//where the received bytes go, NULL to throw them away
+	uint16_t length;												//number of bytes in the segment
+} SPI1Segment;
 
 //EXTERNAL VARIABLE
+extern volatile uint8_t SPI1_DMA_busy;
+extern volatile uint8_t SPI1_DMA_error;
+extern volatile uint8_t SPI1_IT_busy;
+extern volatile uint8_t SPI1_IT_error;
+extern uint32_t SPI1_reconfig_count;
+extern volatile uint32_t SPI1_recovery_count;
+extern volatile uint8_t SPI1_last_error;
+extern volatile uint32_t SPI1_crc_error_count;
 
 //FUNCTION PROTOTYPES
 void SPI1MasterInit (GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_pin_number_SPI);
-void SPI1MasterWrite (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint8_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
-void SPI1MasterRead (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint8_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+uint8_t SPI1MasterWrite (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint8_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+uint8_t SPI1MasterRead (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint8_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+void SPI1DMAInit (void);
+uint8_t SPI1MasterReadDMA (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number, void (*transfer_done)(void));
+uint8_t SPI1MasterWriteDMA (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number, void (*transfer_done)(void));
+uint8_t SPI1MasterExchangeDMA (const uint8_t *bytes_to_send, uint8_t *bytes_received, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number, void (*transfer_done)(void));
+uint8_t SPI1MasterReadIT (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number, void (*transfer_done)(void));
+uint8_t SPI1MasterWriteIT (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number, void (*transfer_done)(void));
+void SPI1DeviceInit (SPI1Device* device, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_pin_number_SPI, uint8_t spi_mode, uint8_t frame_size, uint8_t baud_prescaler);
+void SPI1DeviceSelect (SPI1Device* device);
+void SPI1DeviceRelease (void);
+void SPI1ClockChanged (void);
+uint8_t SPI1Recover (uint8_t error, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+void SPI1DeviceSetGap (SPI1Device* device, uint16_t min_gap_us);
+void SPI1DeviceHoldOff (SPI1Device* device, uint16_t hold_off_us);
+void SPI1DevicePace (SPI1Device* device);
+uint8_t SPI1DeviceRead (SPI1Device* device, uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint8_t number_of_bytes);
+uint8_t SPI1DeviceWrite (SPI1Device* device, uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint8_t number_of_bytes);
+uint8_t SPI1MasterReadStream (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+uint8_t SPI1MasterWriteStream (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+uint8_t SPI1SessionBegin (SPI1Device* device);
+void SPI1SessionSelect (void);
+void SPI1SessionDeselect (void);
+uint8_t SPI1SessionRead (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint16_t number_of_bytes);
+uint8_t SPI1SessionWrite (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint16_t number_of_bytes);
+uint8_t SPI1SessionEnd (void);
+uint8_t SPI1MasterRead16 (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+uint8_t SPI1MasterWrite16 (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint16_t number_of_bytes, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+uint8_t SPI1MasterTransfer (const SPI1Segment* segments, uint8_t number_of_segments, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+uint8_t SPI1DeviceTransfer (SPI1Device* device, const SPI1Segment* segments, uint8_t number_of_segments);
+uint8_t SPI1SessionTransfer (const SPI1Segment* segments, uint8_t number_of_segments);
+uint8_t SPI1MasterReadCRC (uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint16_t number_of_bytes, uint8_t crc_polynomial, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+uint8_t SPI1MasterWriteCRC (uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint16_t number_of_bytes, uint8_t crc_polynomial, GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number);
+void SPI1DeviceSetCRC (SPI1Device* device, uint8_t crc_polynomial);
+uint8_t SPI1DeviceReadCRC (SPI1Device* device, uint8_t reg_addr_to_read_from, uint8_t *bytes_received, uint16_t number_of_bytes);
+uint8_t SPI1DeviceWriteCRC (SPI1Device* device, uint8_t reg_addr_write_to, uint8_t *bytes_to_send, uint16_t number_of_bytes);
 
 #endif /* INC_SPIDRIVER_CUSTOM_H_ */
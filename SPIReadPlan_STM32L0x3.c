@@ -0,0 +1,161 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: SPIReadPlan_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * Read coalescing for sets of registers.
+ * Reading registers one by one costs a full transaction each: CS, SPE, the address byte and the pacing of the device. Most sensors auto-increment the address within a burst though.
+ * The plan takes a register map (a list of fields: first register, length, destination) and merges the fields into the fewest burst reads.
+ * Two neighbouring fields are merged even if there is a gap between them, as long as reading the gap is cheaper than starting another transaction (SPI1_PLAN_GAP_COST bytes).
+ * The plan is built once. Executing it reads the bursts within one bus session and scatters the bytes back into the fields.
+ *
+ * The plan also tells how much it saves against reading every field on its own: naive_transactions/naive_bytes versus burst_count/planned_bytes.
+ *
+ * Example:
+ *    static uint8_t id, status, ctrl[2], data[6];
+ *    static const SPI1Field map[4] = {{0xD0, 1, &id}, {0xF3, 1, &status}, {0xF4, 2, ctrl}, {0xF7, 6, data}};
+ *    SPI1ReadPlan plan;
+ *    SPI1PlanBuild(&plan, map, 4);											//2 bursts: 0xD0 and 0xF3 - 0xFC (0xF6 is read as a gap)
+ *    SPI1PlanExecute(&sensor.device, &plan);
+ *
+ * Note: the device must auto-increment the register address in a burst read. Fields must not wrap around 0xFF.
+ *
+ * v.1.1
+ * A burst is checked against SPI1_PLAN_MAX_BYTES on its own, before its length is stored. Fields covering all 256 registers made a 256-byte burst that was stored as length 0,
+ * so the total passed the check and SPI1PlanExecute read far more than its buffer.
+ *
+ */
+
+#include "SPIReadPlan_STM32L0x3.h"
+
+//1) Build the plan from a register map
+uint8_t SPI1PlanBuild (SPI1ReadPlan* plan, const SPI1Field* fields, uint8_t field_count) {
+	/*
+	 * What happens here?
+	 * 1)We sort the fields by their first register (insertion sort on an index list, the map itself is left as it is).
+	 * 2)We go through the sorted fields and extend the current burst as long as the next field starts within SPI1_PLAN_GAP_COST registers of its end. Overlapping fields are fine.
+	 *   Otherwise a new burst is started.
+	 * 3)We store where each field lands within the data of the bursts (bursts are placed one after the other).
+	 * Returns 1 if the plan fits the limits, 0 if not.
+	 *
+	 * */
+
+	uint8_t order[SPI1_PLAN_MAX_FIELDS];
+	uint8_t burst_of_field[SPI1_PLAN_MAX_FIELDS];
+	uint8_t burst_offset[SPI1_PLAN_MAX_BURSTS];
+
+	if ((field_count == 0) || (field_count > SPI1_PLAN_MAX_FIELDS)) return 0;
+
+	plan->fields = fields;
+	plan->field_count = field_count;
+	plan->burst_count = 0;
+	plan->naive_transactions = field_count;
+	plan->naive_bytes = 0;
+	plan->planned_bytes = 0;
+
+	//1)
+	for (uint8_t i = 0; i < field_count; i++) {
+		if ((fields[i].length == 0) || ((fields[i].reg + fields[i].length) > 0x100)) return 0;
+		uint8_t j = i;
+		while ((j > 0) && (fields[order[j - 1]].reg > fields[i].reg)) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = i;
+		plan->naive_bytes += fields[i].length + 1;
+	}
+
+	//2)
+	uint16_t burst_end = 0;													//first register after the current burst
+	for (uint8_t i = 0; i < field_count; i++) {
+		const SPI1Field* field = &fields[order[i]];
+		uint16_t field_end = field->reg + field->length;
+
+		if ((plan->burst_count == 0) || (field->reg > (burst_end + SPI1_PLAN_GAP_COST))) {
+			if (plan->burst_count == SPI1_PLAN_MAX_BURSTS) return 0;
+			plan->bursts[plan->burst_count].start = field->reg;
+			plan->burst_count++;
+			burst_end = field_end;
+		} else if (field_end > burst_end) {
+			burst_end = field_end;
+		}
+
+		uint16_t burst_length = burst_end - plan->bursts[plan->burst_count - 1].start;	//up to 0x100, doesn't fit the uint8_t of the burst
+		if (burst_length > SPI1_PLAN_MAX_BYTES) return 0;
+		plan->bursts[plan->burst_count - 1].length = burst_length;
+		burst_of_field[order[i]] = plan->burst_count - 1;
+	}
+
+	//3)
+	uint16_t offset = 0;
+	for (uint8_t i = 0; i < plan->burst_count; i++) {
+		burst_offset[i] = offset;
+		offset += plan->bursts[i].length;
+		plan->planned_bytes += plan->bursts[i].length + 1;
+	}
+	if (offset > SPI1_PLAN_MAX_BYTES) return 0;
+
+	for (uint8_t i = 0; i < field_count; i++) {
+		uint8_t burst = burst_of_field[i];
+		plan->field_offset[i] = burst_offset[burst] + (fields[i].reg - plan->bursts[burst].start);
+	}
+
+	return 1;
+}
+
+
+//2) Build the plan from a set of single register addresses
+uint8_t SPI1PlanBuildAddresses (SPI1ReadPlan* plan, SPI1Field* fields, const uint8_t* addresses, uint8_t *values, uint8_t address_count) {
+	/*
+	 * Each address becomes a one byte field, its value goes to values[] at the same index. fields[] must have room for address_count entries and must live as long as the plan.
+	 *
+	 * */
+
+	for (uint8_t i = 0; (i < address_count) && (i < SPI1_PLAN_MAX_FIELDS); i++) {
+		fields[i].reg = addresses[i];
+		fields[i].length = 1;
+		fields[i].destination = &values[i];
+	}
+	return SPI1PlanBuild(plan, fields, address_count);
+}
+
+
+//3) Read the bursts and scatter the data
+uint8_t SPI1PlanExecute (SPI1Device* device, SPI1ReadPlan* plan) {
+	/*
+	 * What happens here?
+	 * All bursts are read within one bus session: the device is selected and SPE is turned on only once, each burst has its own CS assertion.
+	 * The data is read into a local buffer, then copied into the fields. On an error, the fields are left as they were.
+	 *
+	 * */
+
+	uint8_t data[SPI1_PLAN_MAX_BYTES];
+	uint8_t* burst_data = data;
+	uint8_t error = SPI1SessionBegin(device);
+	if (error) return error;
+
+	for (uint8_t i = 0; i < plan->burst_count; i++) {
+		SPI1SessionSelect();
+		error = SPI1SessionRead(plan->bursts[i].start, burst_data, plan->bursts[i].length);
+		if (error) break;
+		SPI1SessionDeselect();
+		burst_data += plan->bursts[i].length;
+	}
+	uint8_t end_error = SPI1SessionEnd();
+	if (!error) error = end_error;
+	if (error) return error;
+
+	for (uint8_t i = 0; i < plan->field_count; i++) {
+		const SPI1Field* field = &plan->fields[i];
+		for (uint8_t j = 0; j < field->length; j++) {
+			field->destination[j] = data[plan->field_offset[i] + j];
+		}
+	}
+
+	return SPI1_OK;
+}
@@ -0,0 +1,53 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: SPIReadPlan_STM32L0x3.h
+ */
+
+#ifndef INC_SPIREADPLAN_CUSTOM_H_
+#define INC_SPIREADPLAN_CUSTOM_H_
+
+#include "stdint.h"
+#include "SPIDriver_STM32L0x3.h"									//custom SPI driver
+
+//LOCAL CONSTANT
+#define SPI1_PLAN_MAX_FIELDS		16								//fields in one register map
+#define SPI1_PLAN_MAX_BURSTS		8								//burst reads in one plan
+#define SPI1_PLAN_MAX_BYTES			64								//bytes read by one plan, gaps included
+
+#ifndef SPI1_PLAN_GAP_COST
+#define SPI1_PLAN_GAP_COST			3								//cost of one more transaction in bytes (address byte, CS and SPE toggle)
+#endif
+
+//LOCAL TYPES
+typedef struct {
+	uint8_t reg;													//first register of the field
+	uint8_t length;													//number of consecutive registers
+	uint8_t *destination;											//where the raw bytes go
+} SPI1Field;
+
+typedef struct {
+	uint8_t start;													//first register of the burst
+	uint8_t length;
+} SPI1Burst;
+
+typedef struct {
+	const SPI1Field* fields;
+	uint8_t field_count;
+	uint8_t field_offset[SPI1_PLAN_MAX_FIELDS];						//position of each field within the burst data
+	SPI1Burst bursts[SPI1_PLAN_MAX_BURSTS];
+	uint8_t burst_count;
+	uint16_t naive_transactions;									//one transaction per field
+	uint16_t naive_bytes;											//field bytes plus one address byte per field
+	uint16_t planned_bytes;											//burst bytes (with the gaps) plus one address byte per burst
+} SPI1ReadPlan;
+
+//FUNCTION PROTOTYPES
+uint8_t SPI1PlanBuild (SPI1ReadPlan* plan, const SPI1Field* fields, uint8_t field_count);
+uint8_t SPI1PlanBuildAddresses (SPI1ReadPlan* plan, SPI1Field* fields, const uint8_t* addresses, uint8_t *values, uint8_t address_count);
+uint8_t SPI1PlanExecute (SPI1Device* device, SPI1ReadPlan* plan);
+
+#endif /* INC_SPIREADPLAN_CUSTOM_H_ */
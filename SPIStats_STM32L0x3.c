@@ -0,0 +1,137 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: SPIStats_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * Hot-path instrumentation for the blocking SPI functions.
+ * Every transaction is timed using the free running TIM6 and every iteration of the TXE/RXNE/BSY poll loops is counted.
+ * The results are kept per device (identified by the CS pin) and per operation (read/write): min/max/average latency, a latency histogram and the poll loop counts.
+ * The statistics can be published over USART2 using SPI1StatsPrint.
+ *
+ * The whole thing is removed at compile time if SPI1_INSTRUMENTATION is 0: the macros in the driver then turn back into the plain (bounded) poll loops.
+ *
+ * v.1.1
+ * This file is compiled only with SPI1_INSTRUMENTATION at 1, so the statistics table takes no RAM otherwise.
+ * Only SPI1MasterRead and SPI1MasterWrite are instrumented (and everything that goes through them, e.g. SPI1DeviceRead/Write).
+ * The stream, DMA, IT, segment and CRC transfers are not: their time is spent in the DMA or the IRQs and they have no poll loops to count.
+ *
+ */
+
+#include "SPIStats_STM32L0x3.h"
+
+#if SPI1_INSTRUMENTATION
+
+#include "stdio.h"
+
+//LOCAL VARIABLES
+SPI1DeviceStats SPI1_stats[SPI1_STATS_DEVICES];
+
+static const char* const stats_poll_names[SPI1_POLLS] = {"TXE", "RXNE", "RX empty", "BSY"};
+
+//1) Record one transaction
+void SPI1StatsRecord (GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number, uint8_t op, uint32_t latency_us, uint32_t *spins) {
+	/*
+	 * What happens here?
+	 * We look for the device's slot using the CS. If there is none, we take the first empty one. If the table is full, the transaction is not recorded.
+	 * Then we update the latency statistics and the histogram (bin is the log2 of the latency in 8 us units) and add the poll loop counts.
+	 *
+	 * */
+
+	SPI1DeviceStats* device = 0;
+
+	for (uint8_t i = 0; i < SPI1_STATS_DEVICES; i++) {
+		if ((SPI1_stats[i].cs_port == gpio_port_SPI) && (SPI1_stats[i].cs_pin == gpio_number)) {
+			device = &SPI1_stats[i];
+			break;
+		}
+		if (SPI1_stats[i].cs_port == 0) {
+			SPI1_stats[i].cs_port = gpio_port_SPI;
+			SPI1_stats[i].cs_pin = gpio_number;
+			device = &SPI1_stats[i];
+			break;
+		}
+	}
+
+	if (device == 0) return;
+
+	SPI1OpStats* stats = &device->op[op];
+
+	if ((stats->count == 0) || (latency_us < stats->latency_min_us)) stats->latency_min_us = latency_us;
+	if (latency_us > stats->latency_max_us) stats->latency_max_us = latency_us;
+	stats->latency_sum_us += latency_us;
+	stats->count++;
+
+	uint8_t bin = 0;
+	uint32_t scaled = latency_us >> 3;
+	while (scaled && (bin < (SPI1_STATS_BINS - 1))) {
+		scaled >>= 1;
+		bin++;
+	}
+	stats->histogram[bin]++;
+
+	for (uint8_t i = 0; i < SPI1_POLLS; i++) {
+		stats->spins[i] += spins[i];
+		if (spins[i] > stats->spins_max[i]) stats->spins_max[i] = spins[i];
+	}
+}
+
+
+//2) Clear the statistics
+void SPI1StatsReset (void) {
+
+	for (uint8_t i = 0; i < SPI1_STATS_DEVICES; i++) {
+		SPI1_stats[i].cs_port = 0;
+		SPI1_stats[i].cs_pin = 0;
+		for (uint8_t op = 0; op < SPI1_OPS; op++) {
+			SPI1OpStats* stats = &SPI1_stats[i].op[op];
+			stats->count = 0;
+			stats->latency_min_us = 0;
+			stats->latency_max_us = 0;
+			stats->latency_sum_us = 0;
+			for (uint8_t j = 0; j < SPI1_STATS_BINS; j++) stats->histogram[j] = 0;
+			for (uint8_t j = 0; j < SPI1_POLLS; j++) {
+				stats->spins[j] = 0;
+				stats->spins_max[j] = 0;
+			}
+		}
+	}
+}
+
+
+//3) Publish the statistics over USART2
+void SPI1StatsPrint (void) {
+	/*
+	 * We print one block per device and operation that has at least one transaction.
+	 * The device is shown as the GPIO port address and the CS pin number.
+	 *
+	 * */
+
+	for (uint8_t i = 0; i < SPI1_STATS_DEVICES; i++) {
+		if (SPI1_stats[i].cs_port == 0) continue;
+
+		for (uint8_t op = 0; op < SPI1_OPS; op++) {
+			SPI1OpStats* stats = &SPI1_stats[i].op[op];
+			if (stats->count == 0) continue;
+
+			printf("SPI1 CS 0x%lx/%u %s: %lu transactions, latency min %lu us, avg %lu us, max %lu us \r\n",
+					(unsigned long)SPI1_stats[i].cs_port, SPI1_stats[i].cs_pin, (op == SPI1_OP_READ ? "read" : "write"),
+					(unsigned long)stats->count, (unsigned long)stats->latency_min_us,
+					(unsigned long)(stats->latency_sum_us / stats->count), (unsigned long)stats->latency_max_us);
+
+			printf("  histogram (<8us, <16us ... >=512us):");
+			for (uint8_t j = 0; j < SPI1_STATS_BINS; j++) printf(" %lu", (unsigned long)stats->histogram[j]);
+			printf(" \r\n");
+
+			for (uint8_t j = 0; j < SPI1_POLLS; j++) {
+				printf("  %s poll: %lu spins total, %lu max per transaction \r\n", stats_poll_names[j], (unsigned long)stats->spins[j], (unsigned long)stats->spins_max[j]);
+			}
+		}
+	}
+}
+
+#endif /* SPI1_INSTRUMENTATION */
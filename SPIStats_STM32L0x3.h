@@ -0,0 +1,72 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: SPIStats_STM32L0x3.h
+ */
+
+#ifndef INC_SPISTATS_CUSTOM_H_
+#define INC_SPISTATS_CUSTOM_H_
+
+#include "stdint.h"
+#include "stm32l053xx.h"											//device specific header file for registers
+#include "ClockDriver_STM32L0x3.h"									//TIM6 time stamps
+
+//LOCAL CONSTANT
+#ifndef SPI1_INSTRUMENTATION
+#define SPI1_INSTRUMENTATION		0								//set to 1 (here or as a compiler flag) to activate the instrumentation
+#endif
+
+#define SPI1_STATS_DEVICES			4								//number of CS pins we keep statistics for
+#define SPI1_STATS_BINS				8								//latency histogram: <8 us, <16 us, <32 us ... <512 us, 512 us and above
+
+#define SPI1_OP_READ				0
+#define SPI1_OP_WRITE				1
+#define SPI1_OPS					2
+
+#define SPI1_POLL_TXE				0								//the poll loops of the blocking functions
+#define SPI1_POLL_RXNE				1
+#define SPI1_POLL_RX_EMPTY			2
+#define SPI1_POLL_BSY				3
+#define SPI1_POLLS					4
+
+//LOCAL TYPES
+typedef struct {
+	uint32_t count;													//number of transactions
+	uint32_t latency_min_us;
+	uint32_t latency_max_us;
+	uint32_t latency_sum_us;
+	uint32_t histogram[SPI1_STATS_BINS];
+	uint32_t spins[SPI1_POLLS];										//total poll loop iterations
+	uint32_t spins_max[SPI1_POLLS];									//most poll loop iterations within one transaction
+} SPI1OpStats;
+
+typedef struct {
+	GPIO_TypeDef* cs_port;											//the device is identified by its CS
+	uint8_t cs_pin;
+	SPI1OpStats op[SPI1_OPS];
+} SPI1DeviceStats;
+
+//EXTERNAL VARIABLE
+extern SPI1DeviceStats SPI1_stats[SPI1_STATS_DEVICES];
+
+//MACROS
+//Note: only SPI1MasterRead and SPI1MasterWrite use these
+#if SPI1_INSTRUMENTATION
+#define SPI1_STATS_START			uint32_t stats_start = TIM6Now(); uint32_t stats_spins[SPI1_POLLS] = {0, 0, 0, 0};
+#define SPI1_STATS_SPINS(poll)		&stats_spins[poll]
+#define SPI1_STATS_END(port, pin, op)	SPI1StatsRecord(port, pin, op, TIM6Elapsed(stats_start), stats_spins)
+#else
+#define SPI1_STATS_START
+#define SPI1_STATS_SPINS(poll)		0
+#define SPI1_STATS_END(port, pin, op)
+#endif
+
+//FUNCTION PROTOTYPES
+void SPI1StatsRecord (GPIO_TypeDef* gpio_port_SPI, uint8_t gpio_number, uint8_t op, uint32_t latency_us, uint32_t *spins);
+void SPI1StatsReset (void);
+void SPI1StatsPrint (void);
+
+#endif /* INC_SPISTATS_CUSTOM_H_ */
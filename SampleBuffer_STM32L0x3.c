@@ -0,0 +1,88 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: SampleBuffer_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * Lock-free single producer/single consumer ring buffer for raw samples.
+ * The producer (an IRQ or a DMA callback) pushes, the consumer (main loop) pops. Neither of them needs to disable interrupts.
+ * This works because:
+ * - head is only written by the producer, tail is only written by the consumer
+ * - 32-bit aligned reads and writes are atomic on the M0+
+ * - the sample is copied into the buffer before head is moved (and read out before tail is moved), with a memory barrier in between
+ * head and tail are free running counters, the index is taken by masking with SAMPLE_BUFFER_SIZE - 1. Their difference is the fill level.
+ *
+ * If the buffer is full, the new sample is dropped and counted in overflow_count. The high water mark shows how close we got to the limit.
+ *
+ */
+
+#include "SampleBuffer_STM32L0x3.h"
+
+//1) Reset the buffer
+void SampleBufferInit (SampleBuffer* buffer) {
+
+	buffer->head = 0;
+	buffer->tail = 0;
+	buffer->overflow_count = 0;
+	buffer->high_water_mark = 0;
+}
+
+
+//2) Producer side
+uint8_t SampleBufferPush (SampleBuffer* buffer, RawSample* sample) {
+	/*
+	 * What happens here?
+	 * We check the fill level using our own head and the consumer's tail. If there is space, we copy the sample into the slot and only then publish it by moving head.
+	 * Returns 1 if the sample was stored, 0 if it was dropped.
+	 *
+	 * */
+
+	uint32_t head = buffer->head;
+	uint32_t level = head - buffer->tail;
+
+	if (level >= SAMPLE_BUFFER_SIZE) {
+		buffer->overflow_count++;
+		return 0;
+	}
+
+	buffer->samples[head & (SAMPLE_BUFFER_SIZE - 1)] = *sample;
+	__DMB();																//the sample must be in the buffer before the consumer sees the new head
+	buffer->head = head + 1;
+
+	if ((level + 1) > buffer->high_water_mark) buffer->high_water_mark = level + 1;
+
+	return 1;
+}
+
+
+//3) Consumer side
+uint8_t SampleBufferPop (SampleBuffer* buffer, RawSample* sample) {
+	/*
+	 * What happens here?
+	 * If head and tail are not equal, we have a sample. We copy it out and only then release the slot by moving tail.
+	 * Returns 1 if we have a sample, 0 if the buffer is empty.
+	 *
+	 * */
+
+	uint32_t tail = buffer->tail;
+
+	if (tail == buffer->head) return 0;
+
+	__DMB();																//we read the slot only after we have seen the head
+	*sample = buffer->samples[tail & (SAMPLE_BUFFER_SIZE - 1)];
+	__DMB();																//the slot must be read out before the producer can reuse it
+	buffer->tail = tail + 1;
+
+	return 1;
+}
+
+
+//4) Fill level
+uint32_t SampleBufferLevel (SampleBuffer* buffer) {
+
+	return buffer->head - buffer->tail;
+}
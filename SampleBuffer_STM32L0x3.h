@@ -0,0 +1,40 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: SampleBuffer_STM32L0x3.h
+ */
+
+#ifndef INC_SAMPLEBUFFER_CUSTOM_H_
+#define INC_SAMPLEBUFFER_CUSTOM_H_
+
+#include "stdint.h"
+#include "stm32l053xx.h"											//device specific header file for registers (and the CMSIS barriers)
+
+//LOCAL CONSTANT
+#define SAMPLE_BUFFER_SIZE			32								//must be a power of 2
+
+//LOCAL TYPES
+typedef struct {
+	uint32_t timestamp;												//TIM6 time stamp of the acquisition
+	int32_t adc_T;													//raw 20-bit temperature
+	int32_t adc_P;													//raw 20-bit pressure
+} RawSample;
+
+typedef struct {
+	RawSample samples[SAMPLE_BUFFER_SIZE];
+	volatile uint32_t head;											//written only by the producer
+	volatile uint32_t tail;											//written only by the consumer
+	volatile uint32_t overflow_count;								//samples dropped because the buffer was full
+	volatile uint32_t high_water_mark;								//highest fill level seen
+} SampleBuffer;
+
+//FUNCTION PROTOTYPES
+void SampleBufferInit (SampleBuffer* buffer);
+uint8_t SampleBufferPush (SampleBuffer* buffer, RawSample* sample);
+uint8_t SampleBufferPop (SampleBuffer* buffer, RawSample* sample);
+uint32_t SampleBufferLevel (SampleBuffer* buffer);
+
+#endif /* INC_SAMPLEBUFFER_CUSTOM_H_ */
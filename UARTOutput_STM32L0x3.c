@@ -0,0 +1,134 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  Program version: 1.0
+ *  File: UARTOutput_STM32L0x3.c
+ *  Change history:
+ *
+ * v.1.0
+ * Buffered USART2 output for the printf retarget.
+ * _write only copies the characters into a ring buffer and returns. The buffer is drained in the background by the USART2 TXE interrupt, one byte per IRQ.
+ * The ring buffer follows the SampleBuffer: free running head/tail, head only moved by the writer, tail only moved by the IRQ, barrier before publishing.
+ * The USART2 must be set up before (MX_USART2_UART_Init). We only use the TXE interrupt on top of it.
+ *
+ * When the buffer is full:
+ * - UART_OUTPUT_DROP: the rest of the write is dropped and counted, the writer never waits
+ * - UART_OUTPUT_BLOCK: the writer waits for the IRQ to make space, at most UART_OUTPUT_BLOCK_TIMEOUT_US per write, then drops
+ * Within an IRQ or with interrupts disabled the buffer cannot drain, so we always drop there.
+ *
+ * Note: there must be only one writer at a time. printf should be called only from the main loop.
+ * Note: USART2_IRQHandler is defined here, so it must not be generated in stm32l0xx_it.c.
+ * Note: USART2 DMA (channel 4/7) would also work, but the TXE interrupt needs no DMA channel and no wrap-around split of the transfer. At 115200 baud it is one IRQ per 87 us.
+ *
+ */
+
+#include "UARTOutput_STM32L0x3.h"
+
+//LOCAL VARIABLES
+UARTOutput uart_output;
+
+//1) Set up the buffered output
+void UARTOutputInit (uint8_t policy) {
+
+	uart_output.head = 0;
+	uart_output.tail = 0;
+	uart_output.dropped = 0;
+	uart_output.high_water_mark = 0;
+	uart_output.policy = policy;
+
+	USART2->CR1 &= ~(1<<7);													//TXEIE off until we have something to send
+	NVIC_SetPriority(USART2_IRQn, 3);										//lowest priority, the output must not delay the acquisition
+	NVIC_EnableIRQ(USART2_IRQn);
+}
+
+
+//2) Copy bytes into the buffer
+int UARTOutputWrite (const uint8_t* bytes, int length) {
+	/*
+	 * What happens here?
+	 * We copy as many bytes as fit into the free space, publish them by moving head and then turn on the TXE interrupt.
+	 * If the IRQ clears TXEIE in between (buffer was empty for it), we turn it back on anyway, so no byte is left behind.
+	 * In blocking mode we wait for space until the deadline. Whatever does not fit is dropped and counted.
+	 * Returns length, so printf never retries.
+	 *
+	 * */
+
+	uint8_t can_block = (uart_output.policy == UART_OUTPUT_BLOCK) && (__get_IPSR() == 0) && (__get_PRIMASK() == 0);
+	uint32_t start = TIM6Now();
+	int i = 0;
+
+	while (i < length) {
+		uint32_t head = uart_output.head;
+		uint32_t space = UART_OUTPUT_BUFFER_SIZE - (head - uart_output.tail);
+
+		if (space == 0) {
+			if (!can_block || (TIM6Elapsed(start) > UART_OUTPUT_BLOCK_TIMEOUT_US)) {
+				uart_output.dropped += (length - i);
+				break;
+			}
+			continue;														//the IRQ makes space
+		}
+
+		while ((space > 0) && (i < length)) {
+			uart_output.data[head & (UART_OUTPUT_BUFFER_SIZE - 1)] = bytes[i++];
+			head++;
+			space--;
+		}
+
+		__DMB();															//the bytes must be in the buffer before the IRQ sees the new head
+		uart_output.head = head;
+		USART2->CR1 |= (1<<7);												//TXEIE on
+
+		uint32_t level = head - uart_output.tail;
+		if (level > uart_output.high_water_mark) uart_output.high_water_mark = level;
+	}
+
+	return length;
+}
+
+
+//3) Wait until everything is out
+void UARTOutputFlush (void) {
+	/*
+	 * What happens here?
+	 * We wait until the buffer is empty and the last byte has left the shift register (TC).
+	 * This is needed before a clock switch or going to sleep. Not possible within an IRQ.
+	 *
+	 * */
+
+	if ((__get_IPSR() != 0) || (__get_PRIMASK() != 0)) return;
+
+	while (uart_output.tail != uart_output.head);
+	while (!(USART2->ISR & (1<<6)));										//TC
+}
+
+
+//4) Fill level
+uint32_t UARTOutputLevel (void) {
+
+	return uart_output.head - uart_output.tail;
+}
+
+
+//5) USART2 IRQ
+void USART2_IRQHandler (void) {
+	/*
+	 * What happens here?
+	 * On TXE we send the next byte. When the buffer is empty, we turn off TXEIE, otherwise the IRQ would fire forever.
+	 * The writer turns TXEIE back on once it has published new bytes.
+	 *
+	 * */
+
+	if ((USART2->CR1 & (1<<7)) && (USART2->ISR & (1<<7))) {
+		uint32_t tail = uart_output.tail;
+		if (tail == uart_output.head) {
+			USART2->CR1 &= ~(1<<7);
+		} else {
+			__DMB();														//we read the byte only after we have seen the head
+			USART2->TDR = uart_output.data[tail & (UART_OUTPUT_BUFFER_SIZE - 1)];
+			uart_output.tail = tail + 1;
+		}
+	}
+}
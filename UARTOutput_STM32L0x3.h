@@ -0,0 +1,48 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8
+ *  HEader version: 1.0
+ *  File: UARTOutput_STM32L0x3.h
+ */
+
+#ifndef INC_UARTOUTPUT_CUSTOM_H_
+#define INC_UARTOUTPUT_CUSTOM_H_
+
+#include "stdint.h"
+#include "stm32l053xx.h"											//device specific header file for registers (and the CMSIS barriers)
+#include "ClockDriver_STM32L0x3.h"									//TIM6 time base for the blocking policy
+
+//LOCAL CONSTANT
+#define UART_OUTPUT_DROP			0								//bytes that do not fit are dropped and counted
+#define UART_OUTPUT_BLOCK			1								//the writer waits for space (bounded)
+
+#ifndef UART_OUTPUT_BUFFER_SIZE
+#define UART_OUTPUT_BUFFER_SIZE		512								//must be a power of 2
+#endif
+
+#ifndef UART_OUTPUT_BLOCK_TIMEOUT_US
+#define UART_OUTPUT_BLOCK_TIMEOUT_US	50000						//longest wait for space in blocking mode, then we drop
+#endif
+
+//LOCAL TYPES
+typedef struct {
+	uint8_t data[UART_OUTPUT_BUFFER_SIZE];
+	volatile uint32_t head;											//written only by the writer
+	volatile uint32_t tail;											//written only by the USART2 IRQ
+	volatile uint32_t dropped;										//bytes lost because the buffer was full
+	volatile uint32_t high_water_mark;								//highest fill level seen
+	uint8_t policy;													//UART_OUTPUT_DROP or UART_OUTPUT_BLOCK
+} UARTOutput;
+
+//EXTERNAL VARIABLE
+extern UARTOutput uart_output;
+
+//FUNCTION PROTOTYPES
+void UARTOutputInit (uint8_t policy);
+int UARTOutputWrite (const uint8_t* bytes, int length);
+void UARTOutputFlush (void);
+uint32_t UARTOutputLevel (void);
+
+#endif /* INC_UARTOUTPUT_CUSTOM_H_ */
@@ -0,0 +1,757 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8 - host simulation
+ *  Program version: 1.0
+ *  File: HostBenchmark.cpp
+ *  Change history:
+ *
+ * v.1.0
+ * Host main of the SPI driver: the drivers run against the register model (SimCore_STM32L0x3.cpp) with a BMP280 model on PB6 (SimBMP280.cpp).
+ * We do the same setup as main.c, then:
+ * 1)Check that every transfer mode (poll, stream, dma, it, wide) reads and writes the sensor correctly and that the compensation gives the datasheet results
+ *   The CRC-checked transfers are checked against a CRC slave on PB5 (SimCRCSlave.cpp), with a good and with a corrupted CRC
+ *   The data EEPROM writes must keep the TIM6 time base, and the calibration cache must hit and miss when it should
+ *   The software timers must expire in deadline order (same deadlines in start order), on time within the ms tick, and a periodic timer must not drift
+ *   After every clock profile switch, a device handle must run at the fastest SCK that is still at or below its sck_hz, the sensor must stay readable,
+ *   and TIM2 must keep its rate without extra ticks
+ *   A 65535-byte gapless transfer and a list of two such segments (interrupts off all along) must send every frame and keep the TIM6 time base
+ *   An IT transfer hit by an injected OVR or mode fault must end with its callback and SPI1_IT_error, and a 65535-byte IT read must send every frame
+ *   A polled read issued while a DMA read is running must wait for it; a stalled slave, an OVR and a mode fault must end in the right error and one recovery each
+ *   A static device (SPIDriverStatic_STM32L0x3.h) must not be switched to within a session
+ *   A read plan must merge the BMP280 registers into the right bursts and read them, and a plan longer than its buffer must be refused
+ *   The batch compensation must give exactly the results of the datasheet formulas over many sets of raw samples (SPIBenchmark_STM32L0x3.c)
+ * 2)Measure every mode, read and write, for every transfer size in simulated time: latency, bytes/second, CPU-busy cycles, SCK edges and bus utilisation
+ * 3)Run the on-target benchmarks of SPIBenchmark_STM32L0x3.c as they are, on the simulated TIM6
+ * The exit code is 0 only if every check has passed, so it can be run in CI (make -C host bench).
+ *
+ * Note: the CPU-busy cycles are the cycles the core was not in WFI. We wait for the DMA/IT transfers with WFI, so these are the cycles the transfer really takes from the application.
+ * Note: only register accesses and IRQs cost time in the model (see SimCore_STM32L0x3.cpp). The numbers are for comparing the modes, not a cycle-exact prediction.
+ *
+ */
+
+#include "stdio.h"
+#include "string.h"
+#include "SimCore_STM32L0x3.h"
+#include "SimBMP280.h"
+#include "SimCRCSlave.h"
+#include "SPIDriver_STM32L0x3.h"
+#include "ClockDriver_STM32L0x3.h"
+#include "BMP280Driver_STM32L0x3.h"
+#include "SPIBenchmark_STM32L0x3.h"
+#include "NVMDriver_STM32L0x3.h"
+#include "SPIDriverStatic_STM32L0x3.h"
+#include "SPIReadPlan_STM32L0x3.h"
+
+//LOCAL CONSTANT
+#define HOST_WRITE_REG				0x7F							//writes only hit the reserved 0xFF register (see SPI1BenchmarkSuite)
+#define HOST_WRITE_FILL				0x7F
+#define HOST_CRC_CS_PIN				5								//PB5 - CS of the CRC slave
+#define HOST_CRC_POLYNOMIAL			0x07
+#define HOST_CRC_LOAD_HZ			50000							//TIM2 IRQ rate while the CRC transfers are hammered
+#define HOST_NVM_TEST_ADDRESS		(NVM_EEPROM_START + 0x100)		//scratch words, away from the calibration cache
+#define HOST_NVM_TEST_WORDS			4
+#define HOST_LONG_BYTES				65535							//longest transfer the uint16 length allows
+#define HOST_COMPENSATION_SETS		1024							//sets of BMP280_BENCHMARK_SAMPLES raw samples, a different seed each
+#define HOST_TIMER_LOG				16								//software timer expiries we record
+#define HOST_PROFILE_SCK_DIV		SPI1_BAUD_DIV16					//1 MHz at 32 MHz: MSI needs another prescaler
+#define HOST_PROFILE_TIM2_HZ		1000
+#define HOST_PROFILE_DRIFT_US		50								//TIM6 time a switch may lose (see ClockSetProfile)
+
+//LOCAL VARIABLES
+static SimBMP280 sensor_model;
+static BMP280 sensor;
+static SimCRCSlave crc_model;
+static SPI1Device crc_device;
+static uint8_t host_buf[SPI1_BENCHMARK_MAX_BYTES];					//static: the DMA takes 32-bit addresses (see SimPointer)
+static uint8_t host_long_buf[HOST_LONG_BYTES];
+static const uint8_t host_sizes[] = {1, 6, 24, 64, 128};
+static const char* const host_mode_names[SPI1_BENCHMARK_MODES] = {"poll", "stream", "dma", "it", "wide"};
+static uint16_t host_failures = 0;
+static uint32_t host_injected_faults = 0;							//SPI1 faults injected on purpose - each one costs a recovery
+static volatile uint32_t host_callbacks = 0;
+static uint8_t host_timer_ids[HOST_TIMER_LOG];						//which timer expired, in the order of the expiries
+static uint32_t host_timer_times[HOST_TIMER_LOG];					//TIM6 time stamp of each expiry
+static volatile uint8_t host_timer_count = 0;
+static SoftTimer host_timers[4];
+static volatile uint32_t host_tim2_ticks = 0;
+
+SPI1_STATIC_DEVICE(HostStatic, GPIOB, HOST_CRC_CS_PIN, SPIMODE3, SPI1_BAUD_DIV8)		//a setup the sensor doesn't use
+
+//1) Record a check
+static void HostCheck (uint8_t passed, const char* what) {
+
+	printf("%s: %s\n", passed ? "PASS" : "FAIL", what);
+	if (!passed) host_failures++;
+}
+
+
+//2) One transaction in the selected mode, waited for
+static void HostWaitAsync (void) {
+	/*
+	 * The busy flags are checked with the interrupts off, otherwise the IRQ could come between the check and the WFI and we would sleep until the next TIM6 update.
+	 *
+	 * */
+
+	while (1) {
+		__disable_irq();
+		if (!(SPI1_DMA_busy || SPI1_IT_busy)) break;
+		__WFI();
+		__enable_irq();
+	}
+	__enable_irq();
+}
+
+static void HostTransferDone (void) {
+
+	host_callbacks++;
+}
+
+static uint8_t HostTransfer (uint8_t mode, uint8_t write, uint8_t reg_addr, uint8_t* buf, uint8_t size) {
+	/*
+	 * What happens here?
+	 * Same as SPI1BenchmarkTransfer, but the DMA/IT transfers are waited for with WFI, so the waiting costs no busy cycles.
+	 *
+	 * */
+
+	GPIO_TypeDef* port = sensor.device.cs_port;
+	uint8_t pin = sensor.device.cs_pin;
+	uint8_t error;
+
+	switch (mode) {
+		case SPI1_BENCHMARK_POLL:
+			error = write ? SPI1MasterWrite(reg_addr, buf, size, port, pin) : SPI1MasterRead(reg_addr, buf, size, port, pin);
+			break;
+		case SPI1_BENCHMARK_STREAM:
+			error = write ? SPI1MasterWriteStream(reg_addr, buf, size, port, pin) : SPI1MasterReadStream(reg_addr, buf, size, port, pin);
+			break;
+		case SPI1_BENCHMARK_DMA:
+			error = write ? SPI1MasterWriteDMA(reg_addr, buf, size, port, pin, 0) : SPI1MasterReadDMA(reg_addr, buf, size, port, pin, 0);
+			break;
+		case SPI1_BENCHMARK_WIDE:
+			error = write ? SPI1MasterWrite16(reg_addr, buf, size, port, pin) : SPI1MasterRead16(reg_addr, buf, size, port, pin);
+			break;
+		default:
+			error = write ? SPI1MasterWriteIT(reg_addr, buf, size, port, pin, 0) : SPI1MasterReadIT(reg_addr, buf, size, port, pin, 0);
+			break;
+	}
+
+	HostWaitAsync();
+	if (SPI1_DMA_error || SPI1_IT_error) error = SPI1_ERROR_TIMEOUT;
+	return error;
+}
+
+
+//3) Functional checks
+static void HostChecks (void) {
+	/*
+	 * What happens here?
+	 * The sensor is identified and compensated as in main.c. Then every mode has to read the calibration and the data block exactly as the model holds them,
+	 * and a write has to arrive in the config register. The config register is put back to 0 in the end.
+	 *
+	 * */
+
+	char what[96];
+	BMP280Sample sample;
+
+	HostCheck(BMP280ReadCalibration(&sensor) == SPI1_OK, "calibration read");
+	HostCheck((sensor.calib.dig_T1 == 27504) && (sensor.calib.dig_T3 == -1000) && (sensor.calib.dig_P9 == 6000), "calibration parsed");
+	HostCheck(BMP280ReadSample(&sensor, &sample) == SPI1_OK, "sample read");
+	snprintf(what, sizeof(what), "compensation: %ld (0.01 degC), %lu Pa", (long)sample.temperature, (unsigned long)(sample.pressure >> 8));
+	HostCheck((sample.temperature == SIM_BMP280_TEMPERATURE) && ((sample.pressure >> 8) == SIM_BMP280_PRESSURE), what);
+	HostCheck(sensor_model.regs[BMP280_REG_CTRL_MEAS] == 0x27, "ctrl_meas written by BMP280Configure");
+
+	SPI1DeviceSelect(&sensor.device);
+	for (uint8_t mode = 0; mode < SPI1_BENCHMARK_MODES; mode++) {
+		uint8_t error;
+		uint8_t config = (mode + 1) << 5;
+
+		memset(host_buf, 0, sizeof(host_buf));
+		error = HostTransfer(mode, 0, BMP280_REG_CALIB, host_buf, BMP280_CALIB_LENGTH);
+		snprintf(what, sizeof(what), "%s read of the calibration block", host_mode_names[mode]);
+		HostCheck(!error && !memcmp(host_buf, &sensor_model.regs[BMP280_REG_CALIB], BMP280_CALIB_LENGTH), what);
+
+		memset(host_buf, 0, sizeof(host_buf));
+		error = HostTransfer(mode, 0, BMP280_REG_DATA, host_buf, BMP280_DATA_LENGTH);
+		snprintf(what, sizeof(what), "%s read of the data block", host_mode_names[mode]);
+		HostCheck(!error && !memcmp(host_buf, &sensor_model.regs[BMP280_REG_DATA], BMP280_DATA_LENGTH), what);
+
+		host_buf[0] = config;
+		error = HostTransfer(mode, 1, (BMP280_REG_CONFIG & 0x7F), host_buf, 1);
+		snprintf(what, sizeof(what), "%s write of the config register", host_mode_names[mode]);
+		HostCheck(!error && (sensor_model.regs[BMP280_REG_CONFIG] == config), what);
+	}
+
+	/*
+	 * Segment list: the address and the calibration block go into different buffers. The transfer is repeated for a few TIM6 ticks,
+	 * so the ms IRQ falls into the gapless loop several times.
+	 *
+	 * */
+
+	uint8_t segment_addr = BMP280_REG_CALIB | 0x80;
+	SPI1Segment segments[2] = {{&segment_addr, NULL, 1}, {NULL, host_buf, BMP280_CALIB_LENGTH}};
+	uint64_t segment_end_ns = SimTimeNs() + 5000000;
+	uint32_t segment_runs = 0;
+	uint32_t segment_errors = 0;
+	uint32_t recoveries = SPI1_recovery_count;
+	while (SimTimeNs() < segment_end_ns) {
+		memset(host_buf, 0, sizeof(host_buf));
+		if (SPI1MasterTransfer(segments, 2, GPIOB, 6) || memcmp(host_buf, &sensor_model.regs[BMP280_REG_CALIB], BMP280_CALIB_LENGTH)) segment_errors++;
+		segment_runs++;
+	}
+	snprintf(what, sizeof(what), "segment transfer over 5 ms: %lu runs, %lu errors", (unsigned long)segment_runs, (unsigned long)segment_errors);
+	HostCheck(!segment_errors && (SPI1_recovery_count == recoveries), what);
+
+	host_buf[0] = 0x00;
+	HostTransfer(SPI1_BENCHMARK_POLL, 1, (BMP280_REG_CONFIG & 0x7F), host_buf, 1);
+
+	/*
+	 * Static device: the switch must be refused while the session keeps SPE on, and go through once the session is over.
+	 *
+	 * */
+
+	HostCheck(SPI1SessionBegin(&sensor.device) == SPI1_OK, "session begin");
+	uint32_t session_cr1 = SPI1->CR1;
+	uint8_t refused = (HostStaticSelect() == SPI1_ERROR_BUSY);
+	HostCheck(refused && ((uint32_t) SPI1->CR1 == session_cr1), "static device switch refused within a session");
+	SPI1SessionEnd();
+	HostCheck((HostStaticSelect() == SPI1_OK) && ((SPI1->CR1 & SPI1_DEVICE_CR1_MASK) == HostStatic_CR1), "static device switch after the session");
+	SPI1DeviceSelect(&sensor.device);
+}
+
+
+//3a) Read plans
+static void HostPlanChecks (void) {
+	/*
+	 * What happens here?
+	 * The example map of SPIReadPlan_STM32L0x3.c must give two bursts and read the registers of the model.
+	 * Maps with a burst longer than SPI1_PLAN_MAX_BYTES must be refused, also the ones covering all 256 registers (a 256-byte burst doesn't fit the uint8_t length).
+	 *
+	 * */
+
+	static uint8_t id, status, ctrl[2], data[6];
+	static uint8_t scratch[SPI1_PLAN_MAX_BYTES + 1];
+	const SPI1Field map[4] = {{0xD0, 1, &id}, {0xF3, 1, &status}, {0xF4, 2, ctrl}, {0xF7, 6, data}};
+	const SPI1Field full[2] = {{0x00, 1, scratch}, {0x01, 255, scratch}};
+	const SPI1Field wide[2] = {{0x00, 1, scratch}, {0x01, SPI1_PLAN_MAX_BYTES, scratch}};
+	SPI1ReadPlan plan;
+
+	HostCheck(SPI1PlanBuild(&plan, map, 4) && (plan.burst_count == 2), "read plan of the example map: 2 bursts");
+	HostCheck((SPI1PlanExecute(&sensor.device, &plan) == SPI1_OK) && (id == sensor_model.regs[0xD0]) && (status == sensor_model.regs[0xF3])
+			&& !memcmp(ctrl, &sensor_model.regs[0xF4], 2) && !memcmp(data, &sensor_model.regs[0xF7], 6), "read plan executed");
+	HostCheck(!SPI1PlanBuild(&plan, full, 2), "read plan over all 256 registers refused");
+	HostCheck(!SPI1PlanBuild(&plan, wide, 2), "read plan with a burst over SPI1_PLAN_MAX_BYTES refused");
+	SPI1DeviceSelect(&sensor.device);
+}
+
+
+//4) CRC-checked transfers
+static void HostCRCChecks (void) {
+	/*
+	 * What happens here?
+	 * A CRC slave on PB5 answers a CRC read: first with a good CRC, then with an injected bad one, which must be caught and counted in SPI1_crc_error_count.
+	 * A CRC write must reach the slave with a CRC frame the slave agrees with.
+	 * Lastly, CRC reads are run back-to-back for 20 ms with a fast TIM2 IRQ as load. An IRQ between the last frame and CRCNEXT would lose the CRC frame and end in a recovery.
+	 *
+	 * */
+
+	char what[96];
+	uint8_t error;
+	uint32_t crc_errors = SPI1_crc_error_count;
+
+	SPI1DeviceInit(&crc_device, GPIOB, HOST_CRC_CS_PIN, SPIMODE0, SPI1_FRAME_8BIT, SPI1_BAUD_DIV2);
+	SPI1DeviceSetCRC(&crc_device, HOST_CRC_POLYNOMIAL);
+
+	crc_model.length = 16;
+	memset(host_buf, 0, sizeof(host_buf));
+	error = SPI1DeviceReadCRC(&crc_device, 0x90, host_buf, 16);
+	HostCheck(!error && !memcmp(host_buf, &crc_model.regs[0x10], 16) && (SPI1_crc_error_count == crc_errors), "CRC read with a good CRC");
+
+	crc_model.corrupt_crc = 1;
+	error = SPI1DeviceReadCRC(&crc_device, 0x90, host_buf, 16);
+	crc_model.corrupt_crc = 0;
+	HostCheck((error == SPI1_ERROR_CRC) && (SPI1_crc_error_count == crc_errors + 1), "CRC read with an injected bad CRC is counted");
+
+	crc_model.length = 4;
+	uint8_t crc_data[4] = {0xC0, 0xFF, 0xEE, 0x01};
+	error = SPI1DeviceWriteCRC(&crc_device, 0x20, crc_data, 4);
+	HostCheck(!error && !memcmp(&crc_model.regs[0x20], crc_data, 4) && (crc_model.rx_crc_errors == 0), "CRC write accepted by the slave");
+
+	uint32_t recoveries = SPI1_recovery_count;
+	uint32_t runs = 0;
+	uint32_t failures = 0;
+	uint64_t end_ns = SimTimeNs() + 20000000;
+	TIM2PeriodicConfig(HOST_CRC_LOAD_HZ, 0);
+	while (SimTimeNs() < end_ns) {
+		crc_model.length = runs & 3;
+		if (SPI1DeviceReadCRC(&crc_device, 0x80 | (runs & 0x3F), host_buf, runs & 3)) failures++;
+		runs++;
+	}
+	TIM2PeriodicStop();
+	snprintf(what, sizeof(what), "CRC reads under a %u Hz IRQ load: %lu runs, %lu failed", HOST_CRC_LOAD_HZ, (unsigned long)runs, (unsigned long)failures);
+	HostCheck(!failures && (SPI1_recovery_count == recoveries) && (SPI1_crc_error_count == crc_errors + 1), what);
+}
+
+
+//5) Data EEPROM and the calibration cache
+static uint8_t HostTimeBaseKept (uint32_t tim6_start, uint64_t sim_start_ns) {
+	/*
+	 * TIM6 time elapsed against the simulated time elapsed: they must agree within 20 us.
+	 *
+	 * */
+
+	int64_t tim6_us = (int64_t) TIM6Elapsed(tim6_start);
+	int64_t sim_us = (int64_t)((SimTimeNs() - sim_start_ns) / 1000);
+	int64_t drift = tim6_us - sim_us;
+	return (drift < 20) && (drift > -20);
+}
+
+static void HostNVMChecks (void) {
+	/*
+	 * What happens here?
+	 * Words written into the data EEPROM must read back, and the TIM6 time base must not drift over the ~3.2 ms per word with the interrupts off.
+	 * Then the calibration cache: a miss after invalidating it (read from the sensor and stored), a hit on the next load (no SPI transaction at all),
+	 * a miss again once a calibration word is corrupted behind the checksum's back, and a hit after it has been stored again.
+	 *
+	 * */
+
+	char what[96];
+	uint32_t words[HOST_NVM_TEST_WORDS] = {0x11111111, 0x22222222, 0x33333333, 0x44444444};
+	uint32_t readback[HOST_NVM_TEST_WORDS];
+	uint32_t eeprom_writes = sim_stats.eeprom_writes;
+	uint32_t tim6_start = TIM6Now();
+	uint64_t sim_start_ns = SimTimeNs();
+
+	uint8_t error = NVMEEPROMWrite(HOST_NVM_TEST_ADDRESS, words, HOST_NVM_TEST_WORDS);
+	NVMEEPROMRead(HOST_NVM_TEST_ADDRESS, readback, HOST_NVM_TEST_WORDS);
+	HostCheck(!error && !memcmp(words, readback, sizeof(words)) && (sim_stats.eeprom_writes == eeprom_writes + HOST_NVM_TEST_WORDS), "data EEPROM words written and read back");
+	Delay_ms(2);															//the IRQ pending from the writes has run by now
+	snprintf(what, sizeof(what), "TIM6 time base kept over %u EEPROM words (%lu us TIM6, %lu us simulated)", HOST_NVM_TEST_WORDS,
+			(unsigned long) TIM6Elapsed(tim6_start), (unsigned long)((SimTimeNs() - sim_start_ns) / 1000));
+	HostCheck(HostTimeBaseKept(tim6_start, sim_start_ns), what);
+
+	eeprom_writes = sim_stats.eeprom_writes;
+	error = NVMEEPROMWrite(HOST_NVM_TEST_ADDRESS, words, HOST_NVM_TEST_WORDS);
+	HostCheck(!error && (sim_stats.eeprom_writes == eeprom_writes), "unchanged words are not programmed again");
+
+	uint32_t transactions = sensor_model.transactions;
+	BMP280InvalidateCalibrationCache();
+	error = BMP280LoadCalibration(&sensor, 0x58);
+	HostCheck(!error && !sensor.calib_from_cache && (sensor_model.transactions == transactions + 1) && (sensor.calib.dig_P9 == 6000), "calibration cache miss after invalidating: read from the sensor");
+
+	transactions = sensor_model.transactions;
+	memset(&sensor.calib, 0, sizeof(sensor.calib));
+	error = BMP280LoadCalibration(&sensor, 0x58);
+	HostCheck(!error && sensor.calib_from_cache && (sensor_model.transactions == transactions) && (sensor.calib.dig_T1 == 27504) && (sensor.calib.dig_P9 == 6000), "calibration cache hit: no SPI transaction");
+
+	uint32_t record[BMP280_CALIB_CACHE_WORDS];
+	NVMEEPROMRead(BMP280_CALIB_CACHE_ADDRESS, record, BMP280_CALIB_CACHE_WORDS);
+	SimEEPROMPoke(BMP280_CALIB_CACHE_ADDRESS + 12, record[3] ^ 0x00010000);	//one bit of the calibration flipped, the checksum left alone
+	transactions = sensor_model.transactions;
+	error = BMP280LoadCalibration(&sensor, 0x58);
+	HostCheck(!error && !sensor.calib_from_cache && (sensor_model.transactions == transactions + 1), "calibration cache miss on a checksum mismatch");
+
+	transactions = sensor_model.transactions;
+	error = BMP280LoadCalibration(&sensor, 0x58);
+	HostCheck(!error && sensor.calib_from_cache && (sensor_model.transactions == transactions), "calibration cache hit after it has been stored again");
+
+	error = BMP280LoadCalibration(&sensor, 0x57);
+	HostCheck(!error && !sensor.calib_from_cache, "calibration cache miss for another chip ID");
+	BMP280LoadCalibration(&sensor, 0x58);
+	HostCheck(HostTimeBaseKept(tim6_start, sim_start_ns), "TIM6 time base kept over the calibration cache writes");
+}
+
+
+//5a) Software timers
+static void HostTimerLog (uint8_t id) {
+
+	if (host_timer_count < HOST_TIMER_LOG) {
+		host_timer_ids[host_timer_count] = id;
+		host_timer_times[host_timer_count] = TIM6Now();
+		host_timer_count++;
+	}
+}
+
+static void HostTimerA (void) { HostTimerLog('A'); }
+static void HostTimerB (void) { HostTimerLog('B'); }
+static void HostTimerC (void) { HostTimerLog('C'); }
+static void HostTimerD (void) { HostTimerLog('D'); }
+
+static void HostTimerChecks (void) {
+	/*
+	 * What happens here?
+	 * A and C are one-shots at 3 ms (A started first), B is periodic, 1 ms then every 2 ms, D is started and stopped right away.
+	 * Over 8 ms, the expiries must be B A C B B B: at 3 ms, B comes back with the same deadline as A and C, so it goes behind them.
+	 * Every expiry must come within the ms tick after its deadline, and B's deadlines are counted from the start, so its expiries must not drift.
+	 *
+	 * */
+
+	char what[96];
+	static const char expected[] = "BACBBB";
+	static const uint32_t expected_us[] = {1000, 3000, 3000, 3000, 5000, 7000};
+	uint8_t on_time = 1;
+
+	host_timer_count = 0;
+	uint32_t start = TIM6Now();
+	TIM6TimerStart(&host_timers[0], 3000, 0, HostTimerA);
+	TIM6TimerStart(&host_timers[2], 3000, 0, HostTimerC);
+	TIM6TimerStart(&host_timers[1], 1000, 2000, HostTimerB);
+	TIM6TimerStart(&host_timers[3], 2000, 0, HostTimerD);
+	TIM6TimerStop(&host_timers[3]);
+	Delay_ms(8);
+	TIM6TimerStop(&host_timers[1]);
+
+	uint8_t count = host_timer_count;
+	uint8_t in_order = (count == sizeof(expected) - 1);
+	for (uint8_t i = 0; in_order && (i < count); i++) {
+		uint32_t late_us = (host_timer_times[i] - start) - expected_us[i];
+		if (host_timer_ids[i] != (uint8_t) expected[i]) in_order = 0;
+		if ((int32_t) late_us < 0 || late_us > 1100) on_time = 0;			//the start calls themselves take a few us
+	}
+	snprintf(what, sizeof(what), "software timers expired in order: %u expiries, B A C B B B expected", count);
+	HostCheck(in_order, what);
+	HostCheck(in_order && on_time, "software timers expired within 1 ms of their deadline, no drift of the periodic one");
+	HostCheck(!host_timers[0].active && !host_timers[1].active && !host_timers[2].active && !host_timers[3].active, "software timers out of the queue");
+}
+
+
+//5b) Clock profiles
+static void HostTIM2Tick (void) {
+
+	host_tim2_ticks++;
+}
+
+static void HostProfileChecks (void) {
+	/*
+	 * What happens here?
+	 * A device handle on the sensor's CS is set up for 1 MHz SCK, then we go through HSI16, MSI and back to PLL32 with TIM2 ticking at 1 kHz.
+	 * In each profile, the chip ID is read through the handle and the SCK is measured from the simulated SCK edges: it must be at or below sck_hz,
+	 * and above half of it (the fastest prescaler that is still slow enough). The TIM2 ticks must follow the TIM6 time (one tick either way),
+	 * and TIM6 may lose at most HOST_PROFILE_DRIFT_US per switch.
+	 *
+	 * */
+
+	static const uint8_t profiles[3] = {CLOCK_PROFILE_HSI16, CLOCK_PROFILE_MSI, CLOCK_PROFILE_PLL32};
+	static const char* const profile_names[3] = {"HSI16", "MSI", "PLL32"};
+	char what[128];
+	uint8_t id;
+	SPI1Device device;
+
+	SPI1DeviceInit(&device, GPIOB, 6, SPIMODE0, SPI1_FRAME_8BIT, HOST_PROFILE_SCK_DIV);
+	host_tim2_ticks = 0;
+	uint32_t tim6_start = TIM6Now();
+	uint64_t sim_start_ns = SimTimeNs();
+	TIM2PeriodicConfig(HOST_PROFILE_TIM2_HZ, HostTIM2Tick);
+
+	for (uint8_t i = 0; i < 3; i++) {
+		ClockSetProfile(profiles[i]);
+		SimStats start = sim_stats;
+		id = 0;
+		uint8_t error = SPI1DeviceRead(&device, BMP280_REG_ID, &id, 1);
+		uint64_t edges = sim_stats.sck_edges - start.sck_edges;
+		uint64_t sck_ps = sim_stats.sck_busy_ps - start.sck_busy_ps;
+		uint32_t sck_hz = sck_ps ? (uint32_t)(((edges / 2) * 1000000000000ULL) / sck_ps) : 0;
+		snprintf(what, sizeof(what), "%s profile: chip ID read, SCK %lu Hz for a %lu Hz device", profile_names[i], (unsigned long) sck_hz, (unsigned long) device.sck_hz);
+		HostCheck(!error && (id == 0x58) && (sck_hz <= device.sck_hz) && (sck_hz > device.sck_hz / 2), what);
+		Delay_ms(5);
+	}
+
+	TIM2PeriodicStop();
+	uint32_t tim6_us = TIM6Elapsed(tim6_start);
+	uint32_t sim_us = (uint32_t)((SimTimeNs() - sim_start_ns) / 1000);
+	uint32_t elapsed_ms = tim6_us / 1000;
+	snprintf(what, sizeof(what), "TIM2 over the profile switches: %lu ticks in %lu ms", (unsigned long) host_tim2_ticks, (unsigned long) elapsed_ms);
+	HostCheck((host_tim2_ticks + 1 >= elapsed_ms) && (host_tim2_ticks <= elapsed_ms + 1), what);
+	snprintf(what, sizeof(what), "TIM6 time base over the profile switches: %lu us TIM6, %lu us simulated", (unsigned long) tim6_us, (unsigned long) sim_us);
+	HostCheck((tim6_us <= sim_us + 20) && (tim6_us + 3 * HOST_PROFILE_DRIFT_US >= sim_us), what);
+	HostCheck((SystemCoreClock == 32000000) && (BMP280ReadID(&sensor) == 0x58), "back at 32 MHz, the sensor handle still reads the chip ID");
+}
+
+
+//6) Long gapless transfers
+static void HostLongChecks (void) {
+	/*
+	 * What happens here?
+	 * A stream read of 65535 bytes: 65536 frames must go out, and TIM6 must still agree with the simulated time after ~65 ms with the interrupts off.
+	 * Then the same for a segment list of twice 65535 bytes after the address, ~131 ms with the interrupts off.
+	 *
+	 * */
+
+	char what[96];
+	uint64_t frames = sim_stats.frames;
+	uint32_t tim6_start = TIM6Now();
+	uint64_t sim_start_ns = SimTimeNs();
+
+	SPI1DeviceSelect(&sensor.device);
+	uint8_t error = SPI1MasterReadStream(BMP280_REG_CALIB, host_long_buf, HOST_LONG_BYTES, GPIOB, 6);
+	HostCheck(!error && (sim_stats.frames - frames == (uint64_t) HOST_LONG_BYTES + 1), "65535-byte stream read sends every frame");
+	snprintf(what, sizeof(what), "TIM6 time base kept over the stream (%lu us TIM6, %lu us simulated)",
+			(unsigned long) TIM6Elapsed(tim6_start), (unsigned long)((SimTimeNs() - sim_start_ns) / 1000));
+	HostCheck(HostTimeBaseKept(tim6_start, sim_start_ns), what);
+
+	uint8_t segment_addr = BMP280_REG_CALIB | 0x80;
+	SPI1Segment segments[3] = {{&segment_addr, NULL, 1}, {NULL, host_long_buf, HOST_LONG_BYTES}, {NULL, NULL, HOST_LONG_BYTES}};
+	frames = sim_stats.frames;
+	tim6_start = TIM6Now();
+	sim_start_ns = SimTimeNs();
+	error = SPI1MasterTransfer(segments, 3, GPIOB, 6);
+	HostCheck(!error && (sim_stats.frames - frames == 2 * (uint64_t) HOST_LONG_BYTES + 1), "segment list of 2 x 65535 bytes sends every frame");
+	snprintf(what, sizeof(what), "TIM6 time base kept over the segment list (%lu us TIM6, %lu us simulated)",
+			(unsigned long) TIM6Elapsed(tim6_start), (unsigned long)((SimTimeNs() - sim_start_ns) / 1000));
+	HostCheck(HostTimeBaseKept(tim6_start, sim_start_ns), what);
+}
+
+
+//7) IT transfer errors
+static void HostITFault (uint8_t fault, uint8_t expected_error, const char* what) {
+	/*
+	 * An IT read of 16 bytes with the fault injected after 3 good frames: the callback must come, with SPI1_IT_error set and SPI1 reset.
+	 *
+	 * */
+
+	uint32_t callbacks = host_callbacks;
+	uint32_t recoveries = SPI1_recovery_count;
+
+	SimSPIInjectFault(fault, 3);
+	host_injected_faults++;
+	uint8_t error = SPI1MasterReadIT(BMP280_REG_CALIB, host_buf, 16, GPIOB, 6, HostTransferDone);
+	HostWaitAsync();
+	HostCheck(!error && (host_callbacks == callbacks + 1) && SPI1_IT_error && (SPI1_last_error == expected_error) && (SPI1_recovery_count == recoveries + 1), what);
+}
+
+static void HostITChecks (void) {
+	/*
+	 * What happens here?
+	 * An OVR and a mode fault in the middle of an IT transfer. The next IT transfer must then work again and clear SPI1_IT_error.
+	 * A stalled IT transfer must make the next start fail with SPI1_ERROR_TIMEOUT instead of starting on top of it.
+	 * Lastly, a 65535-byte IT read must send all 65536 frames.
+	 *
+	 * */
+
+	uint8_t error;
+	uint32_t callbacks;
+
+	SPI1DeviceSelect(&sensor.device);
+	HostITFault(SIM_SPI_FAULT_OVR, SPI1_ERROR_OVR, "IT read with an injected OVR ends with the callback and SPI1_IT_error");
+	HostITFault(SIM_SPI_FAULT_MODF, SPI1_ERROR_MODF, "IT read with an injected mode fault ends with the callback and SPI1_IT_error");
+
+	callbacks = host_callbacks;
+	memset(host_buf, 0, sizeof(host_buf));
+	error = SPI1MasterReadIT(BMP280_REG_CALIB, host_buf, BMP280_CALIB_LENGTH, GPIOB, 6, HostTransferDone);
+	HostWaitAsync();
+	HostCheck(!error && !SPI1_IT_error && (host_callbacks == callbacks + 1) && !memcmp(host_buf, &sensor_model.regs[BMP280_REG_CALIB], BMP280_CALIB_LENGTH), "IT read after the faults");
+
+	SimSPIInjectFault(SIM_SPI_FAULT_STALL, 2);
+	host_injected_faults++;
+	error = SPI1MasterReadIT(BMP280_REG_CALIB, host_buf, 16, GPIOB, 6, 0);
+	uint8_t next_error = SPI1MasterReadIT(BMP280_REG_CALIB, host_buf, 16, GPIOB, 6, 0);
+	HostWaitAsync();
+	HostCheck(!error && (next_error == SPI1_ERROR_TIMEOUT) && !SPI1_IT_busy, "IT start after a stalled IT transfer returns SPI1_ERROR_TIMEOUT");
+
+	uint64_t frames = sim_stats.frames;
+	error = SPI1MasterReadIT(BMP280_REG_CALIB, host_long_buf, HOST_LONG_BYTES, GPIOB, 6, 0);
+	HostWaitAsync();
+	HostCheck(!error && !SPI1_IT_error && (sim_stats.frames - frames == (uint64_t) HOST_LONG_BYTES + 1), "65535-byte IT read sends every frame");
+}
+
+
+//8) Polled transfers against DMA and faults
+static void HostRecoveryChecks (void) {
+	/*
+	 * What happens here?
+	 * A polled read is started right after a DMA read of the calibration block, as the TIM2 acquisition IRQ could do it. Both must read the right bytes.
+	 * A stalled DMA transfer must be aborted by the next polled read (SPI1_ERROR_TIMEOUT), with the DMA callback called and SPI1_DMA_error set.
+	 * Then the polled paths on their own: a stalled slave gives SPI1_ERROR_TIMEOUT, an OVR and a mode fault give their own error, each with one recovery.
+	 *
+	 * */
+
+	uint8_t error;
+	uint8_t dma_error;
+	uint8_t data[BMP280_DATA_LENGTH];
+	uint32_t callbacks = host_callbacks;
+	uint32_t recoveries;
+
+	SPI1DeviceSelect(&sensor.device);
+	memset(host_buf, 0, sizeof(host_buf));
+	memset(data, 0, sizeof(data));
+	dma_error = SPI1MasterReadDMA(BMP280_REG_CALIB, host_buf, BMP280_CALIB_LENGTH, GPIOB, 6, HostTransferDone);
+	error = SPI1MasterRead(BMP280_REG_DATA, data, BMP280_DATA_LENGTH, GPIOB, 6);
+	HostWaitAsync();
+	HostCheck(!dma_error && !error && !SPI1_DMA_error && (host_callbacks == callbacks + 1) && !memcmp(host_buf, &sensor_model.regs[BMP280_REG_CALIB], BMP280_CALIB_LENGTH)
+			&& !memcmp(data, &sensor_model.regs[BMP280_REG_DATA], BMP280_DATA_LENGTH), "polled read during a DMA read waits for it");
+
+	callbacks = host_callbacks;
+	recoveries = SPI1_recovery_count;
+	SimSPIInjectFault(SIM_SPI_FAULT_STALL, 4);
+	host_injected_faults++;
+	dma_error = SPI1MasterReadDMA(BMP280_REG_CALIB, host_buf, BMP280_CALIB_LENGTH, GPIOB, 6, HostTransferDone);
+	error = SPI1MasterRead(BMP280_REG_DATA, data, BMP280_DATA_LENGTH, GPIOB, 6);
+	HostCheck(!dma_error && (error == SPI1_ERROR_TIMEOUT) && SPI1_DMA_error && !SPI1_DMA_busy && (host_callbacks == callbacks + 1) && (SPI1_recovery_count == recoveries + 1),
+			"stalled DMA read aborted by the next polled read, its callback called");
+
+	recoveries = SPI1_recovery_count;
+	SimSPIInjectFault(SIM_SPI_FAULT_STALL, 2);
+	host_injected_faults++;
+	error = SPI1MasterRead(BMP280_REG_CALIB, host_buf, 16, GPIOB, 6);
+	HostCheck((error == SPI1_ERROR_TIMEOUT) && (SPI1_recovery_count == recoveries + 1), "stalled slave: polled read returns SPI1_ERROR_TIMEOUT after one recovery");
+
+	recoveries = SPI1_recovery_count;
+	SimSPIInjectFault(SIM_SPI_FAULT_OVR, 2);
+	host_injected_faults++;
+	error = SPI1MasterRead(BMP280_REG_CALIB, host_buf, 16, GPIOB, 6);
+	HostCheck((error == SPI1_ERROR_OVR) && (SPI1_recovery_count == recoveries + 1), "injected OVR: polled read returns SPI1_ERROR_OVR after one recovery");
+
+	recoveries = SPI1_recovery_count;
+	SimSPIInjectFault(SIM_SPI_FAULT_MODF, 2);
+	host_injected_faults++;
+	error = SPI1MasterReadStream(BMP280_REG_CALIB, host_buf, 16, GPIOB, 6);
+	HostCheck((error == SPI1_ERROR_MODF) && (SPI1_recovery_count == recoveries + 1), "injected mode fault: stream read returns SPI1_ERROR_MODF after one recovery");
+
+	memset(host_buf, 0, sizeof(host_buf));
+	error = SPI1MasterRead(BMP280_REG_CALIB, host_buf, BMP280_CALIB_LENGTH, GPIOB, 6);
+	HostCheck(!error && !memcmp(host_buf, &sensor_model.regs[BMP280_REG_CALIB], BMP280_CALIB_LENGTH), "polled read after the recoveries");
+}
+
+
+//9) Compensation against the datasheet formulas
+static void HostCompensationChecks (void) {
+	/*
+	 * What happens here?
+	 * BMP280BenchmarkCompensationRun over HOST_COMPENSATION_SETS sample sets with the calibration read from the sensor model. Any mismatch fails.
+	 * The cycles are host CPU cycles (see SimHostCycles). They don't carry over to the M0+, not even as a ratio: there every 64-bit multiplication is a library call,
+	 * which is what the batch path saves. The board numbers come from BMP280BenchmarkCompensation (main.c, RUN_SPI_BENCHMARK).
+	 *
+	 * */
+
+	char what[96];
+	BMP280BenchmarkResult result;
+	uint32_t samples = 0;
+	uint32_t mismatches = 0;
+	uint64_t reference_cycles = 0;
+	uint64_t batch_cycles = 0;
+
+	for (uint32_t seed = 1; seed <= HOST_COMPENSATION_SETS; seed++) {
+		BMP280BenchmarkCompensationRun(&sensor.calib, seed, &result);
+		samples += result.samples;
+		mismatches += result.mismatches;
+		reference_cycles += result.reference_cycles;
+		batch_cycles += result.batch_cycles;
+	}
+
+	printf("\nBMP280 compensation on the host CPU (%lu samples): reference %llu cycles/sample, batch %llu cycles/sample\n", (unsigned long) samples,
+			(unsigned long long)(reference_cycles / samples), (unsigned long long)(batch_cycles / samples));
+	snprintf(what, sizeof(what), "batch compensation equals the datasheet formulas: %lu samples, %lu mismatches", (unsigned long) samples, (unsigned long) mismatches);
+	HostCheck(mismatches == 0, what);
+}
+
+
+//10) Simulated time measurement
+static void HostMeasure (void) {
+	/*
+	 * What happens here?
+	 * Every mode, read and write, every size: one transaction each, measured with the simulation counters instead of TIM6.
+	 * - latency: simulated time from the call to the end of the transaction (the DMA/IT ones included)
+	 * - cpu: core clock cycles not spent in WFI, and the share of the latency they are
+	 * - irq: of the cpu cycles, the ones spent in IRQ handlers
+	 * - bus: the share of the latency SCK was running
+	 * Every transaction must have exactly 16 SCK edges per byte plus the address, and no overrun.
+	 *
+	 * */
+
+	uint8_t edges_ok = 1;
+	uint32_t overruns = sim_stats.overruns;
+
+	printf("\nSimulated SPI1 timing, %lu MHz core, %lu cycles per register access\n", (unsigned long)(SystemCoreClock / 1000000), (unsigned long)SIM_ACCESS_CYCLES);
+	printf("mode | op | bytes | latency ns | B/s | cpu cycles | cpu %% | irq cycles | sck edges | bus %%\n");
+
+	SPI1DeviceSelect(&sensor.device);
+	for (uint8_t mode = 0; mode < SPI1_BENCHMARK_MODES; mode++) {
+		for (uint8_t write = 0; write < 2; write++) {
+			for (uint8_t i = 0; i < sizeof(host_sizes); i++) {
+				uint8_t size = host_sizes[i];
+				if (write) memset(host_buf, HOST_WRITE_FILL, size);
+
+				SimStats start = sim_stats;
+				HostTransfer(mode, write, (write ? HOST_WRITE_REG : BMP280_REG_CALIB), host_buf, size);
+				uint64_t latency_ps = sim_stats.time_ps - start.time_ps;
+				uint64_t busy = sim_stats.busy_cycles - start.busy_cycles;
+				uint64_t busy_ps = busy * (1000000000000ULL / SystemCoreClock);
+				uint64_t edges = sim_stats.sck_edges - start.sck_edges;
+				uint64_t sck_ps = sim_stats.sck_busy_ps - start.sck_busy_ps;
+
+				if (edges != 16 * ((uint64_t)size + 1)) edges_ok = 0;
+				printf("%s | %s | %u | %llu | %llu | %llu | %llu | %llu | %llu | %llu\n", host_mode_names[mode], (write ? "write" : "read"), size,
+						(unsigned long long)(latency_ps / 1000),
+						(unsigned long long)(latency_ps ? (((uint64_t)size * 1000000000000ULL) / latency_ps) : 0),
+						(unsigned long long)busy, (unsigned long long)(latency_ps ? ((busy_ps * 100) / latency_ps) : 0),
+						(unsigned long long)(sim_stats.irq_cycles - start.irq_cycles), (unsigned long long)edges,
+						(unsigned long long)(latency_ps ? ((sck_ps * 100) / latency_ps) : 0));
+			}
+		}
+	}
+	printf("\n");
+
+	HostCheck(edges_ok, "16 SCK edges per byte in every transaction");
+	HostCheck(sim_stats.overruns == overruns, "no overrun");
+}
+
+
+//11) Main
+int main (void) {
+	/*
+	 * What happens here?
+	 * Same order as main.c: clock, TIM6, SPI1 and DMA, then the sensor: ID, reset, wait for the NVM copy, configuration.
+	 * The BMP280 model is attached to PB6 before anything runs.
+	 *
+	 * */
+
+	SimReset();
+	SimBMP280Init(&sensor_model, GPIOB, 6);
+	SimCRCSlaveInit(&crc_model, GPIOB, HOST_CRC_CS_PIN, HOST_CRC_POLYNOMIAL);
+
+	SysClockConfig();
+	TIM6Config();
+	SPI1MasterInit(GPIOB, 6);
+	SPI1DMAInit();
+	ClockRegisterHook(SPI1ClockChanged);
+
+	BMP280Init(&sensor, GPIOB, 6);
+	HostCheck(SystemCoreClock == 32000000, "32 MHz core clock");
+	HostCheck(BMP280ReadID(&sensor) == 0x58, "chip ID 0x58");
+	HostCheck(BMP280Reset(&sensor) == SPI1_OK, "sensor reset");
+	uint32_t waited = BMP280WaitReady(&sensor, BMP280_STATUS_IM_UPDATE);
+	HostCheck((waited >= (SIM_BMP280_STARTUP_NS / 1000) - 200) && (waited < BMP280_READY_TIMEOUT_US), "im_update wait follows the simulated time");
+	BMP280Configure(&sensor, 0x27, 0x00);
+
+	HostChecks();
+	HostPlanChecks();
+	HostCRCChecks();
+	HostNVMChecks();
+	HostTimerChecks();
+	HostProfileChecks();
+	HostLongChecks();
+	HostITChecks();
+	HostRecoveryChecks();
+	HostCompensationChecks();
+	HostMeasure();
+
+	SPI1BenchmarkStream(&sensor.device, BMP280_REG_CALIB);
+	SPI1BenchmarkSuite(&sensor.device, BMP280_REG_CALIB, HOST_WRITE_REG, HOST_WRITE_FILL);
+	SPI1BenchmarkStatic(&sensor.device, BMP280_REG_DATA);
+	printf("\n");
+
+	HostCheck(SPI1_recovery_count == host_injected_faults, "no SPI1 recovery apart from the injected faults");
+	HostCheck(sensor_model.protocol_errors == 0, "no BMP280 protocol error");
+	HostCheck(sim_stats.bus_conflicts == 0, "no bus conflict");
+
+	printf("\nSimulated %llu us: %llu cycles (%llu busy, %llu in IRQs), %llu register accesses, %llu frames, %llu SCK edges, %llu DMA transfers, %llu IRQs\n",
+			(unsigned long long)(sim_stats.time_ps / 1000000), (unsigned long long)sim_stats.cycles, (unsigned long long)sim_stats.busy_cycles,
+			(unsigned long long)sim_stats.irq_cycles, (unsigned long long)sim_stats.register_accesses, (unsigned long long)sim_stats.frames,
+			(unsigned long long)sim_stats.sck_edges, (unsigned long long)sim_stats.dma_transfers, (unsigned long long)sim_stats.irqs);
+	printf("BMP280 model: %lu transactions, %lu bytes, %lu register writes, %lu ignored writes\n", (unsigned long)sensor_model.transactions,
+			(unsigned long)sensor_model.bytes, (unsigned long)sensor_model.register_writes, (unsigned long)sensor_model.ignored_writes);
+	printf("%s: %u failed checks\n", host_failures ? "FAILED" : "PASSED", host_failures);
+
+	return host_failures ? 1 : 0;
+}
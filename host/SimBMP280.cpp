@@ -0,0 +1,175 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8 - host simulation
+ *  Program version: 1.0
+ *  File: SimBMP280.cpp
+ *  Change history:
+ *
+ * v.1.0
+ * BMP280 slave model for the host build. It is attached to SPI1 through its CS pin (SimAttachSlave).
+ * The SPI protocol is the one from the datasheet: the first byte of a transaction is the control byte, bit 7 HIGH is a read, LOW is a write of register (control | 0x80).
+ * Reads go on with the next register for every further byte (burst read). Writes are address/data pairs, as many as we want within one CS assertion.
+ * The calibration and the raw data are the example values of the datasheet (section 8.2), so the compensation must give 25.08 degC and 100653 Pa.
+ * The status bits follow the simulated time: im_update is HIGH for SIM_BMP280_STARTUP_NS after a reset, measuring for SIM_BMP280_CONVERSION_NS after a forced mode start.
+ * A forced conversion puts the sensor back into sleep mode when it is done.
+ *
+ */
+
+#include "string.h"
+#include "SimBMP280.h"
+
+//LOCAL CONSTANT
+#define SIM_BMP280_IDLE				0								//waiting for the control byte
+#define SIM_BMP280_READ				1								//burst read ongoing
+#define SIM_BMP280_WRITE			2								//control byte of a write received, data byte comes next
+
+//LOCAL VARIABLES
+static const uint16_t sim_bmp280_calib[12] = {27504, 26435, (uint16_t)-1000, 36477, (uint16_t)-10685, 3024, 2855, 140, (uint16_t)-7, 15500, (uint16_t)-14600, 6000};
+
+//1) Time based status
+static void SimBMP280Update (SimBMP280* model) {
+	/*
+	 * We refresh the status register from the simulated time. A finished forced conversion takes the sensor back to sleep.
+	 *
+	 * */
+
+	uint64_t now_ns = SimTimeNs();
+	uint8_t status = 0;
+	if (now_ns < model->measuring_end_ns) {
+		status |= (1<<3);
+	} else if ((model->regs[0xF4] & 3) == 1 || (model->regs[0xF4] & 3) == 2) {
+		model->regs[0xF4] &= ~3;
+	}
+	if (now_ns < model->im_update_end_ns) status |= (1<<0);
+	model->regs[0xF3] = status;
+}
+
+
+//2) Power-on/soft reset values
+static void SimBMP280Reset (SimBMP280* model) {
+
+	model->regs[0xE0] = 0x00;
+	model->regs[0xF3] = 0x00;
+	model->regs[0xF4] = 0x00;
+	model->regs[0xF5] = 0x00;
+	model->measuring_end_ns = 0;
+	model->im_update_end_ns = SimTimeNs() + SIM_BMP280_STARTUP_NS;
+	model->resets++;
+}
+
+
+//3) Register write
+static void SimBMP280Write (SimBMP280* model, uint8_t address, uint8_t data) {
+	/*
+	 * Only reset, ctrl_meas and config can be written. Anything else is ignored by the sensor - we count it.
+	 *
+	 * */
+
+	SimBMP280Update(model);
+	switch (address) {
+		case 0xE0:
+			if (data == 0xB6) {
+				SimBMP280Reset(model);
+			}
+			model->register_writes++;
+			break;
+		case 0xF4:
+			model->regs[0xF4] = data;
+			if (((data & 3) == 1) || ((data & 3) == 2)) model->measuring_end_ns = SimTimeNs() + SIM_BMP280_CONVERSION_NS;
+			model->register_writes++;
+			break;
+		case 0xF5:
+			model->regs[0xF5] = data & ~(1<<1);						//bit 1 is reserved
+			model->register_writes++;
+			break;
+		default:
+			model->ignored_writes++;
+			break;
+	}
+}
+
+
+//4) Slave callbacks
+static void SimBMP280Select (void* context) {
+
+	SimBMP280* model = (SimBMP280*) context;
+	model->state = SIM_BMP280_IDLE;
+	model->mode_checked = 0;
+	model->transactions++;
+}
+
+static void SimBMP280Deselect (void* context) {
+
+	SimBMP280* model = (SimBMP280*) context;
+	model->state = SIM_BMP280_IDLE;
+}
+
+static uint8_t SimBMP280Exchange (void* context, uint8_t mosi, uint8_t spi_mode) {
+	/*
+	 * What happens here?
+	 * We get the byte the master has sent and give back the byte the sensor has put on MISO at the same time.
+	 * MISO is HIGH-Z (read as 0xFF) during the control byte and the data bytes of a write.
+	 *
+	 * */
+
+	SimBMP280* model = (SimBMP280*) context;
+	uint8_t miso = 0xFF;
+
+	model->bytes++;
+	if (!model->mode_checked) {
+		model->mode_checked = 1;
+		if ((spi_mode == 1) || (spi_mode == 2)) model->protocol_errors++;
+	}
+
+	switch (model->state) {
+		case SIM_BMP280_IDLE:
+			model->address = mosi | 0x80;
+			model->state = (mosi & 0x80) ? SIM_BMP280_READ : SIM_BMP280_WRITE;
+			break;
+		case SIM_BMP280_READ:
+			SimBMP280Update(model);
+			miso = model->regs[model->address++];
+			break;
+		default:
+			SimBMP280Write(model, model->address, mosi);
+			model->state = SIM_BMP280_IDLE;
+			break;
+	}
+	return miso;
+}
+
+
+//5) Set up the model
+void SimBMP280Init (SimBMP280* model, GPIO_TypeDef* cs_port, uint8_t cs_pin) {
+	/*
+	 * What happens here?
+	 * We fill in the registers with the datasheet example: chip ID 0x58, calibration at 0x88 (little endian), raw data at 0xF7 (MSB, LSB, XLSB - pressure first).
+	 * The sensor starts up as after power-on, then it is attached to SPI1.
+	 *
+	 * */
+
+	memset(model, 0, sizeof(SimBMP280));
+	model->regs[0xD0] = 0x58;
+	for (uint8_t i = 0; i < 12; i++) {
+		model->regs[0x88 + (2 * i)] = (uint8_t) sim_bmp280_calib[i];
+		model->regs[0x89 + (2 * i)] = (uint8_t)(sim_bmp280_calib[i] >> 8);
+	}
+	model->regs[0xF7] = (uint8_t)(SIM_BMP280_ADC_P >> 12);
+	model->regs[0xF8] = (uint8_t)(SIM_BMP280_ADC_P >> 4);
+	model->regs[0xF9] = (uint8_t)(SIM_BMP280_ADC_P << 4);
+	model->regs[0xFA] = (uint8_t)(SIM_BMP280_ADC_T >> 12);
+	model->regs[0xFB] = (uint8_t)(SIM_BMP280_ADC_T >> 4);
+	model->regs[0xFC] = (uint8_t)(SIM_BMP280_ADC_T << 4);
+	SimBMP280Reset(model);
+	model->resets = 0;
+
+	model->slave.cs_port = cs_port;
+	model->slave.cs_pin = cs_pin;
+	model->slave.context = model;
+	model->slave.select = SimBMP280Select;
+	model->slave.deselect = SimBMP280Deselect;
+	model->slave.exchange = SimBMP280Exchange;
+	SimAttachSlave(&model->slave);
+}
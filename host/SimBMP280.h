@@ -0,0 +1,44 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8 - host simulation
+ *  HEader version: 1.0
+ *  File: SimBMP280.h
+ */
+
+#ifndef HOST_SIMBMP280_H_
+#define HOST_SIMBMP280_H_
+
+#include "stdint.h"
+#include "SimCore_STM32L0x3.h"										//slave interface, simulated time
+
+//LOCAL CONSTANT
+#define SIM_BMP280_ADC_T			519888							//datasheet example raw values
+#define SIM_BMP280_ADC_P			415148
+#define SIM_BMP280_TEMPERATURE		2508							//what they give with the example calibration, in 0.01 degC
+#define SIM_BMP280_PRESSURE			100653							//in Pa
+#define SIM_BMP280_STARTUP_NS		2000000							//NVM copy after a reset (im_update)
+#define SIM_BMP280_CONVERSION_NS	6400000							//forced conversion with x1 oversampling
+
+//LOCAL TYPES
+typedef struct {
+	SimSlave slave;
+	uint8_t regs[256];
+	uint8_t state;													//see SimBMP280Exchange
+	uint8_t mode_checked;											//SPI mode of this transaction checked
+	uint8_t address;
+	uint64_t im_update_end_ns;
+	uint64_t measuring_end_ns;
+	uint32_t transactions;											//CS assertions
+	uint32_t bytes;
+	uint32_t register_writes;
+	uint32_t ignored_writes;										//writes to read-only or reserved registers
+	uint32_t protocol_errors;										//transactions in SPI mode 1 or 2 (the BMP280 only does mode 0 and 3)
+	uint32_t resets;
+} SimBMP280;
+
+//FUNCTION PROTOTYPES
+void SimBMP280Init (SimBMP280* model, GPIO_TypeDef* cs_port, uint8_t cs_pin);
+
+#endif /* HOST_SIMBMP280_H_ */
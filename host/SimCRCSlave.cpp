@@ -0,0 +1,97 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8 - host simulation
+ *  Program version: 1.0
+ *  File: SimCRCSlave.cpp
+ *  Change history:
+ *
+ * v.1.0
+ * Generic register slave with a CRC-8 frame at the end of every transaction, for the CRC-checked transfers of the driver (the BMP280 has no CRC).
+ * Same protocol as the BMP280: control byte first (bit 7 HIGH is a read), then the data bytes with the register address stepping on every byte.
+ * After "length" data bytes, the slave sends the CRC of everything it has put on MISO and checks the CRC frame of the master against what came on MOSI.
+ * The CRC is the one of the SPI peripheral: MSB first, initial value 0, no final XOR. An error can be injected by inverting the CRC sent back.
+ *
+ */
+
+#include "string.h"
+#include "SimCRCSlave.h"
+
+//1) CRC-8 of one byte
+static uint8_t SimCRCSlaveStep (uint8_t crc, uint8_t data, uint8_t polynomial) {
+
+	crc ^= data;
+	for (uint8_t i = 0; i < 8; i++) {
+		crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ polynomial) : (uint8_t)(crc << 1);
+	}
+	return crc;
+}
+
+
+//2) Slave callbacks
+static void SimCRCSlaveSelect (void* context) {
+
+	SimCRCSlave* model = (SimCRCSlave*) context;
+	model->position = 0;
+	model->tx_crc = 0;
+	model->rx_crc = 0;
+	model->transactions++;
+}
+
+static uint8_t SimCRCSlaveExchange (void* context, uint8_t mosi, uint8_t spi_mode) {
+	/*
+	 * What happens here?
+	 * Position 0 is the control byte, 1 to length are the data bytes, length + 1 is the CRC frame. Anything after that is ignored.
+	 * The reply to the control byte is 0x00, so it goes into the CRC as well.
+	 *
+	 * */
+
+	SimCRCSlave* model = (SimCRCSlave*) context;
+	uint8_t miso = 0x00;
+	(void) spi_mode;
+
+	if (model->position == 0) {
+		model->address = mosi;											//bit 7 stays the read flag
+	} else if (model->position <= model->length) {
+		if (model->address & 0x80) {
+			miso = model->regs[model->address & 0x7F];
+		} else {
+			model->regs[model->address] = mosi;
+		}
+		model->address = (model->address & 0x80) | ((model->address + 1) & 0x7F);
+	} else if (model->position == model->length + 1) {
+		model->crc_frames++;
+		if (mosi != model->rx_crc) model->rx_crc_errors++;
+		miso = model->corrupt_crc ? (uint8_t) ~model->tx_crc : model->tx_crc;
+		model->position++;
+		return miso;
+	} else {
+		return 0xFF;
+	}
+
+	model->rx_crc = SimCRCSlaveStep(model->rx_crc, mosi, model->polynomial);
+	model->tx_crc = SimCRCSlaveStep(model->tx_crc, miso, model->polynomial);
+	model->position++;
+	return miso;
+}
+
+
+//3) Set up the model
+void SimCRCSlaveInit (SimCRCSlave* model, GPIO_TypeDef* cs_port, uint8_t cs_pin, uint8_t polynomial) {
+	/*
+	 * The registers hold their own address XOR 0x5A, so every byte of a burst is different.
+	 *
+	 * */
+
+	memset(model, 0, sizeof(SimCRCSlave));
+	for (uint16_t i = 0; i < 128; i++) model->regs[i] = (uint8_t)(i ^ 0x5A);
+	model->polynomial = polynomial;
+
+	model->slave.cs_port = cs_port;
+	model->slave.cs_pin = cs_pin;
+	model->slave.context = model;
+	model->slave.select = SimCRCSlaveSelect;
+	model->slave.exchange = SimCRCSlaveExchange;
+	SimAttachSlave(&model->slave);
+}
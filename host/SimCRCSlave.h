@@ -0,0 +1,35 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8 - host simulation
+ *  HEader version: 1.0
+ *  File: SimCRCSlave.h
+ */
+
+#ifndef HOST_SIMCRCSLAVE_H_
+#define HOST_SIMCRCSLAVE_H_
+
+#include "stdint.h"
+#include "SimCore_STM32L0x3.h"										//slave interface
+
+//LOCAL TYPES
+typedef struct {
+	SimSlave slave;
+	uint8_t regs[128];
+	uint8_t polynomial;												//CRC-8 polynomial, same as CRCPR on the master side
+	uint16_t length;												//data bytes of the next transactions - the CRC frame comes after them
+	uint8_t corrupt_crc;											//the CRC sent back is inverted (injected error)
+	uint8_t address;
+	uint16_t position;												//bytes of the transaction so far, the control byte included
+	uint8_t tx_crc;													//CRC of what we put on MISO
+	uint8_t rx_crc;													//CRC of what came on MOSI
+	uint32_t transactions;
+	uint32_t crc_frames;											//transactions that ended with a CRC frame
+	uint32_t rx_crc_errors;											//CRC frames from the master that didn't match
+} SimCRCSlave;
+
+//FUNCTION PROTOTYPES
+void SimCRCSlaveInit (SimCRCSlave* model, GPIO_TypeDef* cs_port, uint8_t cs_pin, uint8_t polynomial);
+
+#endif /* HOST_SIMCRCSLAVE_H_ */
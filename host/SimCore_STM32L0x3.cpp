@@ -0,0 +1,1268 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8 - host simulation
+ *  Program version: 1.0
+ *  File: SimCore_STM32L0x3.cpp
+ *  Change history:
+ *
+ * v.1.0
+ * Register model of the peripherals the SPI driver uses: RCC, GPIO, SPI1, DMA1 channel 2/3, TIM2, TIM6, plus the NVIC and the core intrinsics.
+ * Every register access (see SimReg in stm32l053xx.h) ends up here. The model has one clock: the simulated time in ps.
+ * - every register access costs SIM_ACCESS_CYCLES core clock cycles, IRQ entry and exit cost SIM_IRQ_ENTRY_CYCLES/SIM_IRQ_EXIT_CYCLES
+ * - code that doesn't touch a register is free. Compute-only code (e.g. the BMP280 compensation) can't be timed with this.
+ * - SPI1 frames take 8 or 16 SCK periods, SCK being PCLK2 / 2^(BR+1). Back-to-back frames run without a gap, as on the real bus.
+ * - the timers count on the APB1 timer clock, the core and the SPI follow the RCC setup (MSI after reset, then HSI16 + PLL)
+ * - __WFI jumps to the next event (SPI frame end or timer update) and the time spent there is counted as sleep, not as busy cycles
+ * Reads advance the time first and sample the register afterwards, writes act at once and the time advances afterwards.
+ * Pending IRQs are served after every access, with the priorities and PRIMASK of the NVIC.
+ *
+ * v.1.1
+ * The NVIC latches a pending IRQ, as the real one does. An IRQ line that goes HIGH while the IRQ can't be served (PRIMASK, lower priority) stays pending even if the flag is cleared before it is served.
+ * The handler is then called with its flag LOW. NVIC_ClearPendingIRQ drops the latched request.
+ * The data EEPROM is modelled: 2 kbytes of memory mapped at its real address (0x08080000), unlocked by the PEKEYR sequence, BSY for SIM_EEPROM_WRITE_PS after every word written.
+ * A word written while PELOCK is HIGH is not programmed and sets WRPERR. The content survives SimReset, like the real EEPROM survives a reset.
+ *
+ * v.1.2
+ * SPI1 faults can be injected for the recovery checks (SimSPIInjectFault): a stalled SCK, a lost reply (OVR) or a mode fault, once, after a given number of good frames.
+ * SimHostCycles reads the cycle counter of the host CPU, for timing compute-only code (the BMP280 compensation benchmark).
+ *
+ * Modelled SPI1 details: TXE/RXNE/BSY, OVR (cleared by a DR read followed by an SR read), MODF (SSM with SSI LOW in master mode), hardware CRC with CRCNEXT/CRCERR,
+ * the DMA requests, the TXEIE/RXNEIE/ERRIE interrupts and the reset through RCC_APB2RSTR.
+ * Not modelled: slave mode, bidirectional mode, TI mode, I2S, the flash program memory. The CPU doesn't stall while the EEPROM is programmed (the driver programs from RAM anyway).
+ *
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/mman.h"
+#include "time.h"
+#include "SimCore_STM32L0x3.h"
+
+//LOCAL CONSTANT
+#define SIM_MSI_RESET_RANGE			5								//2.097 MHz
+#define SIM_HSI_HZ					16000000
+#define SIM_THREAD_PRIORITY			4								//lower than any NVIC priority (0..3)
+#define SIM_NO_EVENT				0xFFFFFFFFFFFFFFFFULL
+#define SIM_STACK_WINDOW			0x01000000ULL					//buffers on the host stack are expected to be within this distance of the stack pointer
+#define SIM_WFI_LIMIT_PS			10000000000000ULL				//10 s asleep without an IRQ - the program hangs
+#define SIM_EEPROM_START			0x08080000						//data EEPROM of the L053, 2 kbytes
+#define SIM_EEPROM_WORDS			512
+#define SIM_EEPROM_WRITE_PS			3200000000ULL					//one word with the erase, ~3.2 ms
+
+//LOCAL TYPES
+typedef struct {
+	uint16_t tx_data;
+	uint8_t tx_full;
+	uint16_t rx_data;
+	uint8_t rx_full;
+	uint8_t ovr;
+	uint8_t ovr_dr_read;											//DR read since the overrun - the next SR read clears OVR
+	uint8_t modf;
+	uint8_t crcerr;
+	uint8_t shifting;												//a frame is on the bus
+	uint8_t stalled;												//the frame on the bus never ends (injected fault)
+	uint8_t shift_crc;												//the frame on the bus is the CRC
+	uint16_t shift_data;
+	uint8_t shift_bits;
+	uint64_t shift_end_ps;
+	uint16_t txcrc;
+	uint16_t rxcrc;
+} SimSPI;
+
+typedef struct {
+	TIM_TypeDef* regs;
+	uint64_t last_ps;												//time the counter was last brought up to
+	uint32_t cnt;
+	uint32_t psc_count;												//timer clocks since the last counter step
+	uint32_t psc_active;											//PSC is buffered until the next update event
+} SimTimer;
+
+typedef struct {
+	uint8_t* pointer;												//internal memory address - CMAR is latched when the channel is enabled
+	uint32_t remaining;
+	uint32_t length;
+} SimDMAChannel;
+
+//LOCAL VARIABLES
+SPI_TypeDef sim_spi1;
+GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+RCC_TypeDef sim_rcc;
+TIM_TypeDef sim_tim2, sim_tim6;
+DMA_TypeDef sim_dma1;
+DMA_Channel_TypeDef sim_dma1_channel[8];
+DMA_Request_TypeDef sim_dma1_cselr;
+FLASH_TypeDef sim_flash;
+PWR_TypeDef sim_pwr;
+uint32_t SystemCoreClock = 2097152;
+
+SimStats sim_stats;
+
+static SimSPI spi;
+static SimTimer timer2 = {&sim_tim2, 0, 0, 0, 0};
+static SimTimer timer6 = {&sim_tim6, 0, 0, 0, 0};
+static SimDMAChannel dma_channel[8];
+static SimSlave* slaves[SIM_SLAVES];
+static uint8_t slave_count = 0;
+
+static uint64_t now_ps = 0;
+static uint32_t core_period_ps;										//HCLK
+static uint32_t pclk2_period_ps;									//SPI1
+static uint32_t timer_period_ps;									//APB1 timer clock
+
+static uint8_t nvic_enabled[32];
+static uint8_t nvic_priority[32];
+static uint8_t nvic_pending[32];										//latched requests
+static uint8_t nvic_active[32];
+static uint32_t primask = 0;
+static uint32_t active_priority = SIM_THREAD_PRIORITY;
+static uint32_t ipsr = 0;
+static uint8_t irq_depth = 0;
+
+//handlers in the drivers
+void SPI1_IRQHandler (void);
+void DMA1_Channel2_3_IRQHandler (void);
+void TIM2_IRQHandler (void);
+void TIM6_DAC_IRQHandler (void);
+
+static const uint8_t sim_irq_lines[] = {TIM6_DAC_IRQn, DMA1_Channel2_3_IRQn, TIM2_IRQn, SPI1_IRQn};
+
+static volatile uint32_t* eeprom = 0;								//mapped at SIM_EEPROM_START
+static uint32_t eeprom_shadow[SIM_EEPROM_WORDS];					//what has been programmed
+static uint64_t eeprom_busy_end_ps = 0;
+static uint8_t eeprom_key_step = 0;
+
+static uint8_t spi_fault = SIM_SPI_FAULT_NONE;						//injected fault, one-shot
+static uint32_t spi_fault_frames = 0;								//good frames left before it hits
+
+static void SimRunUntil (uint64_t target_ps);
+static void SimDeliverIRQs (void);
+static void SimLatchIRQs (void);
+static void SimDMAService (void);
+static uint32_t SimFlashRead (uint32_t offset);
+static void SimEEPROMMap (void);
+static void SimFlashWrite (uint32_t offset, uint32_t data);
+
+
+//1) Stop the simulation on a model error
+void SimFault (const char* message) {
+	/*
+	 * The drivers did something the hardware would not survive (or the model can't follow). There is no point in going on, so we report it and exit.
+	 *
+	 * */
+
+	fflush(stdout);
+	fprintf(stderr, "SIM FAULT at %llu ns: %s\n", (unsigned long long)(now_ps / 1000), message);
+	exit(2);
+}
+
+
+//2) Clock tree
+static uint32_t SimSysclkHz (void) {
+	/*
+	 * SWS follows SW at once in the model, so we can take the source from SWS.
+	 * PLLMUL is [21:18] (3, 4, 6, 8, 12, 16, 24, 32, 48) and PLLDIV is [23:22] (value + 1).
+	 *
+	 * */
+
+	static const uint8_t pll_mul[9] = {3, 4, 6, 8, 12, 16, 24, 32, 48};
+	uint32_t cfgr = sim_rcc.CFGR.value;
+
+	switch ((cfgr >> 2) & 3) {
+		case 0:
+			return 65536U << ((sim_rcc.ICSCR.value >> 13) & 7);
+		case 1:
+			return SIM_HSI_HZ;
+		case 2:
+			return SIM_HSE_HZ;
+		default: {
+			uint32_t source = (cfgr & (1<<16)) ? SIM_HSE_HZ : SIM_HSI_HZ;
+			uint32_t mul_index = (cfgr >> 18) & 15;
+			if (mul_index > 8) SimFault("PLLMUL value not allowed");
+			return (source * pll_mul[mul_index]) / (((cfgr >> 22) & 3) + 1);
+		}
+	}
+}
+
+static uint32_t SimHclkHz (void) {
+
+	static const uint16_t ahb_div[8] = {2, 4, 8, 16, 64, 128, 256, 512};
+	uint32_t hpre = (sim_rcc.CFGR.value >> 4) & 15;
+	return (hpre < 8) ? SimSysclkHz() : (SimSysclkHz() / ahb_div[hpre - 8]);
+}
+
+static uint32_t SimAPBHz (uint32_t ppre) {
+
+	return (ppre < 4) ? SimHclkHz() : (SimHclkHz() >> (ppre - 3));
+}
+
+static void SimClocksUpdate (void) {
+	/*
+	 * Called after every write into the RCC. The timers have been brought up to now with the old clock already (SimRunUntil runs before every write lands).
+	 *
+	 * */
+
+	uint32_t ppre1 = (sim_rcc.CFGR.value >> 8) & 7;
+	uint32_t ppre2 = (sim_rcc.CFGR.value >> 11) & 7;
+	uint32_t timer_hz = (ppre1 < 4) ? SimAPBHz(ppre1) : (SimAPBHz(ppre1) * 2);
+
+	core_period_ps = 1000000000000ULL / SimHclkHz();
+	pclk2_period_ps = 1000000000000ULL / SimAPBHz(ppre2);
+	timer_period_ps = 1000000000000ULL / timer_hz;
+}
+
+
+//3) SPI1 CRC
+static uint16_t SimCRC (uint16_t crc, uint16_t data, uint8_t bits) {
+	/*
+	 * CRC-8 for 8-bit frames, CRC-16 for 16-bit frames, MSB first, with the polynomial in CRCPR (the top bit is implied).
+	 *
+	 * */
+
+	uint32_t top = 1U << (bits - 1);
+	uint32_t mask = (bits == 16) ? 0xFFFF : 0xFF;
+	uint32_t value = (crc ^ data) & mask;
+	uint32_t polynomial = sim_spi1.CRCPR.value & mask;
+
+	for (uint8_t i = 0; i < bits; i++) {
+		value = (value & top) ? (((value << 1) ^ polynomial) & mask) : ((value << 1) & mask);
+	}
+	return (uint16_t) value;
+}
+
+
+//4) Put a frame on the bus
+static void SimSPIStartFrame (uint16_t data, uint8_t crc_frame, uint64_t start_ps) {
+	/*
+	 * The frame moves into the shift register, TXE goes HIGH. It ends after 8 or 16 SCK periods.
+	 * The TX CRC is calculated on the data frames as they are sent.
+	 *
+	 * */
+
+	uint32_t cr1 = sim_spi1.CR1.value;
+	uint8_t bits = (cr1 & (1<<11)) ? 16 : 8;
+	uint64_t sck_period_ps = (uint64_t)pclk2_period_ps << (((cr1 >> 3) & 7) + 1);
+
+	spi.shifting = 1;
+	spi.shift_crc = crc_frame;
+	spi.shift_data = data;
+	spi.shift_bits = bits;
+	spi.shift_end_ps = start_ps + (bits * sck_period_ps);
+	if ((spi_fault == SIM_SPI_FAULT_STALL) && (spi_fault_frames == 0)) {
+		spi.shift_end_ps = SIM_NO_EVENT;
+		spi.stalled = 1;
+		spi_fault = SIM_SPI_FAULT_NONE;
+	}
+	if (!crc_frame) {
+		spi.tx_full = 0;
+		if (cr1 & (1<<13)) spi.txcrc = SimCRC(spi.txcrc, data, bits);
+	}
+
+	sim_stats.frames++;
+	sim_stats.sck_edges += 2 * bits;
+	sim_stats.sck_busy_ps += bits * sck_period_ps;
+}
+
+static void SimSPITryStart (uint64_t start_ps) {
+	/*
+	 * A frame is started if SPI1 is an enabled master, the shift register is free and the TX buffer is loaded.
+	 *
+	 * */
+
+	uint32_t cr1 = sim_spi1.CR1.value;
+	if (spi.shifting || !spi.tx_full) return;
+	if ((cr1 & ((1<<6) | (1<<2))) != ((1<<6) | (1<<2))) return;
+	SimSPIStartFrame(spi.tx_data, 0, start_ps);
+}
+
+
+//5) Exchange a frame with the selected slave
+static uint16_t SimSPISlaveExchange (uint16_t mosi, uint8_t bits) {
+	/*
+	 * The slave sees bytes, MSB first, so a 16-bit frame is two bytes with the upper one first.
+	 * With no slave selected, MISO is pulled HIGH (0xFF). With more than one, the first one wins and the conflict is counted.
+	 *
+	 * */
+
+	SimSlave* slave = 0;
+	uint8_t selected = 0;
+	for (uint8_t i = 0; i < slave_count; i++) {
+		if (slaves[i]->selected) {
+			if (!slave) slave = slaves[i];
+			selected++;
+		}
+	}
+	if (selected > 1) sim_stats.bus_conflicts++;
+
+	uint8_t spi_mode = sim_spi1.CR1.value & 3;
+	if (bits == 16) {
+		uint16_t upper = slave ? slave->exchange(slave->context, (uint8_t)(mosi >> 8), spi_mode) : 0xFF;
+		uint16_t lower = slave ? slave->exchange(slave->context, (uint8_t) mosi, spi_mode) : 0xFF;
+		return (upper << 8) | lower;
+	}
+	return slave ? slave->exchange(slave->context, (uint8_t) mosi, spi_mode) : 0xFF;
+}
+
+
+//6) End of a frame
+static void SimSPIFrameDone (void) {
+	/*
+	 * What happens here?
+	 * The frame is exchanged with the slave, the reply goes into the RX buffer (RXNE). If RXNE was still HIGH, the reply is lost and OVR is set.
+	 * A CRC frame is not stored in the RX CRC: it is compared to it instead (CRCERR). CRCNEXT is cleared by the hardware after the CRC frame.
+	 * If CRCNEXT was set during the last data frame, the CRC frame follows at once. Otherwise the next frame starts if the TX buffer is loaded.
+	 * An injected OVR or MODF hits here, once the good frames before it are done.
+	 *
+	 * */
+
+	uint64_t end_ps = spi.shift_end_ps;
+	uint16_t miso = SimSPISlaveExchange(spi.shift_data, spi.shift_bits);
+	uint32_t cr1 = sim_spi1.CR1.value;
+	uint8_t fault = SIM_SPI_FAULT_NONE;
+
+	if (spi_fault != SIM_SPI_FAULT_NONE) {
+		if (spi_fault_frames) {
+			spi_fault_frames--;
+		} else if (spi_fault != SIM_SPI_FAULT_STALL) {
+			fault = spi_fault;
+			spi_fault = SIM_SPI_FAULT_NONE;
+		}
+	}
+
+	spi.shifting = 0;
+	if (spi.shift_crc) {
+		if (miso != spi.rxcrc) spi.crcerr = 1;
+		sim_spi1.CR1.value &= ~(1<<12);
+	} else if (cr1 & (1<<13)) {
+		spi.rxcrc = SimCRC(spi.rxcrc, miso, spi.shift_bits);
+	}
+
+	if (spi.rx_full || (fault == SIM_SPI_FAULT_OVR)) {
+		spi.ovr = 1;
+		spi.ovr_dr_read = 0;
+		sim_stats.overruns++;
+	} else {
+		spi.rx_data = miso;
+		spi.rx_full = 1;
+	}
+	if (fault == SIM_SPI_FAULT_MODF) {
+		spi.modf = 1;
+		sim_spi1.CR1.value &= ~((1<<6) | (1<<2));
+		return;
+	}
+
+	if (!spi.shift_crc && (cr1 & (1<<13)) && (cr1 & (1<<12)) && !spi.tx_full) {
+		SimSPIStartFrame(spi.txcrc, 1, end_ps);
+	} else {
+		SimSPITryStart(end_ps);
+	}
+}
+
+
+//7) SPI1 data register
+static void SimSPIWriteDR (uint16_t data) {
+
+	if (!(sim_spi1.CR1.value & (1<<11))) data &= 0xFF;
+	spi.tx_data = data;												//written while TXE is LOW, the TX buffer is simply overwritten
+	spi.tx_full = 1;
+	SimSPITryStart(now_ps);
+}
+
+static uint16_t SimSPIReadDR (void) {
+
+	if (spi.ovr) spi.ovr_dr_read = 1;
+	spi.rx_full = 0;
+	return spi.rx_data;
+}
+
+static uint32_t SimSPIReadSR (void) {
+	/*
+	 * BSY is HIGH while a frame is on the bus or waiting in the TX buffer.
+	 * Reading SR after a DR read clears OVR.
+	 *
+	 * */
+
+	uint32_t sr = 0;
+	if (spi.rx_full) sr |= (1<<0);
+	if (!spi.tx_full) sr |= (1<<1);
+	if (spi.crcerr) sr |= (1<<4);
+	if (spi.modf) sr |= (1<<5);
+	if (spi.ovr) sr |= (1<<6);
+	if (spi.shifting || (spi.tx_full && (sim_spi1.CR1.value & (1<<6)))) sr |= (1<<7);
+
+	if (spi.ovr && spi.ovr_dr_read) {
+		spi.ovr = 0;
+		spi.ovr_dr_read = 0;
+	}
+	return sr;
+}
+
+static void SimSPIReset (void) {
+	/*
+	 * RCC_APB2RSTR bit 12. Everything goes back to the reset values, a frame on the bus is dropped.
+	 *
+	 * */
+
+	memset(&spi, 0, sizeof(spi));
+	sim_spi1.CR1.value = 0;
+	sim_spi1.CR2.value = 0;
+	sim_spi1.CRCPR.value = 7;
+}
+
+static void SimSPIWriteCR1 (uint32_t data) {
+	/*
+	 * Toggling CRCEN resets both CRC registers. SSM with SSI LOW is a mode fault in master mode: MSTR and SPE are cleared by the hardware.
+	 *
+	 * */
+
+	uint32_t old = sim_spi1.CR1.value;
+	sim_spi1.CR1.value = data & 0xFFFF;
+	if ((old ^ data) & (1<<13)) {
+		spi.txcrc = 0;
+		spi.rxcrc = 0;
+	}
+	if ((data & (1<<2)) && (data & (1<<9)) && !(data & (1<<8))) {
+		spi.modf = 1;
+		sim_spi1.CR1.value &= ~((1<<6) | (1<<2));
+	}
+	SimSPITryStart(now_ps);
+}
+
+static uint32_t SimSPIRead (uint32_t offset) {
+
+	switch (offset) {
+		case 0x08: return SimSPIReadSR();
+		case 0x0C: return SimSPIReadDR();
+		case 0x14: return spi.rxcrc;
+		case 0x18: return spi.txcrc;
+		default: return ((SimReg*)((uint8_t*)&sim_spi1 + offset))->value;
+	}
+}
+
+static void SimSPIWrite (uint32_t offset, uint32_t data) {
+
+	switch (offset) {
+		case 0x00:
+			SimSPIWriteCR1(data);
+			break;
+		case 0x08:
+			if (!(data & (1<<4))) spi.crcerr = 0;					//CRCERR is rc_w0, the rest is read only
+			break;
+		case 0x0C:
+			SimSPIWriteDR((uint16_t) data);
+			break;
+		case 0x14:
+		case 0x18:
+			break;
+		default:
+			((SimReg*)((uint8_t*)&sim_spi1 + offset))->value = data & 0xFFFF;
+			break;
+	}
+}
+
+static uint8_t SimSPIIRQLine (void) {
+
+	uint32_t cr2 = sim_spi1.CR2.value;
+	if ((cr2 & (1<<7)) && !spi.tx_full) return 1;
+	if ((cr2 & (1<<6)) && spi.rx_full) return 1;
+	if ((cr2 & (1<<5)) && (spi.ovr || spi.modf || spi.crcerr)) return 1;
+	return 0;
+}
+
+
+//8) DMA1 channel 2 (SPI1_RX) and channel 3 (SPI1_TX)
+extern "C" char __executable_start, _end;								//image limits from the linker
+
+static void* SimPointer (uint32_t address) {
+	/*
+	 * The drivers store buffer addresses in the 32-bit CMAR. The host build is linked without PIE, so statics and globals are below 4 GB and the address is complete.
+	 * Buffers on the stack are not: we take the upper half of the address from the stack pointer.
+	 * An address inside the program image is always a static, whatever the stack looks like. Otherwise, the stack may straddle a 4 GB boundary,
+	 * so the upper halves next to the one of the stack pointer are tried as well and the one closest to the stack pointer is taken.
+	 *
+	 * */
+
+	if ((address >= (uint64_t)(uintptr_t)&__executable_start) && (address < (uint64_t)(uintptr_t)&_end)) return (void*)(uintptr_t) address;
+
+	uint8_t probe;
+	uint64_t stack = (uint64_t)(uintptr_t)&probe;
+	if (!(stack >> 32)) return (void*)(uintptr_t) address;
+
+	for (int64_t shift = -1; shift <= 1; shift++) {
+		uint64_t candidate = (((stack >> 32) + shift) << 32) | address;
+		uint64_t distance = (candidate > stack) ? (candidate - stack) : (stack - candidate);
+		if (distance < SIM_STACK_WINDOW) return (void*)(uintptr_t) candidate;
+	}
+	return (void*)(uintptr_t) address;
+}
+
+static void SimDMAFlag (uint8_t channel, uint32_t flag) {
+
+	sim_dma1.ISR.value |= ((flag | 1) << (4 * (channel - 1)));		//GIF goes with every flag
+}
+
+static uint8_t SimDMAStep (uint8_t channel) {
+	/*
+	 * One data item for the channel if it is enabled, has something left to do and the SPI request is active.
+	 * DIR 0 is peripheral to memory (RXNE request), DIR 1 is memory to peripheral (TXE request).
+	 *
+	 * */
+
+	DMA_Channel_TypeDef* regs = &sim_dma1_channel[channel];
+	SimDMAChannel* state = &dma_channel[channel];
+	uint32_t ccr = regs->CCR.value;
+	uint32_t cr2 = sim_spi1.CR2.value;
+	uint8_t request = (sim_dma1_cselr.CSELR.value >> (4 * (channel - 1))) & 15;
+	uint8_t wide = ((ccr >> 10) & 3) != 0;
+
+	if (!(ccr & (1<<0)) || (state->remaining == 0) || (request != 1)) return 0;
+
+	if (ccr & (1<<4)) {
+		if (channel != 3 || !(cr2 & (1<<1)) || spi.tx_full) return 0;
+		SimSPIWriteDR(wide ? *(uint16_t*)state->pointer : *state->pointer);
+	} else {
+		if (channel != 2 || !(cr2 & (1<<0)) || !spi.rx_full) return 0;
+		uint16_t data = SimSPIReadDR();
+		if (wide) *(uint16_t*)state->pointer = data; else *state->pointer = (uint8_t) data;
+	}
+
+	if (ccr & (1<<7)) state->pointer += wide ? 2 : 1;
+	state->remaining--;
+	sim_stats.dma_transfers++;
+
+	if (state->remaining == state->length / 2) SimDMAFlag(channel, (1<<2));
+	if (state->remaining == 0) {
+		SimDMAFlag(channel, (1<<1));
+		if (ccr & (1<<5)) {											//circular
+			state->remaining = state->length;
+			state->pointer = (uint8_t*) SimPointer(regs->CMAR.value);
+		}
+	}
+	return 1;
+}
+
+static void SimDMAService (void) {
+
+	while (SimDMAStep(2) | SimDMAStep(3));
+}
+
+static uint8_t SimDMAIRQLine (void) {
+	/*
+	 * TC, HT and TE each have their enable bit in CCR (TCIE 1, HTIE 2, TEIE 3), in the same order as the flags.
+	 *
+	 * */
+
+	for (uint8_t channel = 2; channel <= 3; channel++) {
+		uint32_t flags = (sim_dma1.ISR.value >> (4 * (channel - 1))) & 14;
+		if (flags & sim_dma1_channel[channel].CCR.value & 14) return 1;
+	}
+	return 0;
+}
+
+static uint32_t SimDMARead (DMA_Channel_TypeDef* regs, uint32_t offset) {
+
+	uint8_t channel = (uint8_t)(regs - sim_dma1_channel);
+	if ((offset == 0x04) && (regs->CCR.value & (1<<0))) return dma_channel[channel].remaining;
+	return ((SimReg*)((uint8_t*)regs + offset))->value;
+}
+
+static void SimDMAWrite (DMA_Channel_TypeDef* regs, uint32_t offset, uint32_t data) {
+	/*
+	 * The channel takes CNDTR and CMAR when it is enabled. CNDTR, CMAR and CPAR can't be written while the channel is on.
+	 *
+	 * */
+
+	uint8_t channel = (uint8_t)(regs - sim_dma1_channel);
+	uint32_t enabled = regs->CCR.value & (1<<0);
+
+	if (offset == 0x00) {
+		regs->CCR.value = data & 0x7FFF;
+		if (!enabled && (data & (1<<0))) {
+			dma_channel[channel].remaining = regs->CNDTR.value & 0xFFFF;
+			dma_channel[channel].length = dma_channel[channel].remaining;
+			dma_channel[channel].pointer = (uint8_t*) SimPointer(regs->CMAR.value);
+		}
+	} else if (!enabled) {
+		((SimReg*)((uint8_t*)regs + offset))->value = (offset == 0x04) ? (data & 0xFFFF) : data;
+	}
+}
+
+
+//9) Timers
+static void SimTimerUpdate (SimTimer* timer, uint8_t flag) {
+
+	timer->cnt = 0;
+	timer->psc_active = timer->regs->PSC.value & 0xFFFF;
+	if (flag) timer->regs->SR.value |= (1<<0);
+}
+
+static void SimTimerSync (SimTimer* timer, uint64_t target_ps) {
+	/*
+	 * We count the timer clocks since the last sync, then step the counter arithmetically. Every overflow past ARR is an update event.
+	 *
+	 * */
+
+	if (!(timer->regs->CR1.value & (1<<0))) {
+		timer->last_ps = target_ps;
+		return;
+	}
+	uint64_t clocks = (target_ps - timer->last_ps) / timer_period_ps;
+	timer->last_ps += clocks * timer_period_ps;
+
+	while (clocks) {
+		uint32_t divider = timer->psc_active + 1;
+		uint32_t arr = timer->regs->ARR.value & 0xFFFF;
+		uint32_t limit = (timer->cnt <= arr) ? arr : 0xFFFF;
+		uint64_t to_update = ((uint64_t)(limit - timer->cnt) * divider) + (divider - timer->psc_count);
+
+		if (clocks < to_update) {
+			uint64_t steps = (timer->psc_count + clocks) / divider;
+			timer->psc_count = (uint32_t)((timer->psc_count + clocks) % divider);
+			timer->cnt += (uint32_t) steps;
+			clocks = 0;
+		} else {
+			clocks -= to_update;
+			timer->psc_count = 0;
+			SimTimerUpdate(timer, 1);
+		}
+	}
+}
+
+static uint64_t SimTimerNextUpdate (SimTimer* timer) {
+
+	if (!(timer->regs->CR1.value & (1<<0))) return SIM_NO_EVENT;
+	uint32_t divider = timer->psc_active + 1;
+	uint32_t arr = timer->regs->ARR.value & 0xFFFF;
+	uint32_t limit = (timer->cnt <= arr) ? arr : 0xFFFF;
+	uint64_t to_update = ((uint64_t)(limit - timer->cnt) * divider) + (divider - timer->psc_count);
+	return timer->last_ps + (to_update * timer_period_ps);
+}
+
+static uint32_t SimTimerRead (SimTimer* timer, uint32_t offset) {
+
+	if (offset == 0x24) return timer->cnt;
+	if (offset == 0x14) return 0;									//EGR is write only
+	return ((SimReg*)((uint8_t*)timer->regs + offset))->value;
+}
+
+static void SimTimerWrite (SimTimer* timer, uint32_t offset, uint32_t data) {
+	/*
+	 * SR is rc_w0. UG in EGR re-initialises the counter and loads PSC, UIF is set unless URS is HIGH.
+	 *
+	 * */
+
+	switch (offset) {
+		case 0x00:
+			if (!(timer->regs->CR1.value & (1<<0))) timer->last_ps = now_ps;
+			timer->regs->CR1.value = data & 0x3FF;
+			break;
+		case 0x10:
+			timer->regs->SR.value &= data;
+			break;
+		case 0x14:
+			if (data & (1<<0)) {
+				timer->psc_count = 0;
+				SimTimerUpdate(timer, !(timer->regs->CR1.value & (1<<2)));
+			}
+			break;
+		case 0x24:
+			timer->cnt = data & 0xFFFF;
+			break;
+		default:
+			((SimReg*)((uint8_t*)timer->regs + offset))->value = data;
+			break;
+	}
+}
+
+
+//10) RCC and GPIO
+static void SimRCCWrite (uint32_t offset, uint32_t data) {
+	/*
+	 * Oscillators and the PLL are ready as soon as they are turned on. SWS follows SW at once.
+	 *
+	 * */
+
+	switch (offset) {
+		case 0x00: {
+			uint32_t ready = 0;
+			if (data & (1<<0)) ready |= (1<<2);
+			if (data & (1<<8)) ready |= (1<<9);
+			if (data & (1<<16)) ready |= (1<<17);
+			if (data & (1<<24)) ready |= (1<<25);
+			sim_rcc.CR.value = (data & ~((1<<2) | (1<<9) | (1<<17) | (1<<25))) | ready;
+			break;
+		}
+		case 0x0C:
+			sim_rcc.CFGR.value = (data & ~(3<<2)) | ((data & 3) << 2);
+			break;
+		case 0x24:
+			if (data & (1<<12)) SimSPIReset();
+			sim_rcc.APB2RSTR.value = data;
+			break;
+		default:
+			((SimReg*)((uint8_t*)&sim_rcc + offset))->value = data;
+			break;
+	}
+
+	SimClocksUpdate();
+	SystemCoreClockUpdate();
+}
+
+static void SimGPIOUpdate (GPIO_TypeDef* port) {
+	/*
+	 * A CS pin is only driven once it is an output. Before that, the pull-up keeps it HIGH.
+	 * Every change of a CS pin is passed on to the slave attached to it.
+	 *
+	 * */
+
+	for (uint8_t i = 0; i < slave_count; i++) {
+		SimSlave* slave = slaves[i];
+		if (slave->cs_port != port) continue;
+
+		uint8_t output = ((port->MODER.value >> (slave->cs_pin * 2)) & 3) == 1;
+		uint8_t level = output ? ((port->ODR.value >> slave->cs_pin) & 1) : 1;
+		if (!level && !slave->selected) {
+			if (spi.shifting) SimFault("CS pulled LOW in the middle of a frame");
+			slave->selected = 1;
+			if (slave->select) slave->select(slave->context);
+		} else if (level && slave->selected) {
+			if (spi.shifting && !spi.stalled) SimFault("CS released in the middle of a frame");
+			slave->selected = 0;
+			if (slave->deselect) slave->deselect(slave->context);
+		}
+	}
+}
+
+static uint32_t SimGPIORead (GPIO_TypeDef* port, uint32_t offset) {
+
+	switch (offset) {
+		case 0x10: return port->ODR.value;							//IDR: the pins we care about are outputs
+		case 0x18:
+		case 0x28: return 0;										//BSRR and BRR are write only
+		default: return ((SimReg*)((uint8_t*)port + offset))->value;
+	}
+}
+
+static void SimGPIOWrite (GPIO_TypeDef* port, uint32_t offset, uint32_t data) {
+
+	switch (offset) {
+		case 0x10:
+			break;
+		case 0x18:
+			port->ODR.value = (port->ODR.value & ~(data >> 16)) | (data & 0xFFFF);	//set wins over reset
+			break;
+		case 0x28:
+			port->ODR.value &= ~(data & 0xFFFF);
+			break;
+		default:
+			((SimReg*)((uint8_t*)port + offset))->value = data;
+			break;
+	}
+	SimGPIOUpdate(port);
+}
+
+
+//11) Register access dispatch
+#define SIM_INSIDE(reg, block)		(((uintptr_t)(reg) >= (uintptr_t)&(block)) && ((uintptr_t)(reg) < (uintptr_t)&(block) + sizeof(block)))
+#define SIM_OFFSET(reg, block)		((uint32_t)((uintptr_t)(reg) - (uintptr_t)&(block)))
+
+static GPIO_TypeDef* SimPort (SimReg* reg) {
+
+	if (SIM_INSIDE(reg, sim_gpioa)) return &sim_gpioa;
+	if (SIM_INSIDE(reg, sim_gpiob)) return &sim_gpiob;
+	if (SIM_INSIDE(reg, sim_gpioc)) return &sim_gpioc;
+	return 0;
+}
+
+static uint32_t SimRead (SimReg* reg) {
+
+	GPIO_TypeDef* port = SimPort(reg);
+	if (SIM_INSIDE(reg, sim_spi1)) return SimSPIRead(SIM_OFFSET(reg, sim_spi1));
+	if (SIM_INSIDE(reg, sim_tim6)) return SimTimerRead(&timer6, SIM_OFFSET(reg, sim_tim6));
+	if (SIM_INSIDE(reg, sim_tim2)) return SimTimerRead(&timer2, SIM_OFFSET(reg, sim_tim2));
+	if (SIM_INSIDE(reg, sim_dma1_channel)) {
+		DMA_Channel_TypeDef* regs = &sim_dma1_channel[SIM_OFFSET(reg, sim_dma1_channel) / sizeof(DMA_Channel_TypeDef)];
+		return SimDMARead(regs, SIM_OFFSET(reg, *regs));
+	}
+	if (port) return SimGPIORead(port, SIM_OFFSET(reg, *port));
+	if (reg == &sim_pwr.CSR) return 0;								//VOSF LOW - regulator ready
+	if (SIM_INSIDE(reg, sim_flash)) return SimFlashRead(SIM_OFFSET(reg, sim_flash));
+	return reg->value;
+}
+
+static void SimWrite (SimReg* reg, uint32_t data) {
+
+	GPIO_TypeDef* port = SimPort(reg);
+	if (SIM_INSIDE(reg, sim_spi1)) {
+		SimSPIWrite(SIM_OFFSET(reg, sim_spi1), data);
+	} else if (SIM_INSIDE(reg, sim_tim6)) {
+		SimTimerWrite(&timer6, SIM_OFFSET(reg, sim_tim6), data);
+	} else if (SIM_INSIDE(reg, sim_tim2)) {
+		SimTimerWrite(&timer2, SIM_OFFSET(reg, sim_tim2), data);
+	} else if (SIM_INSIDE(reg, sim_dma1_channel)) {
+		DMA_Channel_TypeDef* regs = &sim_dma1_channel[SIM_OFFSET(reg, sim_dma1_channel) / sizeof(DMA_Channel_TypeDef)];
+		SimDMAWrite(regs, SIM_OFFSET(reg, *regs), data);
+	} else if (reg == &sim_dma1.IFCR) {
+		for (uint8_t channel = 1; channel <= 7; channel++) {
+			uint32_t clear = (data >> (4 * (channel - 1))) & 15;
+			if (clear & 1) clear = 15;								//CGIF clears all flags of the channel
+			sim_dma1.ISR.value &= ~(clear << (4 * (channel - 1)));
+		}
+	} else if (reg == &sim_dma1.ISR) {
+		//read only
+	} else if (SIM_INSIDE(reg, sim_rcc)) {
+		SimRCCWrite(SIM_OFFSET(reg, sim_rcc), data);
+	} else if (SIM_INSIDE(reg, sim_flash)) {
+		SimFlashWrite(SIM_OFFSET(reg, sim_flash), data);
+	} else if (port) {
+		SimGPIOWrite(port, SIM_OFFSET(reg, *port), data);
+	} else {
+		reg->value = data;
+	}
+	SimDMAService();
+}
+
+SimReg::operator uint32_t () {
+	/*
+	 * The time moves on first: the value is what the bus sees at the end of the access.
+	 *
+	 * */
+
+	sim_stats.register_accesses++;
+	SimAdvance(SIM_ACCESS_CYCLES);
+	return SimRead(this);
+}
+
+SimReg& SimReg::operator= (uint32_t data) {
+
+	sim_stats.register_accesses++;
+	SimWrite(this, data);
+	SimAdvance(SIM_ACCESS_CYCLES);
+	return *this;
+}
+
+
+//12) Time
+static void SimRunUntil (uint64_t target_ps) {
+	/*
+	 * What happens here?
+	 * We step from event to event: every SPI frame end is handled at its own time, so the next frame starts exactly when the bus is free.
+	 * The timers are brought up to every step. The DMA is served after every step since a frame end or a timer can raise a request.
+	 *
+	 * */
+
+	while (1) {
+		uint64_t step_ps = target_ps;
+		if (spi.shifting && (spi.shift_end_ps < step_ps)) step_ps = spi.shift_end_ps;
+		if (step_ps < now_ps) step_ps = now_ps;
+
+		SimTimerSync(&timer6, step_ps);
+		SimTimerSync(&timer2, step_ps);
+		now_ps = step_ps;
+		sim_stats.time_ps = now_ps;
+
+		if (spi.shifting && (spi.shift_end_ps <= now_ps)) SimSPIFrameDone();
+		SimDMAService();
+		if (now_ps >= target_ps) break;
+	}
+}
+
+void SimAdvance (uint32_t cycles) {
+	/*
+	 * The core runs for cycles, then any pending IRQ is served.
+	 *
+	 * */
+
+	sim_stats.cycles += cycles;
+	sim_stats.busy_cycles += cycles;
+	if (irq_depth) sim_stats.irq_cycles += cycles;
+	SimRunUntil(now_ps + ((uint64_t)cycles * core_period_ps));
+	SimLatchIRQs();
+	SimDeliverIRQs();
+}
+
+uint64_t SimTimeNs (void) {
+
+	return now_ps / 1000;
+}
+
+
+//13) NVIC
+static uint8_t SimIRQLine (uint8_t irq) {
+
+	switch (irq) {
+		case SPI1_IRQn: return SimSPIIRQLine();
+		case DMA1_Channel2_3_IRQn: return SimDMAIRQLine();
+		case TIM6_DAC_IRQn: return (sim_tim6.SR.value & sim_tim6.DIER.value & (1<<0)) != 0;
+		case TIM2_IRQn: return (sim_tim2.SR.value & sim_tim2.DIER.value & (1<<0)) != 0;
+		default: return 0;
+	}
+}
+
+static void SimCallHandler (uint8_t irq) {
+
+	switch (irq) {
+		case SPI1_IRQn: SPI1_IRQHandler(); break;
+		case DMA1_Channel2_3_IRQn: DMA1_Channel2_3_IRQHandler(); break;
+		case TIM6_DAC_IRQn: TIM6_DAC_IRQHandler(); break;
+		case TIM2_IRQn: TIM2_IRQHandler(); break;
+		default: break;
+	}
+}
+
+static void SimLatchIRQs (void) {
+	/*
+	 * An IRQ line that is HIGH makes the IRQ pending, unless its handler is running. The request stays latched until the handler is entered or NVIC_ClearPendingIRQ is called,
+	 * so a flag that is cleared while the IRQ is held back still leads to a handler call.
+	 *
+	 * */
+
+	for (uint8_t i = 0; i < sizeof(sim_irq_lines); i++) {
+		uint8_t irq = sim_irq_lines[i];
+		if (!nvic_active[irq] && SimIRQLine(irq)) nvic_pending[irq] = 1;
+	}
+}
+
+static int SimPendingIRQ (uint32_t above_priority) {
+	/*
+	 * An IRQ is pending if it is latched or its line (flag and enable bit) is HIGH right now.
+	 * Of the pending ones, the highest priority (lowest value) wins, ties go to the lower IRQ number.
+	 *
+	 * */
+
+	int best = -1;
+	uint32_t best_priority = above_priority;
+	for (uint8_t i = 0; i < sizeof(sim_irq_lines); i++) {
+		uint8_t irq = sim_irq_lines[i];
+		if (!nvic_enabled[irq] || nvic_active[irq] || !(nvic_pending[irq] || SimIRQLine(irq))) continue;
+		if ((nvic_priority[irq] < best_priority) || ((best >= 0) && (nvic_priority[irq] == best_priority) && (irq < best))) {
+			best = irq;
+			best_priority = nvic_priority[irq];
+		}
+	}
+	return best;
+}
+
+static void SimDeliverIRQs (void) {
+	/*
+	 * What happens here?
+	 * We call the handler of the highest priority pending IRQ if it can preempt what is running, and repeat until there is none.
+	 * A handler entered from here runs on the host stack, so a higher priority IRQ can nest into it through its own register accesses.
+	 * A handler that doesn't clear its flag would be called forever - we stop the simulation instead, once 100000 calls have gone by without an SPI frame ending.
+	 * (A long IT transfer is served from here in one go: two IRQs per frame.)
+	 *
+	 * */
+
+	uint32_t calls = 0;
+	uint64_t frames = sim_stats.frames;
+	int irq;
+
+	while (!primask && ((irq = SimPendingIRQ(active_priority)) >= 0)) {
+		uint32_t saved_priority = active_priority;
+		uint32_t saved_ipsr = ipsr;
+
+		if (sim_stats.frames != frames) {
+			frames = sim_stats.frames;
+			calls = 0;
+		}
+		if (++calls > 100000) SimFault("IRQ flag never cleared");
+		active_priority = nvic_priority[irq];
+		ipsr = 16 + irq;
+		irq_depth++;
+		sim_stats.irqs++;
+		nvic_pending[irq] = 0;										//the pending state is cleared on entry
+		nvic_active[irq] = 1;
+
+		SimAdvance(SIM_IRQ_ENTRY_CYCLES);
+		SimCallHandler((uint8_t) irq);
+		nvic_active[irq] = 0;
+		SimAdvance(SIM_IRQ_EXIT_CYCLES);
+
+		irq_depth--;
+		ipsr = saved_ipsr;
+		active_priority = saved_priority;
+	}
+}
+
+void NVIC_EnableIRQ (IRQn_Type irq) {
+
+	nvic_enabled[irq & 31] = 1;
+	SimAdvance(SIM_ACCESS_CYCLES);
+}
+
+void NVIC_DisableIRQ (IRQn_Type irq) {
+
+	nvic_enabled[irq & 31] = 0;
+	SimAdvance(SIM_ACCESS_CYCLES);
+}
+
+void NVIC_ClearPendingIRQ (IRQn_Type irq) {
+
+	nvic_pending[irq & 31] = 0;
+	SimAdvance(SIM_ACCESS_CYCLES);
+}
+
+void NVIC_SetPriority (IRQn_Type irq, uint32_t priority) {
+
+	nvic_priority[irq & 31] = (uint8_t)(priority & 3);				//2 priority bits on the M0+
+	SimAdvance(SIM_ACCESS_CYCLES);
+}
+
+
+//14) Core intrinsics
+void __disable_irq (void) {
+
+	primask = 1;
+	SimAdvance(1);
+}
+
+void __enable_irq (void) {
+
+	primask = 0;
+	SimAdvance(1);
+}
+
+uint32_t __get_PRIMASK (void) {
+
+	SimAdvance(1);
+	return primask;
+}
+
+void __set_PRIMASK (uint32_t value) {
+
+	primask = value & 1;
+	SimAdvance(1);
+}
+
+uint32_t __get_IPSR (void) {
+
+	SimAdvance(1);
+	return ipsr;
+}
+
+void __NOP (void) {
+
+	SimAdvance(1);
+}
+
+void __DMB (void) {
+
+	SimAdvance(1);
+}
+
+void __WFI (void) {
+	/*
+	 * What happens here?
+	 * The core sleeps until an enabled IRQ is pending, even with PRIMASK set (it is then served once PRIMASK is cleared, same as on the M0+).
+	 * We jump from event to event (frame end, timer update) and count the time as sleep cycles - not busy.
+	 * If nothing can wake the core up, the program would hang forever on the board. We stop the simulation instead.
+	 *
+	 * */
+
+	uint64_t sleep_start_ps = now_ps;
+
+	while (SimPendingIRQ(primask ? SIM_THREAD_PRIORITY + 1 : active_priority) < 0) {
+		uint64_t wake_ps = SIM_NO_EVENT;
+		uint64_t event_ps;
+		if (spi.shifting) wake_ps = spi.shift_end_ps;
+		if ((event_ps = SimTimerNextUpdate(&timer6)) < wake_ps) wake_ps = event_ps;
+		if ((event_ps = SimTimerNextUpdate(&timer2)) < wake_ps) wake_ps = event_ps;
+		if ((wake_ps == SIM_NO_EVENT) || (now_ps - sleep_start_ps > SIM_WFI_LIMIT_PS)) SimFault("WFI with nothing to wake the core up");
+
+		uint64_t cycles = (wake_ps > now_ps) ? (((wake_ps - now_ps) + core_period_ps - 1) / core_period_ps) : 1;
+		sim_stats.cycles += cycles;
+		SimRunUntil(now_ps + (cycles * core_period_ps));
+		SimLatchIRQs();
+	}
+	SimAdvance(1);
+}
+
+
+//15) CMSIS system clock
+void SystemCoreClockUpdate (void) {
+
+	SystemCoreClock = SimHclkHz();
+}
+
+
+//16) Reset and slaves
+void SimReset (void) {
+	/*
+	 * Everything goes back to the reset state: MSI range 5 (2.097 MHz) is the system clock, all peripherals are at their reset values, time is 0.
+	 * Attached slaves remain attached but are deselected.
+	 *
+	 * */
+
+	memset((void*) &sim_spi1, 0, sizeof(sim_spi1));
+	memset((void*) &sim_gpioa, 0, sizeof(sim_gpioa));
+	memset((void*) &sim_gpiob, 0, sizeof(sim_gpiob));
+	memset((void*) &sim_gpioc, 0, sizeof(sim_gpioc));
+	memset((void*) &sim_rcc, 0, sizeof(sim_rcc));
+	memset((void*) &sim_tim2, 0, sizeof(sim_tim2));
+	memset((void*) &sim_tim6, 0, sizeof(sim_tim6));
+	memset((void*) &sim_dma1, 0, sizeof(sim_dma1));
+	memset((void*) sim_dma1_channel, 0, sizeof(sim_dma1_channel));
+	memset((void*) &sim_dma1_cselr, 0, sizeof(sim_dma1_cselr));
+	memset((void*) &sim_flash, 0, sizeof(sim_flash));
+	memset((void*) &sim_pwr, 0, sizeof(sim_pwr));
+	memset(dma_channel, 0, sizeof(dma_channel));
+	memset(nvic_enabled, 0, sizeof(nvic_enabled));
+	memset(nvic_priority, 0, sizeof(nvic_priority));
+	memset(nvic_pending, 0, sizeof(nvic_pending));
+	memset(nvic_active, 0, sizeof(nvic_active));
+	memset((void*) &sim_stats, 0, sizeof(sim_stats));
+
+	SimSPIReset();
+	sim_tim2.ARR.value = 0xFFFF;
+	sim_tim6.ARR.value = 0xFFFF;
+	timer2 = (SimTimer){&sim_tim2, 0, 0, 0, 0};
+	timer6 = (SimTimer){&sim_tim6, 0, 0, 0, 0};
+	sim_rcc.CR.value = (1<<8) | (1<<9);								//MSI on and ready
+	sim_rcc.ICSCR.value = (SIM_MSI_RESET_RANGE << 13);
+	sim_flash.PECR.value = 7;										//PELOCK, PRGLOCK, OPTLOCK
+	SimEEPROMMap();
+
+	now_ps = 0;
+	eeprom_busy_end_ps = 0;
+	eeprom_key_step = 0;
+	spi_fault = SIM_SPI_FAULT_NONE;
+	primask = 0;
+	active_priority = SIM_THREAD_PRIORITY;
+	ipsr = 0;
+	irq_depth = 0;
+	for (uint8_t i = 0; i < slave_count; i++) slaves[i]->selected = 0;
+
+	SimClocksUpdate();
+	SystemCoreClockUpdate();
+}
+
+void SimAttachSlave (SimSlave* slave) {
+
+	if (slave_count == SIM_SLAVES) SimFault("too many slaves");
+	slave->selected = 0;
+	slaves[slave_count++] = slave;
+	SimGPIOUpdate(slave->cs_port);
+}
+
+
+//17) Data EEPROM
+static void SimEEPROMMap (void) {
+	/*
+	 * The drivers access the EEPROM through plain pointers to its real address, so we put memory there. The host build is linked without PIE, nothing else lives at 0x08080000.
+	 * It is mapped once and keeps its content across SimReset.
+	 *
+	 * */
+
+	if (eeprom) return;
+	void* mapped = mmap((void*)(uintptr_t) SIM_EEPROM_START, SIM_EEPROM_WORDS * 4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (mapped != (void*)(uintptr_t) SIM_EEPROM_START) SimFault("data EEPROM can't be mapped at 0x08080000");
+	eeprom = (volatile uint32_t*) mapped;
+	memset(eeprom_shadow, 0, sizeof(eeprom_shadow));
+}
+
+static void SimEEPROMSync (void) {
+	/*
+	 * What happens here?
+	 * A store into the EEPROM is plain memory on the host, so we find it when the flash interface is accessed next (the driver polls SR right after the store).
+	 * Every word that differs from the programmed content is a write: with PELOCK HIGH, it is undone and WRPERR is set. Otherwise it is programmed, which keeps BSY HIGH for SIM_EEPROM_WRITE_PS.
+	 *
+	 * */
+
+	for (uint32_t i = 0; i < SIM_EEPROM_WORDS; i++) {
+		uint32_t word = eeprom[i];
+		if (word == eeprom_shadow[i]) continue;
+		if (sim_flash.PECR.value & (1<<0)) {
+			eeprom[i] = eeprom_shadow[i];
+			sim_flash.SR.value |= (1<<8);							//WRPERR
+			continue;
+		}
+		eeprom_shadow[i] = word;
+		eeprom_busy_end_ps = ((eeprom_busy_end_ps > now_ps) ? eeprom_busy_end_ps : now_ps) + SIM_EEPROM_WRITE_PS;
+		sim_stats.eeprom_writes++;
+	}
+}
+
+static uint32_t SimFlashRead (uint32_t offset) {
+
+	SimEEPROMSync();
+	if (offset == 0x18) {											//SR: BSY, the error flags
+		uint32_t sr = sim_flash.SR.value & ((1<<8) | (1<<9) | (1<<10));
+		if (now_ps < eeprom_busy_end_ps) sr |= (1<<0);
+		return sr;
+	}
+	return ((SimReg*)((uint8_t*)&sim_flash + offset))->value;
+}
+
+static void SimFlashWrite (uint32_t offset, uint32_t data) {
+	/*
+	 * PELOCK is set by writing it, cleared only by the key sequence in PEKEYR. A wrong key leaves it locked.
+	 * The error flags in SR are cleared by writing 1.
+	 *
+	 * */
+
+	SimEEPROMSync();
+	switch (offset) {
+		case 0x04:													//PECR
+			sim_flash.PECR.value = data | (sim_flash.PECR.value & (1<<0));
+			break;
+		case 0x0C:													//PEKEYR
+			if ((eeprom_key_step == 0) && (data == 0x89ABCDEF)) {
+				eeprom_key_step = 1;
+			} else if ((eeprom_key_step == 1) && (data == 0x02030405)) {
+				sim_flash.PECR.value &= ~(1<<0);
+				eeprom_key_step = 0;
+			} else {
+				eeprom_key_step = 0;
+			}
+			break;
+		case 0x18:													//SR
+			sim_flash.SR.value &= ~(data & ((1<<8) | (1<<9) | (1<<10)));
+			break;
+		default:
+			((SimReg*)((uint8_t*)&sim_flash + offset))->value = data;
+			break;
+	}
+}
+
+void SimEEPROMPoke (uint32_t address, uint32_t word) {
+	/*
+	 * Backdoor for the checks: the word is changed as if it had always been there (no programming time, no lock). Used to corrupt a record on purpose.
+	 *
+	 * */
+
+	uint32_t index = (address - SIM_EEPROM_START) / 4;
+	if (index >= SIM_EEPROM_WORDS) SimFault("EEPROM poke outside of the data EEPROM");
+	SimEEPROMMap();
+	eeprom[index] = word;
+	eeprom_shadow[index] = word;
+}
+
+//18) SPI1 fault injection
+void SimSPIInjectFault (uint8_t fault, uint32_t after_frames) {
+	/*
+	 * The fault hits once, after after_frames more frames have ended normally. A stalled frame keeps BSY HIGH until SPI1 is reset through RCC.
+	 * SIM_SPI_FAULT_NONE takes back a fault that hasn't hit yet.
+	 *
+	 * */
+
+	spi_fault = fault;
+	spi_fault_frames = after_frames;
+}
+
+//19) Host cycle counter
+uint32_t SimHostCycles (void) {
+	/*
+	 * The time stamp counter on x86 (close to the core cycles), ns on anything else. Only the difference of two readings means anything.
+	 *
+	 * */
+
+#if defined(__x86_64__) || defined(__i386__)
+	return (uint32_t) __builtin_ia32_rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(((uint64_t) now.tv_sec * 1000000000ULL) + now.tv_nsec);
+#endif
+}
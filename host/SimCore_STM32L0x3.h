@@ -0,0 +1,69 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8 - host simulation
+ *  HEader version: 1.0
+ *  File: SimCore_STM32L0x3.h
+ */
+
+#ifndef HOST_SIMCORE_H_
+#define HOST_SIMCORE_H_
+
+#include "stdint.h"
+#include "stm32l053xx.h"											//host register model
+
+//LOCAL CONSTANT
+#ifndef SIM_ACCESS_CYCLES
+#define SIM_ACCESS_CYCLES			4								//core clock cycles charged for a register access (the load/store over the APB bridge and the instructions around it)
+#endif
+#define SIM_IRQ_ENTRY_CYCLES		16								//Cortex-M0+ exception entry
+#define SIM_IRQ_EXIT_CYCLES			12								//exception return
+#define SIM_HSE_HZ					8000000							//HSE crystal (not used by the clock profiles)
+#define SIM_SLAVES					4								//slave models that can be attached to SPI1
+
+#define SIM_SPI_FAULT_NONE			0								//faults that can be injected into SPI1 (SimSPIInjectFault)
+#define SIM_SPI_FAULT_STALL			1								//SCK stops in the middle of the frame, it never ends
+#define SIM_SPI_FAULT_OVR			2								//the reply of the frame is lost, as if RXNE had still been HIGH
+#define SIM_SPI_FAULT_MODF			3								//mode fault at the end of the frame, SPE and MSTR are cleared
+
+//LOCAL TYPES
+typedef struct {
+	GPIO_TypeDef* cs_port;											//CS of the slave
+	uint8_t cs_pin;
+	void* context;													//passed back to the callbacks
+	void (*select)(void* context);									//CS went LOW
+	void (*deselect)(void* context);								//CS went HIGH
+	uint8_t (*exchange)(void* context, uint8_t mosi, uint8_t spi_mode);	//one byte on the bus, MSB first - gives back the MISO byte
+	uint8_t selected;
+} SimSlave;
+
+typedef struct {
+	uint64_t time_ps;												//simulated time since SimReset
+	uint64_t cycles;												//core clock cycles since SimReset
+	uint64_t busy_cycles;											//cycles the core was running (all but WFI)
+	uint64_t irq_cycles;											//cycles spent in IRQ handlers (entry and exit included)
+	uint64_t register_accesses;
+	uint64_t sck_edges;												//two per bit
+	uint64_t sck_busy_ps;											//time SCK was toggling
+	uint64_t frames;												//SPI1 frames, CRC frames included
+	uint64_t dma_transfers;											//DMA data items moved
+	uint64_t irqs;													//IRQ handler calls
+	uint32_t overruns;												//frames lost to OVR
+	uint32_t bus_conflicts;											//frames with more than one slave selected
+	uint32_t eeprom_writes;											//data EEPROM words programmed
+} SimStats;
+
+//EXTERNAL VARIABLE
+extern SimStats sim_stats;
+
+//FUNCTION PROTOTYPES
+void SimReset (void);
+void SimAttachSlave (SimSlave* slave);
+void SimAdvance (uint32_t cycles);
+uint64_t SimTimeNs (void);
+void SimFault (const char* message);
+void SimEEPROMPoke (uint32_t address, uint32_t word);
+void SimSPIInjectFault (uint8_t fault, uint32_t after_frames);
+
+#endif /* HOST_SIMCORE_H_ */
@@ -0,0 +1,152 @@
+/*
+ *  Created on: Nov 2, 2023
+ *  Author: BalazsFarkas
+ *  Project: STM32_SPIDriver
+ *  Processor: STM32L053R8 - host simulation
+ *  HEader version: 1.0
+ *  File: stm32l053xx.h
+ *
+ *  Host replacement of the CMSIS device header. Only the host build (host/Makefile) picks this file up.
+ *  Every register is a SimReg: reading or writing it calls the register model in SimCore_STM32L0x3.cpp instead of touching memory.
+ *  The register structs keep the layout of the real ones, so the offsets are the same as in the reference manual.
+ *  The drivers are compiled as C++ for this, since the register classes need operator overloading.
+ */
+
+#ifndef HOST_STM32L053XX_H_
+#define HOST_STM32L053XX_H_
+
+#include "stdint.h"
+
+//LOCAL TYPES
+class SimReg {
+public:
+	uint32_t value;													//storage of the register - only the model touches it directly
+
+	operator uint32_t ();											//read
+	SimReg& operator= (uint32_t data);								//write
+	SimReg& operator= (SimReg& other) { return *this = (uint32_t) other; }
+	SimReg& operator|= (uint32_t data) { return *this = ((uint32_t) *this | data); }
+	SimReg& operator&= (uint32_t data) { return *this = ((uint32_t) *this & data); }
+	SimReg& operator^= (uint32_t data) { return *this = ((uint32_t) *this ^ data); }
+};
+
+class SimRegAccess {
+	/*
+	 * In C, "(void) SPI1->DR;" reads the register. In C++, a discarded class object is never converted, so it would not be read.
+	 * DR is therefore handed out through this one-off object: if it is neither read nor written until the end of the statement, it is read in the destructor.
+	 *
+	 * */
+public:
+	SimRegAccess (SimReg* reg) : reg(reg), used(0) {}
+	~SimRegAccess () { if (!used) (void)(uint32_t) *reg; }
+	operator uint32_t () { used = 1; return (uint32_t) *reg; }
+	SimRegAccess& operator= (uint32_t data) { used = 1; *reg = data; return *this; }
+	SimRegAccess& operator|= (uint32_t data) { used = 1; *reg |= data; return *this; }
+	SimRegAccess& operator&= (uint32_t data) { used = 1; *reg &= data; return *this; }
+	SimReg* operator& () { used = 1; return reg; }
+private:
+	SimReg* reg;
+	uint8_t used;
+};
+
+typedef struct SPI_TypeDef {
+	SimReg CR1, CR2, SR, DR_reg, CRCPR, RXCRCR, TXCRCR, I2SCFGR, I2SPR;
+	SimRegAccess DR_access () { return SimRegAccess(&DR_reg); }
+} SPI_TypeDef;
+
+typedef struct GPIO_TypeDef {
+	SimReg MODER, OTYPER, OSPEEDR, PUPDR, IDR, ODR, BSRR, LCKR, AFR[2], BRR;
+} GPIO_TypeDef;
+
+typedef struct RCC_TypeDef {
+	SimReg CR, ICSCR, CRRCR, CFGR, CIER, CIFR, CICR, IOPRSTR, AHBRSTR, APB2RSTR, APB1RSTR, IOPENR, AHBENR, APB2ENR, APB1ENR;
+	SimReg IOPSMENR, AHBSMENR, APB2SMENR, APB1SMENR, CCIPR, CSR;
+} RCC_TypeDef;
+
+typedef struct TIM_TypeDef {
+	SimReg CR1, CR2, SMCR, DIER, SR, EGR, CCMR1, CCMR2, CCER, CNT, PSC, ARR, RESERVED0, CCR1, CCR2, CCR3, CCR4, RESERVED1, DCR, DMAR, OR;
+} TIM_TypeDef;
+
+typedef struct DMA_TypeDef {
+	SimReg ISR, IFCR;
+} DMA_TypeDef;
+
+typedef struct DMA_Channel_TypeDef {
+	SimReg CCR, CNDTR, CPAR, CMAR;
+} DMA_Channel_TypeDef;
+
+typedef struct DMA_Request_TypeDef {
+	SimReg CSELR;
+} DMA_Request_TypeDef;
+
+typedef struct FLASH_TypeDef {
+	SimReg ACR, PECR, PDKEYR, PEKEYR, PRGKEYR, OPTKEYR, SR, OPTR, WRPR;
+} FLASH_TypeDef;
+
+typedef struct PWR_TypeDef {
+	SimReg CR, CSR;
+} PWR_TypeDef;
+
+typedef enum {
+	DMA1_Channel1_IRQn = 9,
+	DMA1_Channel2_3_IRQn = 10,
+	TIM2_IRQn = 15,
+	TIM6_DAC_IRQn = 17,
+	SPI1_IRQn = 25,
+	USART2_IRQn = 28
+} IRQn_Type;
+
+//EXTERNAL VARIABLE
+extern SPI_TypeDef sim_spi1;
+extern GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+extern RCC_TypeDef sim_rcc;
+extern TIM_TypeDef sim_tim2, sim_tim6;
+extern DMA_TypeDef sim_dma1;
+extern DMA_Channel_TypeDef sim_dma1_channel[8];						//index is the channel number, 0 is not used
+extern DMA_Request_TypeDef sim_dma1_cselr;
+extern FLASH_TypeDef sim_flash;
+extern PWR_TypeDef sim_pwr;
+extern uint32_t SystemCoreClock;
+
+//LOCAL CONSTANT
+#define SPI1						(&sim_spi1)
+#define GPIOA						(&sim_gpioa)
+#define GPIOB						(&sim_gpiob)
+#define GPIOC						(&sim_gpioc)
+#define RCC							(&sim_rcc)
+#define TIM2						(&sim_tim2)
+#define TIM6						(&sim_tim6)
+#define DMA1						(&sim_dma1)
+#define DMA1_Channel2				(&sim_dma1_channel[2])
+#define DMA1_Channel3				(&sim_dma1_channel[3])
+#define DMA1_CSELR					(&sim_dma1_cselr)
+#define FLASH						(&sim_flash)
+#define PWR							(&sim_pwr)
+
+#define DR							DR_access()						//see SimRegAccess
+
+#define RCC_CFGR_HPRE_DIV1			(0U<<4)
+#define RCC_CFGR_PPRE1_DIV4			(5U<<8)
+#define RCC_CFGR_PPRE2_DIV2			(4U<<11)
+#define RCC_CFGR_SWS				(3U<<2)
+#define RCC_CFGR_SWS_PLL			(3U<<2)
+
+#define BMP280_BENCHMARK_CYCLES()	SimHostCycles()					//compute-only code costs no simulated time, the compensation benchmark runs on the host clock
+
+//FUNCTION PROTOTYPES
+void SystemCoreClockUpdate (void);
+void NVIC_EnableIRQ (IRQn_Type irq);
+void NVIC_DisableIRQ (IRQn_Type irq);
+void NVIC_SetPriority (IRQn_Type irq, uint32_t priority);
+void NVIC_ClearPendingIRQ (IRQn_Type irq);
+void __disable_irq (void);
+void __enable_irq (void);
+uint32_t __get_PRIMASK (void);
+void __set_PRIMASK (uint32_t primask);
+uint32_t __get_IPSR (void);
+void __WFI (void);
+void __NOP (void);
+void __DMB (void);
+uint32_t SimHostCycles (void);
+
+#endif /* HOST_STM32L053XX_H_ */
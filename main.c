@@ -32,6 +32,13 @@
 /* USER CODE BEGIN Includes */
 
 #include "SPIDriver_STM32L0x3.h"
+#include "BMP280Driver_STM32L0x3.h"
+#include "SPIBenchmark_STM32L0x3.h"
+#include "SampleBuffer_STM32L0x3.h"
+#include "BMP280Stream_STM32L0x3.h"
+#include "UARTOutput_STM32L0x3.h"
+#include "BMP280Multi_STM32L0x3.h"
+#include "SPIReadPlan_STM32L0x3.h"
 
 /* USER CODE END Includes */
 
@@ -42,6 +49,13 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+#define SAMPLE_RATE_HZ				1															//acquisitions per second
+//#define RUN_SPI_BENCHMARK																//uncomment to publish the SPI driver measurements at startup
+//#define CONTINUOUS_ACQUISITION															//uncomment to log at STREAM_RATE_HZ using the double-buffered stream
+#define STREAM_RATE_HZ				100															//acquisitions per second in continuous mode
+//#define MULTI_SENSOR_SAMPLING																	//uncomment to sample the BMP280 on PB6 and a second one on SECOND_SENSOR_CS_PIN in staggered forced mode
+#define SECOND_SENSOR_CS_PIN		5															//CS of the second BMP280 on port B
+#define OUTPUT_POLICY				UART_OUTPUT_DROP											//printf policy once the acquisition runs: UART_OUTPUT_DROP or UART_OUTPUT_BLOCK
 
 /* USER CODE END PD */
 
@@ -54,6 +68,22 @@
 UART_HandleTypeDef huart2;
 
 /* USER CODE BEGIN PV */
+SampleBuffer sample_buffer;																//raw samples between the acquisition and the output
+const uint8_t acquisition_command[BMP280_DATA_LENGTH + 1] = {BMP280_REG_DATA, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};	//address, then dummies for the data block
+uint8_t acquisition_block[BMP280_DATA_LENGTH + 1];										//DMA target of the readout: the reply to the address (junk), then the data block
+BMP280 sensor;
+volatile uint32_t acquisition_errors = 0;												//data blocks lost to a failed DMA transfer (or start)
+volatile uint32_t acquisition_missed = 0;												//periods where the bus was still busy
+BMP280Stream acquisition_stream;														//ping-pong buffer of the continuous mode
+BMP280Sample stream_samples[BMP280_STREAM_SAMPLES];
+BMP280 second_sensor;
+uint8_t snapshot_id, snapshot_status, snapshot_ctrl[2], snapshot_data[BMP280_DATA_LENGTH];
+const SPI1Field snapshot_map[4] = {{BMP280_REG_ID, 1, &snapshot_id}, {BMP280_REG_STATUS, 1, &snapshot_status},
+		{BMP280_REG_CTRL_MEAS, 2, snapshot_ctrl}, {BMP280_REG_DATA, BMP280_DATA_LENGTH, snapshot_data}};	//register map of the sensor snapshot
+SPI1ReadPlan snapshot_plan;
+BMP280Multi multi_sampler;																//staggered forced mode sampling of both sensors
+SoftTimer multi_period_timer;															//starts a multi-sensor cycle every period
+volatile uint8_t multi_period_due = 0;
 
 /* USER CODE END PV */
 
@@ -71,24 +101,53 @@ static void MX_USART2_UART_Init(void);
 //retarget printf to the CubeIDE serial port
 int _write(int file, char *ptr, int len)
 {
-	int DataIdx;
-	for (DataIdx = 0; DataIdx < len; DataIdx++) {
-		HAL_UART_Transmit(&huart2, (uint8_t *)ptr++, 1, 100);			//here we pass the dereferenced pointer, one byte is sent over with a timeout of 100, using the huart2 settings
-	}
-	return len;
+	return UARTOutputWrite((uint8_t *)ptr, len);										//the characters are only copied into the output buffer, USART2 IRQ sends them out in the background
 }
 
 
 
-//BMP280 temperature compensation calculation for fixed point results
-int32_t compensate_temperature(int32_t sensor_adc_readout, uint16_t dig_T1, int16_t dig_T2, int16_t dig_T3) {
+//clock change hook: the UART baud rate and the HAL tick are recalculated for the new clock
+void HALClockChanged(void)
+{
+	USART2->BRR = ClockAPB1Hz() / huart2.Init.BaudRate;									//oversampling by 16
+	HAL_InitTick(uwTickPrio);															//SysTick reload from the new SystemCoreClock
+}
+
 
-	int32_t var1, var2;
 
-	var1 = ((((sensor_adc_readout >> 3) - (dig_T1 << 1)))	* dig_T2) >> 11;
-	var2 = (((((sensor_adc_readout >> 4) - dig_T1) * ((sensor_adc_readout >> 4) - dig_T1)) >> 12) * dig_T3) >> 14;
+//acquisition side: called from the DMA IRQ once the data block is in
+void AcquisitionDone(void)
+{
+	if (SPI1_DMA_error) {
+		SPI1_DMA_error = 0;
+		acquisition_errors++;															//the block is partial or stale, it must not be published
+		return;
+	}
+
+	RawSample raw;
+	raw.timestamp = TIM6Now();
+	BMP280ParseData(&acquisition_block[1], &raw.adc_P, &raw.adc_T);
+	SampleBufferPush(&sample_buffer, &raw);											//if the output is lagging behind, the sample is dropped and counted
+}
+
+//acquisition trigger: called from the TIM2 IRQ at SAMPLE_RATE_HZ
+//the address goes out through the DMA too (same as BMP280Stream), so nothing is polled in the IRQ
+void AcquisitionTick(void)
+{
+	if (SPI1_DMA_busy || SPI1_IT_busy) {
+		acquisition_missed++;															//we must not wait for the bus in an IRQ
+		return;
+	}
+	SPI1DeviceSelect(&sensor.device);
+	if (SPI1MasterExchangeDMA(acquisition_command, acquisition_block, BMP280_DATA_LENGTH + 1, sensor.device.cs_port, sensor.device.cs_pin, AcquisitionDone)) {
+		acquisition_errors++;															//nothing was started, no callback will come
+	}
+}
 
-	return ((var1 + var2) * 5 + 128) >> 8;
+//multi-sensor trigger: called from the TIM6 IRQ at SAMPLE_RATE_HZ
+void MultiPeriodElapsed(void)
+{
+	multi_period_due = 1;																//the cycle itself runs in the main loop
 }
 
 /* USER CODE END 0 */
@@ -126,20 +185,63 @@ int main(void)
   MX_USART2_UART_Init();
 
   /* USER CODE BEGIN 2 */
+  UARTOutputInit(UART_OUTPUT_BLOCK);													//buffered printf, nothing is lost during the setup and the benchmarks
   SPI1MasterInit(GPIOB, 6);																//we initialise SPI1 as master peripheral
+  SPI1DMAInit();																		//DMA for the background acquisition
+  ClockRegisterHook(SPI1ClockChanged);													//SPI prescalers follow the clock profile
+  ClockRegisterHook(HALClockChanged);
+  SampleBufferInit(&sample_buffer);
+
+  BMP280Init(&sensor, GPIOB, 6);														//BMP280 with external CS/SS on PB6
+
+  uint8_t chip_id = BMP280ReadID(&sensor);												//we read out the sensor ID from the sensor
+  printf("Custom readout for device id is 0x%x \r\n", chip_id);
+
+  if (BMP280Reset(&sensor)) printf("Sensor reset failed \r\n");							//we send a reset sensor message
+  BMP280WaitReady(&sensor, BMP280_STATUS_IM_UPDATE);									//we wait until the sensor has loaded its calibration data after the reset
+  BMP280Configure(&sensor, 0x27, 0x00);													//we use the standard run mode, no filter, 0.5 ms standby
+  BMP280LoadCalibration(&sensor, chip_id);												//calibration from the data EEPROM, or one burst from the sensor if the cache is not valid
+  printf("Calibration loaded from the %s \r\n", sensor.calib_from_cache ? "data EEPROM" : "sensor");
+
+  if (!SPI1PlanBuild(&snapshot_plan, snapshot_map, 4)) {								//ID, status, ctrl_meas/config and data block merged into bursts
+    printf("Read plan does not fit \r\n");
+  } else if (SPI1PlanExecute(&sensor.device, &snapshot_plan)) {
+    printf("Snapshot read failed \r\n");
+  } else {
+    printf("Snapshot: id 0x%x, status 0x%x, ctrl_meas 0x%x, config 0x%x \r\n", snapshot_id, snapshot_status, snapshot_ctrl[0], snapshot_ctrl[1]);
+    printf("Read plan: %d transactions instead of %d, %d bytes instead of %d \r\n", snapshot_plan.burst_count, snapshot_plan.naive_transactions,
+			snapshot_plan.planned_bytes, snapshot_plan.naive_bytes);
+  }
 
-  uint8_t reset_sensor_msg[2] = {0x60, 0xB6};											//SPI message array. First element is the address of the register we write to, second is the desired message.
-  uint8_t reply_id_msg[2] = {0xD0, 0xFF};												//we store the address at [0] and leave the rest of the buffer empty for incoming data
-  uint8_t std_setup[2] = {0x74, 0x27};													//standard function setup
-  	  	  	  	  	  	  	  	  	  	  	  	  	  	  	  	  	  	  	  	  	  	//Note: 0x74 is 0xF4 without the MSB
-
-  SPI1MasterRead (reply_id_msg[0], &reply_id_msg[1], 1, GPIOB, 6);						//we read out the sensor ID from the sensor
-  printf("Custom readout for device id is 0x%x \r\n", reply_id_msg[1]);
-
-  SPI1MasterWrite(reset_sensor_msg[0], &reset_sensor_msg[1], 1, GPIOB, 6);				//we send a reset sensor message by publishing the reset array. External CS/SS will be on PB6.
-  Delay_us(100);
-  SPI1MasterWrite(std_setup[0], &std_setup[1], 1, GPIOB, 6);							//we use the standard run mode
-  Delay_us(100);
+#ifdef MULTI_SENSOR_SAMPLING
+  BMP280Init(&second_sensor, GPIOB, SECOND_SENSOR_CS_PIN);
+  BMP280Reset(&second_sensor);
+  BMP280WaitReady(&second_sensor, BMP280_STATUS_IM_UPDATE);
+  BMP280ReadCalibration(&second_sensor);												//the EEPROM cache holds the first sensor only
+  BMP280* multi_sensors[2] = {&sensor, &second_sensor};
+  BMP280MultiInit(&multi_sampler, multi_sensors, 2, 0x24);								//x1 oversampling, forced mode
+#endif
+
+#ifdef RUN_SPI_BENCHMARK
+  SPI1BenchmarkStream(&sensor.device, BMP280_REG_CALIB);								//polling versus streaming reads
+  BMP280BenchmarkCompensation(&sensor.calib);											//batch compensation versus the datasheet formulas
+  SPI1BenchmarkSuite(&sensor.device, BMP280_REG_CALIB, 0x7F, 0x7F);					//all modes, reads and writes (writes only hit the reserved 0xFF register)
+  SPI1BenchmarkStatic(&sensor.device, BMP280_REG_DATA);									//run-time versus compile-time specialised 6-byte reads
+#endif
+
+#if SPI1_INSTRUMENTATION
+  SPI1StatsPrint();																		//latency and poll loop statistics of the setup transactions
+#endif
+
+  uart_output.policy = OUTPUT_POLICY;													//from here on, logging must not hold up the acquisition
+
+#if defined(CONTINUOUS_ACQUISITION)
+  BMP280StreamStart(&acquisition_stream, &sensor, STREAM_RATE_HZ, 0);					//continuous acquisition from here on
+#elif defined(MULTI_SENSOR_SAMPLING)
+  TIM6TimerStart(&multi_period_timer, 0, (1000000 / SAMPLE_RATE_HZ), MultiPeriodElapsed);	//the sensors are triggered from the main loop, once per period
+#else
+  TIM2PeriodicConfig(SAMPLE_RATE_HZ, AcquisitionTick);									//acquisition is scheduled from here on
+#endif
 
   /* USER CODE END 2 */
 
@@ -148,45 +250,82 @@ int main(void)
   while (1)
   {
 
-	//we define the SPI message matrices (see datasheet)
-	//Note: we will be doing a one-by-one swap and use the same matrices to store the extracted values. We can do this since reading from the SPI is a write followed by a read.
-
-	uint8_t T_comp[6] = {0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D};							//this is where the temperature compensation parameters are
-	uint8_t T_out[3] = {0xFA, 0xFB, 0xFC};												//this is where the ADC temp values will go
-
-	//BMP280 temperature coefficient readout
-	SPI1MasterRead(T_comp[0], &T_comp[0], 1, GPIOB, 6);
-	Delay_us(100);
-	SPI1MasterRead(T_comp[1], &T_comp[1], 1, GPIOB, 6);
-	Delay_us(100);
-	SPI1MasterRead(T_comp[2], &T_comp[2], 1, GPIOB, 6);
-	Delay_us(100);
-	SPI1MasterRead(T_comp[3], &T_comp[3], 1, GPIOB, 6);
-	Delay_us(100);
-	SPI1MasterRead(T_comp[4], &T_comp[4], 1, GPIOB, 6);
-	Delay_us(100);
-	SPI1MasterRead(T_comp[5], &T_comp[5], 1, GPIOB, 6);
-	Delay_us(100);
-
-	//BMP280 temperature ADC readout
-	SPI1MasterRead(T_out[0], &T_out[0], 1, GPIOB, 6);
-	Delay_us(100);
-	SPI1MasterRead(T_out[1], &T_out[1], 1, GPIOB, 6);
-	Delay_us(100);
-	SPI1MasterRead(T_out[1], &T_out[2], 1, GPIOB, 6);
-
-	//We rebuild the parameters from the readout
-	uint16_t dig_T1 = (T_comp[1] << 8) | T_comp[0];
-	int16_t dig_T2 = (T_comp[3] << 8) | T_comp[2];
-	int16_t dig_T3 = (T_comp[5] << 8) | T_comp[4];
-
-
-	int32_t adc_T = (T_out[0] << 12) | (T_out[1] << 4) | (T_out[2]>>4);						//we rebuild the 20 bit temperature value
-	int32_t temperature = compensate_temperature(adc_T, dig_T1, dig_T2, dig_T3);
-
-	printf("Temperature measured from the device is %i.%i degrees Celsius \r\n", (temperature / 100), (temperature - (temperature / 100) * 100));
+#if defined(CONTINUOUS_ACQUISITION)
+	//acquisition: TIM2 starts a DMA burst into the ping-pong buffer every period
+	//output: whenever a half is full, we compensate it in one batch and publish the average
+	int8_t half;
+	while ((half = BMP280StreamPending(&acquisition_stream)) >= 0) {
+		BMP280StreamParse(&acquisition_stream, half, stream_samples);
+		BMP280StreamRelease(&acquisition_stream, half);									//the half can be filled again while we compensate
+		BMP280CompensateBatch(&sensor.calib, stream_samples, BMP280_STREAM_SAMPLES);
+
+		int32_t temperature_sum = 0;
+		uint32_t pressure_sum = 0;
+		for (uint8_t i = 0; i < BMP280_STREAM_SAMPLES; i++) {
+			temperature_sum += stream_samples[i].temperature;
+			pressure_sum += stream_samples[i].pressure >> 8;							//Q24.8 to Pa
+		}
+		int32_t temperature = temperature_sum / BMP280_STREAM_SAMPLES;
+		uint32_t pressure = pressure_sum / BMP280_STREAM_SAMPLES;
+
+		printf("Average of %d samples: %i.%i degrees Celsius, %lu.%02lu hPa \r\n", BMP280_STREAM_SAMPLES, (temperature / 100), (temperature - (temperature / 100) * 100),
+				(unsigned long)(pressure / 100), (unsigned long)(pressure % 100));
+		printf("Halves: %lu, missed periods: %lu, overruns: %lu, errors: %lu \r\n", (unsigned long)acquisition_stream.halves_completed,
+				(unsigned long)acquisition_stream.missed_periods, (unsigned long)acquisition_stream.overruns, (unsigned long)acquisition_stream.errors);
+		printf("Output dropped: %lu bytes, high water mark: %lu \r\n", (unsigned long)uart_output.dropped, (unsigned long)uart_output.high_water_mark);
+	}
+
+	__disable_irq();
+	if (BMP280StreamPending(&acquisition_stream) < 0) __WFI();
+	__enable_irq();
+#elif defined(MULTI_SENSOR_SAMPLING)
+	//acquisition: all sensors convert at the same time, each is read out as soon as it is done
+	//output: we publish the samples and the cycle time, then sleep until the next period
+	//Note: the check and the WFI are done with IRQs masked so the TIM6 expiry can't be missed in between
+	__disable_irq();
+	if (!multi_period_due) __WFI();
+	__enable_irq();
+	if (!multi_period_due) continue;													//woken up by another IRQ (TIM6 ms tick, USART2, SysTick)
+	multi_period_due = 0;
+
+	uint8_t valid = BMP280MultiCycle(&multi_sampler);
+	for (uint8_t i = 0; i < multi_sampler.count; i++) {
+		if (!(valid & (1<<i))) continue;
+		int32_t temperature = multi_sampler.samples[i].temperature;
+		uint32_t pressure = multi_sampler.samples[i].pressure >> 8;						//Q24.8 to Pa
+		printf("Sensor %d: %i.%i degrees Celsius, %lu.%02lu hPa \r\n", i, (temperature / 100), (temperature - (temperature / 100) * 100),
+				(unsigned long)(pressure / 100), (unsigned long)(pressure % 100));
+	}
+	printf("Cycle: %lu us (one conversion: %lu us), status polls: %lu, timeouts: %lu, errors: %lu \r\n", (unsigned long)multi_sampler.cycle_us,
+			(unsigned long)multi_sampler.conversion_us, (unsigned long)multi_sampler.status_polls, (unsigned long)multi_sampler.timeouts, (unsigned long)multi_sampler.errors);
 	printf(" \r\n");
-	Delay_ms(1000);
+#else
+	//acquisition: TIM2 starts the data block readout in the background, the DMA callback puts it into the sample buffer
+	//output: we drain the sample buffer, compensate and publish
+	BMP280Sample sample;
+	RawSample raw;
+	while (SampleBufferPop(&sample_buffer, &raw)) {
+		sample.adc_T = raw.adc_T;
+		sample.adc_P = raw.adc_P;
+		BMP280CompensateBatch(&sensor.calib, &sample, 1);
+		int32_t temperature = sample.temperature;
+		uint32_t pressure = sample.pressure >> 8;										//Q24.8 to Pa
+
+		printf("Temperature measured from the device is %i.%i degrees Celsius \r\n", (temperature / 100), (temperature - (temperature / 100) * 100));
+		printf("Pressure measured from the device is %lu.%02lu hPa \r\n", (unsigned long)(pressure / 100), (unsigned long)(pressure % 100));
+		printf("Sample buffer overflows: %lu, high water mark: %lu \r\n", (unsigned long)sample_buffer.overflow_count, (unsigned long)sample_buffer.high_water_mark);
+		printf("Schedule jitter: %lu us, missed periods: %lu, errors: %lu \r\n", (unsigned long)(TIM2_stats.latency_max_us - TIM2_stats.latency_min_us), (unsigned long)acquisition_missed,
+				(unsigned long)acquisition_errors);
+		printf("Output dropped: %lu bytes, high water mark: %lu \r\n", (unsigned long)uart_output.dropped, (unsigned long)uart_output.high_water_mark);
+		printf(" \r\n");
+	}
+
+	//sleep until the next IRQ (TIM2, DMA, USART2 or SysTick)
+	//Note: the check and the WFI are done with IRQs masked so a sample arriving in between can't be missed. A pending IRQ still wakes up the core.
+	__disable_irq();
+	if (SampleBufferLevel(&sample_buffer) == 0) __WFI();
+	__enable_irq();
+#endif
 
     /* USER CODE END WHILE */
 